@@ -30,6 +30,9 @@ OP_STORE_G       = 0b0001_0001_0000_0000_0000_0000_0000_0000
 OP_NOT           = 0b0001_0010_0000_0000_0000_0000_0000_0000
 OP_MAPSET        = 0b0001_0011_0000_0000_0000_0000_0000_0000
 OP_NEWMAP        = 0b0001_0100_0000_0000_0000_0000_0000_0000
+OP_LOAD_GLOBAL_C = 0b0001_0101_0000_0000_0000_0000_0000_0000
+OP_INVOKE_G      = 0b0001_0110_0000_0000_0000_0000_0000_0000
+OP_INVOKE_G_TAIL = 0b0001_0111_0000_0000_0000_0000_0000_0000
 
 # Constant structure -
 # [Tag - 8 bits, Variable length depending on tag ...]
@@ -165,6 +168,23 @@ def main():
         argument_count = next_int()
         emit(OP_INVOKE | Arg1(base_reg) | Arg2(argument_count))
 
+    def load_global_constant():
+        dest_reg = next_register()
+        const_number = next_int()
+        emit(OP_LOAD_GLOBAL_C | Arg1(dest_reg) | LargeArg(const_number))
+
+    def invoke_global():
+        base_reg = next_register()
+        argument_count = next_int()
+        const_number = next_int()
+        emit(OP_INVOKE_G | Arg1(base_reg) | Arg2(argument_count) | Arg3(const_number))
+
+    def invoke_global_tail():
+        base_reg = next_register()
+        argument_count = next_int()
+        const_number = next_int()
+        emit(OP_INVOKE_G_TAIL | Arg1(base_reg) | Arg2(argument_count) | Arg3(const_number))
+
     def op_newmap():
         base_reg = next_register()
         emit(OP_NEWMAP | Arg1(base_reg))
@@ -283,6 +303,9 @@ def main():
         'loadc': load_constant,
         'loadg': load_global,
         'invoke': invoke,
+        'loadgc': load_global_constant,
+        'invokeg': invoke_global,
+        'invokegtail': invoke_global_tail,
         'string': string,
         'function': function,
         'end': endfunction,
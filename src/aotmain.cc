@@ -0,0 +1,16 @@
+#include "espresso.hh"
+
+int main(int argc, char** argv) {
+
+    if (argc != 3) {
+        std::fprintf(stderr, "usage: espresso-aot <script> <output.cc>\n");
+        return 2;
+    }
+
+    const char* loadPath = ".";
+
+    espresso::DefaultSystem system;
+    espresso::Espresso espresso{&system, loadPath};
+
+    return espresso.Translate(argv[1], argv[2]);
+}
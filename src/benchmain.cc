@@ -0,0 +1,268 @@
+#include "ert.hh"
+
+// espresso_bench [repetitions] runs the benchmarks of lib/bench and writes
+// what they measure as JSON to stdout, so that regressions can be tracked.
+// Every benchmark gets a runtime of its own and is warmed up before it is
+// measured.
+
+namespace {
+
+using espresso::DefaultSystem;
+using espresso::Integer;
+using espresso::Runtime;
+using espresso::System;
+using espresso::ThrowException;
+
+constexpr std::int64_t MAX_REPETITIONS = 64;
+
+struct Benchmark {
+    const char* name;
+    // defines run, which performs the given number of operations, or
+    // nullptr for the benchmarks the harness performs itself
+    const char* script;
+    std::int64_t operations;
+};
+
+constexpr Benchmark BENCHMARKS[] = {
+    {"fib", "fib.espresso", 50},
+    {"fibtail", "fibtail.espresso", 20000},
+    {"factorial", "factorial.espresso", 50000},
+    {"globals", "globals.espresso", 20000},
+    {"strings", "strings.espresso", 2000},
+    {"churn", "churn.espresso", 50000},
+    {"compile", nullptr, 10},
+    {"startup", nullptr, 200},
+    // an operation puts a key in a map of that many keys and gets it back
+    {"map10k", nullptr, 10000},
+    {"map1m", nullptr, 1000000},
+    // the same with the keys 0 to 9999, as in a map used as an array
+    {"array10k", nullptr, 10000},
+};
+
+// totals over the measured repetitions
+struct Metrics {
+    std::int64_t nanos[MAX_REPETITIONS];
+    std::int64_t allocations;
+    std::int64_t bytes;
+    std::int64_t peakBytes;
+    std::int64_t collections;
+};
+
+std::int64_t Now() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+// as Espresso makes one
+Runtime* NewRuntime(System* system, const char* loadPath) {
+    Runtime* rt = static_cast<Runtime*>(system->ReAllocate(nullptr, 0, sizeof(Runtime)));
+    rt->Init(system, loadPath);
+    return rt;
+}
+
+void DeleteRuntime(System* system, Runtime* rt) {
+    rt->DeInit();
+    system->ReAllocate(rt, sizeof(Runtime), 0);
+}
+
+// calls the global name with the argument in local 1
+void Call(Runtime* rt, const char* name) {
+    rt->Local(Integer{0})->SetString(rt->NewString(name));
+    rt->LoadGlobal(Integer{0}, Integer{0});
+    rt->Invoke(Integer{0}, Integer{2});
+}
+
+// a thousand lines for the compile benchmark, in local 1
+void GenerateSource(Runtime* rt) {
+    rt->Local(Integer{1})->SetString(rt->NewString(""));
+    espresso::String* source = rt->Local(Integer{1})->GetString(rt);
+    source->Clear();
+    char line[128];
+    for (int i = 0; i < 1000; i++) {
+        std::snprintf(line, sizeof(line),
+            "(def f%d (fn (n) (if (< n 2) n (+ (f%d (- n 1)) (* n %d)))))\n", i, i, i);
+        source->Push(rt, line);
+    }
+    source->Push(rt, '\0');
+}
+
+void Measure(Runtime* rt, Metrics* metrics, std::int64_t repetition, std::int64_t nanos,
+        std::int64_t allocations, std::int64_t bytes, std::uint64_t collections) {
+    metrics->nanos[repetition] = nanos;
+    metrics->allocations += rt->AllocationCount().Unwrap() - allocations;
+    metrics->bytes += rt->TotalBytesAllocated().Unwrap() - bytes;
+    metrics->collections += static_cast<std::int64_t>(rt->CollectionCount() - collections);
+    if (rt->PeakBytesAllocated().Unwrap() > metrics->peakBytes) {
+        metrics->peakBytes = rt->PeakBytesAllocated().Unwrap();
+    }
+}
+
+void RunScript(Runtime* rt, const Benchmark& benchmark, std::int64_t repetitions, Metrics* metrics) {
+    // the path of the script, which the strings benchmark reads
+    char path[512];
+    std::snprintf(path, sizeof(path), "%s/%s", ESPRESSO_BENCH_DIR, benchmark.script);
+    rt->Local(Integer{0})->SetString(rt->NewString("source"));
+    rt->Local(Integer{1})->SetString(rt->NewString(path));
+    rt->StoreGlobal(Integer{0}, Integer{1});
+
+    rt->Local(Integer{1})->SetString(rt->NewString(benchmark.script));
+    Call(rt, "load");
+
+    rt->Local(Integer{1})->SetInteger(Integer{benchmark.operations / 10 + 1});
+    Call(rt, "run");
+
+    for (std::int64_t i = 0; i < repetitions; i++) {
+        std::int64_t allocations = rt->AllocationCount().Unwrap();
+        std::int64_t bytes = rt->TotalBytesAllocated().Unwrap();
+        std::uint64_t collections = rt->CollectionCount();
+        rt->Local(Integer{1})->SetInteger(Integer{benchmark.operations});
+        std::int64_t start = Now();
+        Call(rt, "run");
+        Measure(rt, metrics, i, Now() - start, allocations, bytes, collections);
+    }
+}
+
+void RunCompile(Runtime* rt, const Benchmark& benchmark, std::int64_t repetitions, Metrics* metrics) {
+    // kept in a global, as the registers of a call overlap those above its
+    // callee
+    GenerateSource(rt);
+    rt->Local(Integer{0})->SetString(rt->NewString("generated"));
+    rt->StoreGlobal(Integer{0}, Integer{1});
+    Call(rt, "compile");
+
+    for (std::int64_t i = 0; i < repetitions; i++) {
+        std::int64_t allocations = rt->AllocationCount().Unwrap();
+        std::int64_t bytes = rt->TotalBytesAllocated().Unwrap();
+        std::uint64_t collections = rt->CollectionCount();
+        std::int64_t start = Now();
+        for (std::int64_t j = 0; j < benchmark.operations; j++) {
+            rt->Local(Integer{1})->SetString(rt->NewString("generated"));
+            rt->LoadGlobal(Integer{1}, Integer{1});
+            Call(rt, "compile");
+        }
+        Measure(rt, metrics, i, Now() - start, allocations, bytes, collections);
+    }
+}
+
+// Fills a new map, kept in a global, with the integer keys 0, stride, 2 *
+// stride and so on, then gets every key back. The map is collected on the
+// next repetition.
+void RunMap(Runtime* rt, const Benchmark& benchmark, std::int64_t stride, std::int64_t repetitions,
+        Metrics* metrics) {
+    for (std::int64_t i = -1; i < repetitions; i++) {
+        rt->Local(Integer{0})->SetString(rt->NewString("table"));
+        rt->Local(Integer{1})->SetMap(rt->NewMap());
+        rt->StoreGlobal(Integer{0}, Integer{1});
+        espresso::Map* map = rt->Local(Integer{1})->GetMap(rt);
+        espresso::Value* key = rt->Local(Integer{2});
+        espresso::Value* value = rt->Local(Integer{3});
+
+        std::int64_t allocations = rt->AllocationCount().Unwrap();
+        std::int64_t bytes = rt->TotalBytesAllocated().Unwrap();
+        std::uint64_t collections = rt->CollectionCount();
+        std::int64_t start = Now();
+        for (std::int64_t j = 0; j < benchmark.operations; j++) {
+            key->SetInteger(Integer{j * stride});
+            value->SetInteger(Integer{j});
+            map->Put(rt, key, value);
+        }
+        for (std::int64_t j = 0; j < benchmark.operations; j++) {
+            key->SetInteger(Integer{j * stride});
+            if (map->Get(rt, key) == nullptr) {
+                espresso::Panic("Key missing from map");
+            }
+        }
+        // the first round warms up
+        if (i >= 0) {
+            Measure(rt, metrics, i, Now() - start, allocations, bytes, collections);
+        }
+    }
+}
+
+// an operation makes a runtime, which is torn down again unmeasured
+void RunStartup(System* system, const Benchmark& benchmark, std::int64_t repetitions, Metrics* metrics) {
+    DeleteRuntime(system, NewRuntime(system, ESPRESSO_BENCH_DIR));
+
+    for (std::int64_t i = 0; i < repetitions; i++) {
+        std::int64_t nanos = 0;
+        for (std::int64_t j = 0; j < benchmark.operations; j++) {
+            std::int64_t start = Now();
+            Runtime* rt = NewRuntime(system, ESPRESSO_BENCH_DIR);
+            nanos += Now() - start;
+            Measure(rt, metrics, i, 0, 0, 0, 0);
+            DeleteRuntime(system, rt);
+        }
+        metrics->nanos[i] = nanos;
+    }
+}
+
+std::int64_t Median(std::int64_t* values, std::int64_t count) {
+    for (std::int64_t i = 1; i < count; i++) {
+        std::int64_t value = values[i];
+        std::int64_t j = i;
+        while (j > 0 && values[j - 1] > value) {
+            values[j] = values[j - 1];
+            j--;
+        }
+        values[j] = value;
+    }
+    return values[count / 2];
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    std::int64_t repetitions = 5;
+    if (argc >= 2) {
+        repetitions = std::strtoll(argv[1], nullptr, 10);
+    }
+    if (argc > 2 || repetitions < 1 || repetitions > MAX_REPETITIONS) {
+        std::fprintf(stderr, "usage: espresso_bench [repetitions, 1 to %lld]\n",
+            static_cast<long long>(MAX_REPETITIONS));
+        return 2;
+    }
+
+    DefaultSystem system;
+
+    std::printf("{\n  \"repetitions\": %lld,\n  \"benchmarks\": [\n", static_cast<long long>(repetitions));
+    bool first = true;
+    for (const Benchmark& benchmark : BENCHMARKS) {
+        Metrics metrics{};
+        if (std::strcmp(benchmark.name, "startup") == 0) {
+            RunStartup(&system, benchmark, repetitions, &metrics);
+        } else {
+            Runtime* rt = NewRuntime(&system, ESPRESSO_BENCH_DIR);
+            try {
+                if (benchmark.script != nullptr) {
+                    RunScript(rt, benchmark, repetitions, &metrics);
+                } else if (std::strncmp(benchmark.name, "map", 3) == 0) {
+                    // far apart
+                    RunMap(rt, benchmark, 2654435761, repetitions, &metrics);
+                } else if (std::strncmp(benchmark.name, "array", 5) == 0) {
+                    RunMap(rt, benchmark, 1, repetitions, &metrics);
+                } else {
+                    RunCompile(rt, benchmark, repetitions, &metrics);
+                }
+            } catch (const ThrowException&) {
+                std::fprintf(stderr, "%s: uncaught exception\n", benchmark.name);
+                DeleteRuntime(&system, rt);
+                return 1;
+            }
+            DeleteRuntime(&system, rt);
+        }
+
+        double operations = static_cast<double>(benchmark.operations * repetitions);
+        double nanos = static_cast<double>(Median(metrics.nanos, repetitions));
+        std::printf("%s    {\"name\": \"%s\", \"operations\": %lld, \"ns_per_op\": %.1f, "
+            "\"allocations_per_op\": %.2f, \"bytes_per_op\": %.1f, \"peak_bytes\": %lld, "
+            "\"gc_count\": %lld}",
+            first ? "" : ",\n", benchmark.name, static_cast<long long>(benchmark.operations),
+            nanos / static_cast<double>(benchmark.operations),
+            static_cast<double>(metrics.allocations) / operations,
+            static_cast<double>(metrics.bytes) / operations,
+            static_cast<long long>(metrics.peakBytes), static_cast<long long>(metrics.collections));
+        first = false;
+    }
+    std::printf("\n  ]\n}\n");
+    return 0;
+}
@@ -0,0 +1,553 @@
+#include "eaot.hh"
+#include "esdt.hh"
+
+namespace espresso {
+
+namespace aot {
+
+namespace {
+
+// Every function of a program gets a native in the generated code, named
+// by its index. The bodies share one C++ function, Run, so that calls
+// between them do not grow the C++ stack: a call pushes the frame of the
+// callee and goes to its body, a return pops it and goes back to the point
+// after the call, which the frame of the caller keeps as its program
+// counter. Calls in tail position make the frame over instead.
+//
+// Constants live in K, the natives of the functions first, then the
+// constants of each function but functions themselves, which use the
+// native instead.
+class Translator {
+public:
+    Translator(Runtime* rt, FILE* out) : rt{rt}, out{out} {
+        this->functions.Init(rt);
+        this->constantBase.Init(rt);
+    }
+
+    ~Translator() {
+        this->functions.DeInit(this->rt);
+        this->constantBase.DeInit(this->rt);
+    }
+
+    Translator(const Translator&) = delete;
+    Translator& operator=(const Translator&) = delete;
+
+    Translator(Translator&&) = delete;
+    Translator& operator=(Translator&&) = delete;
+
+    void Collect(Function* main) {
+        *this->functions.Push(this->rt) = main;
+        for (std::int64_t i = 0; i < this->functions.Length().Unwrap(); i++) {
+            Function* fn = *this->functions.At(Integer{i});
+            std::int64_t n = fn->GetConstantCount().Unwrap();
+            for (std::int64_t j = 0; j < n; j++) {
+                Value* constant = fn->ConstantAt(Integer{j});
+                if (constant->GetType() == ValueType::Function
+                        && this->IndexOf(constant->GetFunction(this->rt)) < 0) {
+                    *this->functions.Push(this->rt) = constant->GetFunction(this->rt);
+                }
+            }
+        }
+
+        this->constantCount = this->functions.Length().Unwrap();
+        for (std::int64_t i = 0; i < this->functions.Length().Unwrap(); i++) {
+            *this->constantBase.Push(this->rt) = this->constantCount;
+            Function* fn = *this->functions.At(Integer{i});
+            this->constantCount += fn->GetConstantCount().Unwrap();
+            std::int64_t n = fn->GetByteCodeCount().Unwrap();
+            for (std::int64_t pc = 0; pc < n; pc++) {
+                ByteCodeType type = fn->ByteCodeAt(Integer{pc})->Type();
+                if (type == ByteCodeType::LoadGlobalConstant
+                        || type == ByteCodeType::InvokeGlobal
+                        || type == ByteCodeType::InvokeGlobalTail) {
+                    this->cacheCount++;
+                }
+                if (type == ByteCodeType::Invoke || type == ByteCodeType::InvokeGlobal) {
+                    this->pointCount++;
+                }
+                if (type == ByteCodeType::InvokeTail || type == ByteCodeType::InvokeGlobalTail) {
+                    this->hasTailCalls = true;
+                }
+            }
+        }
+    }
+
+    void Write(const char* source) {
+        std::int64_t count = this->functions.Length().Unwrap();
+
+        std::fprintf(out, "// Generated by espresso-aot from %s, do not edit.\n\n", source);
+        std::fprintf(out, "#include \"eaot.hh\"\n#include \"espresso.hh\"\n\n");
+        std::fprintf(out, "namespace {\n\nusing namespace espresso;\n\n");
+        std::fprintf(out, "void Run(Runtime* rt, std::int64_t fn);\n\n");
+        for (std::int64_t i = 0; i < count; i++) {
+            std::fprintf(out, "void Function%lld(Runtime* rt) { Run(rt, %lld); }\n",
+                static_cast<long long>(i), static_cast<long long>(i));
+        }
+
+        std::fprintf(out, "\nconstexpr std::int64_t ENTRY_COUNT = %lld;\n", static_cast<long long>(count));
+        std::fprintf(out, "constexpr std::int64_t CONSTANT_COUNT = %lld;\n\n",
+            static_cast<long long>(this->constantCount));
+        std::fprintf(out, "const aot::Entry ENTRIES[ENTRY_COUNT] = {\n");
+        for (std::int64_t i = 0; i < count; i++) {
+            Function* fn = *this->functions.At(Integer{i});
+            std::fprintf(out, "    {%lld, %lld, Function%lld},\n",
+                static_cast<long long>(fn->GetArity().Unwrap()),
+                static_cast<long long>(fn->GetLocalCount().Unwrap()),
+                static_cast<long long>(i));
+        }
+        std::fprintf(out, "};\n\n");
+
+        std::fprintf(out, "Value* K = nullptr;\n");
+        if (this->cacheCount > 0) {
+            std::fprintf(out, "GlobalCache C[%lld] = {};\n", static_cast<long long>(this->cacheCount));
+        }
+        std::fprintf(out, "\n");
+
+        std::fprintf(out, "void Run(Runtime* rt, std::int64_t fn) {\n");
+        std::fprintf(out, "    std::int64_t depth = rt->FrameCount().Unwrap();\n");
+        std::fprintf(out, "    std::int64_t point = 0;\n");
+        std::fprintf(out, "    Value* R = nullptr;\n");
+        if (this->pointCount > 0 || this->hasTailCalls) {
+            std::fprintf(out, "dispatch:\n");
+        }
+        std::fprintf(out, "    switch (fn) {\n");
+        for (std::int64_t i = 0; i < count; i++) {
+            std::fprintf(out, "        case %lld: goto function%lld;\n",
+                static_cast<long long>(i), static_cast<long long>(i));
+        }
+        std::fprintf(out, "        default: return;\n    }\n");
+        std::fprintf(out, "resume:\n    switch (point) {\n");
+        for (std::int64_t i = 0; i < this->pointCount; i++) {
+            std::fprintf(out, "        case %lld: goto point%lld;\n",
+                static_cast<long long>(i), static_cast<long long>(i));
+        }
+        std::fprintf(out, "        default: return;\n    }\n");
+        for (std::int64_t i = 0; i < count; i++) {
+            this->WriteFunction(i);
+        }
+        std::fprintf(out, "}\n\n");
+
+        std::fprintf(out, "void Main(Runtime* rt) {\n");
+        std::fprintf(out, "    K = aot::Start(rt, ENTRIES, ENTRY_COUNT, CONSTANT_COUNT);\n");
+        for (std::int64_t i = 0; i < count; i++) {
+            this->WriteConstants(i);
+        }
+        std::fprintf(out, "    rt->Local(Integer{2})->Copy(&K[0]);\n");
+        std::fprintf(out, "    rt->Invoke(Integer{2}, Integer{1});\n");
+        std::fprintf(out, "}\n\n} // namespace\n\n");
+
+        std::fprintf(out, "int main() {\n");
+        std::fprintf(out, "    espresso::DefaultSystem system;\n");
+        std::fprintf(out, "    espresso::Espresso espresso{&system, \".\"};\n");
+        std::fprintf(out, "    return espresso.Run(Main);\n");
+        std::fprintf(out, "}\n");
+    }
+
+private:
+    std::int64_t IndexOf(Function* fn) const {
+        for (std::int64_t i = 0; i < this->functions.Length().Unwrap(); i++) {
+            if (*this->functions.At(Integer{i}) == fn) {
+                return i;
+            }
+        }
+        return -1;
+    }
+
+    std::int64_t ConstantSlot(std::int64_t function, Integer index) const {
+        Function* fn = *this->functions.At(Integer{function});
+        Value* constant = fn->ConstantAt(index);
+        if (constant->GetType() == ValueType::Function) {
+            return this->IndexOf(constant->GetFunction(this->rt));
+        }
+        return *this->constantBase.At(Integer{function}) + index.Unwrap();
+    }
+
+    void Fail(const char* message) {
+        this->rt->Local(Integer{0})->SetString(this->rt->NewString(message));
+        this->rt->Throw(Integer{0});
+    }
+
+    void WriteConstants(std::int64_t function) {
+        Function* fn = *this->functions.At(Integer{function});
+        std::int64_t base = *this->constantBase.At(Integer{function});
+        std::int64_t n = fn->GetConstantCount().Unwrap();
+        for (std::int64_t j = 0; j < n; j++) {
+            Value* constant = fn->ConstantAt(Integer{j});
+            long long slot = static_cast<long long>(base + j);
+            switch (constant->GetType()) {
+                case ValueType::Nil:
+                case ValueType::Function: {
+                    break;
+                }
+                case ValueType::Integer: {
+                    std::int64_t value = constant->GetInteger(this->rt).Unwrap();
+                    if (value == std::numeric_limits<std::int64_t>::min()) {
+                        std::fprintf(out, "    K[%lld].SetInteger(Integer{std::numeric_limits<std::int64_t>::min()});\n", slot);
+                    } else {
+                        std::fprintf(out, "    K[%lld].SetInteger(Integer{%lld});\n", slot, static_cast<long long>(value));
+                    }
+                    break;
+                }
+                case ValueType::Double: {
+                    double value = constant->GetDouble(this->rt).Unwrap();
+                    if (std::isnan(value)) {
+                        std::fprintf(out, "    K[%lld].SetDouble(Double{std::numeric_limits<double>::quiet_NaN()});\n", slot);
+                    } else if (std::isinf(value)) {
+                        std::fprintf(out, "    K[%lld].SetDouble(Double{%sstd::numeric_limits<double>::infinity()});\n",
+                            slot, value < 0 ? "-" : "");
+                    } else {
+                        // hexadecimal keeps every bit of the value
+                        std::fprintf(out, "    K[%lld].SetDouble(Double{%a});\n", slot, value);
+                    }
+                    break;
+                }
+                case ValueType::Boolean: {
+                    std::fprintf(out, "    K[%lld].SetBoolean(%s);\n", slot,
+                        constant->GetBoolean(this->rt) ? "true" : "false");
+                    break;
+                }
+                case ValueType::String: {
+                    String* str = constant->GetString(this->rt);
+                    std::fprintf(out, "    K[%lld].SetString(rt->InternString(\"", slot);
+                    this->WriteEscaped(str);
+                    std::fprintf(out, "\", %lld));\n", static_cast<long long>(str->Length().Unwrap()));
+                    break;
+                }
+                case ValueType::NativeFunction:
+                case ValueType::Map: {
+                    this->Fail("Constant cannot be translated");
+                    return;
+                }
+            }
+        }
+    }
+
+    void WriteEscaped(String* str) {
+        std::int64_t n = str->Length().Unwrap();
+        for (std::int64_t i = 0; i < n; i++) {
+            unsigned char c = static_cast<unsigned char>(str->At(Integer{i}));
+            if (c == '"' || c == '\\') {
+                std::fprintf(out, "\\%c", c);
+            } else if (c >= ' ' && c <= '~') {
+                std::fputc(c, out);
+            } else {
+                // always three digits, so a following digit is not taken in
+                std::fprintf(out, "\\%03o", c);
+            }
+        }
+    }
+
+    bool IsJumpTarget(Function* fn, std::int64_t pc) const {
+        std::int64_t n = fn->GetByteCodeCount().Unwrap();
+        for (std::int64_t i = 0; i < n; i++) {
+            ByteCode* bc = fn->ByteCodeAt(Integer{i});
+            if ((bc->Type() == ByteCodeType::Jump || bc->Type() == ByteCodeType::JumpIfFalse)
+                    && bc->LargeArgument().Unwrap() == pc) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void WriteFunction(std::int64_t function) {
+        Function* fn = *this->functions.At(Integer{function});
+        long long self = static_cast<long long>(function);
+        std::int64_t n = fn->GetByteCodeCount().Unwrap();
+
+        // R is reloaded after every call, which may move the stack
+        std::fprintf(out, "function%lld:\n", self);
+        std::fprintf(out, "    R = rt->Local(Integer{0});\n");
+
+        for (std::int64_t pc = 0; pc < n; pc++) {
+            ByteCode* bc = fn->ByteCodeAt(Integer{pc});
+            long long a1 = static_cast<long long>(bc->SmallArgument1().Unwrap());
+            long long a2 = static_cast<long long>(bc->SmallArgument2().Unwrap());
+
+            if (this->IsJumpTarget(fn, pc)) {
+                std::fprintf(out, "function%lld_%lld:\n", self, static_cast<long long>(pc));
+            }
+
+            switch (bc->Type()) {
+                case ByteCodeType::NoOp: {
+                    std::fprintf(out, "    ;\n");
+                    break;
+                }
+                case ByteCodeType::Return: {
+                    std::fprintf(out, "    R[0].Copy(&R[%lld]);\n", a1);
+                    this->WriteReturn(self);
+                    break;
+                }
+                case ByteCodeType::LoadConstant: {
+                    std::fprintf(out, "    R[%lld].Copy(&K[%lld]);\n", a1,
+                        static_cast<long long>(this->ConstantSlot(function, bc->LargeArgument())));
+                    break;
+                }
+                case ByteCodeType::Copy: {
+                    std::fprintf(out, "    R[%lld].Copy(&R[%lld]);\n", a1, a2);
+                    break;
+                }
+                case ByteCodeType::Jump: {
+                    std::fprintf(out, "    goto function%lld_%lld;\n", self,
+                        static_cast<long long>(bc->LargeArgument().Unwrap()));
+                    break;
+                }
+                case ByteCodeType::JumpIfFalse: {
+                    std::fprintf(out, "    if (!R[%lld].IsTruthy()) goto function%lld_%lld;\n", a1, self,
+                        static_cast<long long>(bc->LargeArgument().Unwrap()));
+                    break;
+                }
+                case ByteCodeType::LoadGlobal: {
+                    std::fprintf(out, "    rt->LoadGlobal(Integer{%lld}, Integer{%lld});\n", a1, a2);
+                    break;
+                }
+                case ByteCodeType::StoreGlobal: {
+                    std::fprintf(out, "    rt->StoreGlobal(Integer{%lld}, Integer{%lld});\n", a1, a2);
+                    break;
+                }
+                case ByteCodeType::LoadGlobalConstant: {
+                    this->WriteLoadGlobal(function, a1, bc->LargeArgument());
+                    break;
+                }
+                case ByteCodeType::Invoke: {
+                    this->WriteCall(self, a1, a2);
+                    break;
+                }
+                case ByteCodeType::InvokeTail: {
+                    this->WriteTailCall(self, a1, a2);
+                    break;
+                }
+                case ByteCodeType::InvokeGlobal: {
+                    this->WriteLoadGlobal(function, a1, bc->SmallArgument3());
+                    if (a2 == 3) {
+                        std::fprintf(out, "    if (!aot::Quick(rt, R, %lld)) {\n", a1);
+                        this->WriteCall(self, a1, a2);
+                        std::fprintf(out, "    }\n");
+                    } else {
+                        this->WriteCall(self, a1, a2);
+                    }
+                    break;
+                }
+                case ByteCodeType::InvokeGlobalTail: {
+                    this->WriteLoadGlobal(function, a1, bc->SmallArgument3());
+                    if (a2 == 3) {
+                        std::fprintf(out, "    if (aot::Quick(rt, R, %lld)) {\n", a1);
+                        std::fprintf(out, "    R[0].Copy(&R[%lld]);\n", a1);
+                        this->WriteReturn(self);
+                        std::fprintf(out, "    }\n");
+                    }
+                    this->WriteTailCall(self, a1, a2);
+                    break;
+                }
+                default: {
+                    // quickened and guard instructions only exist at runtime
+                    this->Fail("Instruction cannot be translated");
+                    return;
+                }
+            }
+        }
+    }
+
+    void WriteLoadGlobal(std::int64_t function, long long dest, Integer key) {
+        std::fprintf(out, "    aot::LoadGlobal(rt, R, %lld, &K[%lld], &C[%lld]);\n", dest,
+            static_cast<long long>(this->ConstantSlot(function, key)),
+            static_cast<long long>(this->nextCache));
+        this->nextCache++;
+    }
+
+    // resumes here once the callee returned, if it was given a frame
+    void WriteCall(long long self, long long base, long long count) {
+        long long point = static_cast<long long>(this->nextPoint);
+        this->nextPoint++;
+        std::fprintf(out, "    fn = aot::Call(rt, ENTRIES, ENTRY_COUNT, %lld, %lld, %lld, %lld);\n",
+            self, base, count, point);
+        std::fprintf(out, "    if (fn >= 0) goto dispatch;\n");
+        std::fprintf(out, "point%lld:\n", point);
+        std::fprintf(out, "    R = rt->Local(Integer{0});\n");
+    }
+
+    void WriteTailCall(long long self, long long base, long long count) {
+        std::fprintf(out, "    fn = aot::TailCall(rt, ENTRIES, ENTRY_COUNT, %lld, %lld, %lld, depth);\n",
+            self, base, count);
+        std::fprintf(out, "    if (fn >= 0) goto dispatch;\n");
+        this->WriteReturn(self);
+    }
+
+    // the native of each entry is its constant in K, see Start
+    void WriteReturn(long long self) {
+        std::fprintf(out, "    point = aot::Return(rt, depth, &K[%lld]);\n", self);
+        std::fprintf(out, "    if (point < 0) return;\n    goto resume;\n");
+    }
+
+    Runtime* rt;
+    FILE* out;
+    Vector<Function*> functions;
+    // index in K of the first constant of each function
+    Vector<std::int64_t> constantBase;
+    std::int64_t constantCount{0};
+    std::int64_t cacheCount{0};
+    std::int64_t nextCache{0};
+    // calls that resume where they left off
+    std::int64_t pointCount{0};
+    std::int64_t nextPoint{0};
+    bool hasTailCalls{false};
+};
+
+} // namespace
+
+void Translate(Runtime* rt, const char* source, const char* output) {
+    Function* main = rt->Local(Integer{0})->GetFunction(rt);
+
+    System* system = rt->GetSystem();
+    FILE* out = system->Open(output, "w");
+    if (out == nullptr) {
+        rt->Local(Integer{0})->SetString(rt->NewString("Could not open output file"));
+        rt->Throw(Integer{0});
+        return;
+    }
+    Defer closeAtEnd{[=](){
+        system->Close(out);
+    }};
+
+    Translator translator{rt, out};
+    translator.Collect(main);
+    translator.Write(source);
+}
+
+Value* Start(Runtime* rt, const Entry* entries, std::int64_t entryCount, std::int64_t constantCount) {
+    rt->Local(Integer{1})->SetFunction(rt->NewFunction());
+    Function* pool = rt->Local(Integer{1})->GetFunction(rt);
+    pool->ReserveConstants(rt, Integer{constantCount});
+    for (std::int64_t i = 0; i < constantCount; i++) {
+        pool->PushConstant(rt);
+    }
+    // pushing never moves the constants once reserved
+    Value* constants = pool->ConstantAt(Integer{0});
+    for (std::int64_t i = 0; i < entryCount; i++) {
+        NativeFunction* native = rt->NewNativeFunction(
+            Integer{entries[i].arity}, Integer{entries[i].localCount}, entries[i].handle);
+        constants[i].SetNativeFunction(native);
+    }
+    return constants;
+}
+
+// Calls between translated functions push or take over a frame without
+// going through Runtime::Invoke, so they fire the probes and are traced
+// from here to the return that pops the frame. The callees are natives,
+// as they are to Invoke.
+static void TraceCall(Runtime* rt, Value* callee, std::int64_t count) {
+    ESPRESSO_PROBE3(function__entry, callee->GetNativeFunction(rt), count, true);
+    if (prof::tracing) {
+        prof::BeginCall(rt, "native", callee->GetNativeFunction(rt));
+    }
+}
+
+// The function running in the frame returns first. The frame the native
+// was called with is left to Runtime::RawInvoke, which gives it as that
+// native to the probes until it returns.
+static void TraceTailCall(Runtime* rt, Value* callee, std::int64_t count, std::int64_t depth) {
+    if (rt->FrameCount().Unwrap() != depth) {
+        ESPRESSO_PROBE2(function__return, rt->Local(Integer{0})->GetNativeFunction(rt), true);
+        ESPRESSO_PROBE3(function__entry, callee->GetNativeFunction(rt), count, true);
+    }
+    if (prof::tracing) {
+        prof::End(rt);
+        prof::BeginCall(rt, "native", callee->GetNativeFunction(rt));
+    }
+}
+
+// the entry a call goes to, -1 for any other callee, or one that is given
+// the wrong number of arguments, which the invoke then raises
+static std::int64_t EntryOf(Runtime* rt, const Entry* entries, std::int64_t entryCount,
+        std::int64_t self, Value* callee, std::int64_t count) {
+    if (callee->GetType() != ValueType::NativeFunction) {
+        return -1;
+    }
+    NativeFunction::Handle handle = callee->GetNativeFunction(rt)->GetHandle();
+    std::int64_t entry = -1;
+    if (entries[self].handle == handle) {
+        entry = self;
+    } else {
+        for (std::int64_t i = 0; i < entryCount; i++) {
+            if (entries[i].handle == handle) {
+                entry = i;
+                break;
+            }
+        }
+    }
+    if (entry >= 0 && entries[entry].arity != count) {
+        return -1;
+    }
+    return entry;
+}
+
+std::int64_t Call(Runtime* rt, const Entry* entries, std::int64_t entryCount,
+        std::int64_t self, std::int64_t base, std::int64_t count, std::int64_t point) {
+    rt->SafePoint();
+    std::int64_t entry = EntryOf(rt, entries, entryCount, self, rt->Local(Integer{base}), count);
+    if (entry < 0) {
+        rt->Invoke(Integer{base}, Integer{count});
+        return -1;
+    }
+    rt->CurrentFrame()->SetProgramCounter(Integer{point});
+    TraceCall(rt, rt->Local(Integer{base}), count);
+    rt->PushFrame(Integer{base}, Integer{count}, Integer{entries[entry].localCount});
+    return entry;
+}
+
+std::int64_t Return(Runtime* rt, std::int64_t depth, Value* callee) {
+    if (rt->FrameCount().Unwrap() == depth) {
+        return -1;
+    }
+    ESPRESSO_PROBE2(function__return, callee->GetNativeFunction(rt), true);
+    if (prof::tracing) {
+        prof::End(rt);
+    }
+    rt->PopFrame();
+    return rt->CurrentFrame()->ProgramCounter().Unwrap();
+}
+
+// A try in tail position takes over the frame like any other tail call.
+// The handler is called in tail position too, outside of the catch, so a
+// handler that tries again does not grow the stack.
+static std::int64_t TailTry(Runtime* rt, const Entry* entries, std::int64_t entryCount,
+        std::int64_t self, std::int64_t base, std::int64_t depth) {
+    // the body and the handler, with the body called above them. The
+    // function running in the frame stays in register 0, it returns what
+    // the body or the handler gives.
+    rt->Copy(Integer{1}, Integer{base + 1});
+    rt->Copy(Integer{2}, Integer{base + 2});
+    rt->ReuseFrame(Integer{0}, Integer{3}, Integer{4});
+    try {
+        rt->Copy(Integer{3}, Integer{1});
+        rt->Invoke(Integer{3}, Integer{1});
+        rt->Copy(Integer{0}, Integer{3});
+        return -1;
+    } catch (const ThrowException& e) {
+        rt->Local(Integer{3})->Copy(rt->StackAtAbsoluteIndex(e.GetAbsoluteStackIndex()));
+    }
+    return TailCall(rt, entries, entryCount, self, 2, 2, depth);
+}
+
+std::int64_t TailCall(Runtime* rt, const Entry* entries, std::int64_t entryCount,
+        std::int64_t self, std::int64_t base, std::int64_t count, std::int64_t depth) {
+    rt->SafePoint();
+    Value* callee = rt->Local(Integer{base});
+    if (callee->GetType() == ValueType::NativeFunction
+            && callee->GetNativeFunction(rt)->GetIntrinsic() == Intrinsic::Try
+            && count == 3) {
+        return TailTry(rt, entries, entryCount, self, base, depth);
+    }
+    std::int64_t entry = EntryOf(rt, entries, entryCount, self, callee, count);
+    if (entry < 0) {
+        rt->Invoke(Integer{base}, Integer{count});
+        rt->Copy(Integer{0}, Integer{base});
+        return -1;
+    }
+    TraceTailCall(rt, rt->Local(Integer{base}), count, depth);
+    rt->ReuseFrame(Integer{base}, Integer{count}, Integer{entries[entry].localCount});
+    return entry;
+}
+
+} // aot
+
+} // espresso
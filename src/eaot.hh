@@ -0,0 +1,96 @@
+#pragma once
+
+#include "ert.hh"
+
+namespace espresso {
+
+namespace aot {
+
+// Writes a C++ program that runs the function in register 0 of the current
+// frame, each of its bytecode functions translated to a native function
+// with the same arity and registers. See espresso-aot.
+void Translate(Runtime* rt, const char* source, const char* output);
+
+// What a translated program knows of one of its functions
+struct Entry {
+    std::int64_t arity;
+    std::int64_t localCount;
+    NativeFunction::Handle handle;
+};
+
+// Builds the constants of a translated program in register 1 of the
+// current frame, a native function for each entry first and nils after,
+// and returns the first of them. They stay in place for as long as the
+// program runs.
+Value* Start(Runtime* rt, const Entry* entries, std::int64_t entryCount, std::int64_t constantCount);
+
+// Calls the callee in register base of the entry self. One of the entries gets a frame,
+// which the caller resumes at point in once it is popped, and the index of
+// the entry to run is returned. Any other callee is invoked, giving -1.
+std::int64_t Call(Runtime* rt, const Entry* entries, std::int64_t entryCount,
+    std::int64_t self, std::int64_t base, std::int64_t count, std::int64_t point);
+
+// Pops the current frame, which runs the native callee, and gives the
+// point its caller resumes at, or -1 when the frame is the one the native
+// was called with. depth is the frame count at that call.
+std::int64_t Return(Runtime* rt, std::int64_t depth, Value* callee);
+
+// A call in tail position makes the frame over for an entry and returns
+// its index. Any other callee is invoked and its result returned, giving
+// -1.
+std::int64_t TailCall(Runtime* rt, const Entry* entries, std::int64_t entryCount,
+    std::int64_t self, std::int64_t base, std::int64_t count, std::int64_t depth);
+
+// the fast path of LoadGlobalConstant, see Runtime::LoadGlobal
+inline void LoadGlobal(Runtime* rt, Value* registers, std::int64_t dest, Value* key, GlobalCache* cache) {
+    if (cache->version == rt->GetGlobals()->Version()) {
+        registers[dest].Copy(cache->slot);
+    } else {
+        rt->LoadGlobal(Integer{dest}, key, cache);
+    }
+}
+
+// Performs a call of an intrinsic with two arguments the way the quickened
+// instructions of the interpreter do, leaving the result in place of the
+// callee. Returns false when the callee or its arguments do not suit,
+// and the call has to be made.
+inline bool Quick(Runtime* rt, Value* registers, std::int64_t base) {
+    Value* callee = &registers[base];
+    if (callee->GetType() != ValueType::NativeFunction) {
+        return false;
+    }
+    Intrinsic intrinsic = callee->GetNativeFunction(rt)->GetIntrinsic();
+    Value* lhs = &registers[base + 1];
+    Value* rhs = &registers[base + 2];
+    if (intrinsic == Intrinsic::Equal) {
+        callee->SetBoolean(lhs->Equals(rt, rhs));
+        return true;
+    }
+    if (lhs->GetType() != ValueType::Integer || rhs->GetType() != ValueType::Integer) {
+        return false;
+    }
+    std::int64_t a = lhs->GetInteger(rt).Unwrap();
+    std::int64_t b = rhs->GetInteger(rt).Unwrap();
+    switch (intrinsic) {
+        case Intrinsic::Less: callee->SetBoolean(a < b); return true;
+        case Intrinsic::LessEqual: callee->SetBoolean(a <= b); return true;
+        case Intrinsic::Greater: callee->SetBoolean(a > b); return true;
+        case Intrinsic::GreaterEqual: callee->SetBoolean(a >= b); return true;
+        case Intrinsic::Add: callee->SetInteger(Integer{a + b}); return true;
+        case Intrinsic::Subtract: callee->SetInteger(Integer{a - b}); return true;
+        case Intrinsic::Multiply: callee->SetInteger(Integer{a * b}); return true;
+        case Intrinsic::Divide: {
+            // division by zero is left to the native, which raises the error
+            if (b == 0) {
+                return false;
+            }
+            callee->SetInteger(Integer{a / b});
+            return true;
+        }
+        default: return false;
+    }
+}
+
+} // aot
+
+} // espresso
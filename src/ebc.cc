@@ -80,16 +80,14 @@ struct BytecodeReader {
             }
             // string
             case bits::CONST_STRING: {
-                rt->Local(Integer{2})->SetString(rt->NewString(""));
-                String* str = rt->Local(Integer{2})->GetString(rt);
-                dest->SetString(str);
                 uint32_t length = readU32(rt);
-                str->Reserve(rt, Integer{length + 1});
-                str->Clear();
-                for (uint32_t i = 0; i < length; i++) {
-                    str->Push(rt, static_cast<char>(readU8(rt)));
+                if (index + length > source->Length().Unwrap()) {
+                    rt->Local(Integer{0})->SetString(rt->NewString("File truncated"));
+                    rt->Throw(Integer{0});
+                    return;
                 }
-                str->Push(rt, '\0');
+                dest->SetString(rt->InternString(source->RawPointer() + index, length));
+                index += length;
                 break;
             }
             // boolean
@@ -136,6 +134,7 @@ struct BytecodeReader {
 };
 
 void Load(Runtime* rt) {
+    prof::Span span{rt, "compile", "bytecode::Load"};
     rt->Local(Integer{0})->SetFunction(rt->NewFunction());
 
     Function* dest = rt->Local(Integer{0})->GetFunction(rt);
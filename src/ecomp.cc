@@ -265,7 +265,7 @@ struct Compiler {
 
         Integer NewStringConstant(Runtime* runtime, const char* message, std::int64_t length) {
             Integer id = destination->GetConstantCount();
-            destination->PushConstant(runtime)->SetString(runtime->NewString(message, length));
+            destination->PushConstant(runtime)->SetString(runtime->InternString(message, length));
             return id;
         }
 
@@ -483,6 +483,32 @@ struct Compiler {
             }
         }
 
+        // looks past the next expression without consuming anything and
+        // reports whether it is the last one in the enclosing form
+        bool IsLastExpression() {
+            std::int64_t savedIndex = this->index;
+            Stack<Token, 2> savedBuffer = this->tokenBuffer;
+
+            std::int64_t depth = 0;
+            do {
+                Token curr = Next();
+                if (curr.type == TokenType::EndOfFile) {
+                    break;
+                }
+                if (curr.type == TokenType::LeftParen) {
+                    depth++;
+                } else if (curr.type == TokenType::RightParen) {
+                    depth--;
+                }
+            } while (depth > 0);
+
+            bool isLast = Next().type == TokenType::RightParen;
+
+            this->index = savedIndex;
+            this->tokenBuffer = savedBuffer;
+            return isLast;
+        }
+
         bool AtEof() {
             SkipWhiteSpace();
             Token t = RawNext();
@@ -710,14 +736,16 @@ struct Compiler {
             if (!first) {
                 CurrentContext()->StackPop();
             }
-            CompileExpression(runtime);
+            CompileExpression(runtime, false);
             first = false;
         }
         Integer top = CurrentContext()->StackTop();
         CurrentContext()->Emit(runtime, ByteCodeType::Return, top);
     }
 
-    void CompileExpression(Runtime* runtime) {
+    // isTail is set when the value of the expression is returned directly
+    // from the enclosing function, in which case calls become tail calls
+    void CompileExpression(Runtime* runtime, bool isTail) {
         Token current = tokenizer.Next();
         switch(current.type) {
             case TokenType::Boolean: {
@@ -761,15 +789,15 @@ struct Compiler {
                         break;
                     }
                     case TokenType::If: {
-                        CompileIf(runtime);
+                        CompileIf(runtime, isTail);
                         break;
                     }
                     case TokenType::Let: {
-                        CompileLet(runtime);
+                        CompileLet(runtime, isTail);
                         break;
                     }
                     case TokenType::Do: {
-                        CompileDo(runtime);
+                        CompileDo(runtime, isTail);
                         break;
                     }
                     case TokenType::Fn: {
@@ -777,7 +805,7 @@ struct Compiler {
                         break;
                     }
                     default: {
-                        CompileInvoke(runtime);
+                        CompileInvoke(runtime, isTail);
                         break;
                     }
                 }
@@ -786,16 +814,16 @@ struct Compiler {
         }
     }
 
-    void CompileIf(Runtime* runtime) {
+    void CompileIf(Runtime* runtime, bool isTail) {
         tokenizer.Expect(runtime, TokenType::LeftParen);
         tokenizer.Expect(runtime, TokenType::If);
         // condition
-        CompileExpression(runtime);
+        CompileExpression(runtime, false);
         Integer top = CurrentContext()->StackTop();
         CurrentContext()->StackPop();
         Integer jumpIfFalseLocation = CurrentContext()->EmitLong(runtime, ByteCodeType::JumpIfFalse, top, Integer{0});
         // if true
-        CompileExpression(runtime);
+        CompileExpression(runtime, isTail);
 
         Token curr = tokenizer.Next();
         tokenizer.PutBack(&curr);
@@ -811,7 +839,7 @@ struct Compiler {
 
         if (curr.type != TokenType::RightParen) {
             // if false
-            CompileExpression(runtime);
+            CompileExpression(runtime, isTail);
         } else {
             // one armed if returns nil for else
             Integer constantNumber = CurrentContext()->NewNilConstant(runtime);
@@ -831,7 +859,7 @@ struct Compiler {
         tokenizer.Expect(runtime, TokenType::Def);
         Token identifier = tokenizer.Expect(runtime, TokenType::Identifier);
         Integer constantNumber = CurrentContext()->NewStringConstant(runtime, identifier.source, identifier.length);
-        CompileExpression(runtime);
+        CompileExpression(runtime, false);
         // there should be something at the top of the stack that
         // we will use as the value of the expression
         Integer globalValue = CurrentContext()->StackTop();
@@ -849,7 +877,7 @@ struct Compiler {
         CurrentContext()->EmitLong(runtime, ByteCodeType::LoadConstant, registerDest, constantNumber);
     }
 
-    void CompileLet(Runtime* runtime) {
+    void CompileLet(Runtime* runtime, bool isTail) {
         tokenizer.Expect(runtime, TokenType::LeftParen);
         tokenizer.Expect(runtime, TokenType::Let);
 
@@ -866,7 +894,7 @@ struct Compiler {
             }
             Token identifier = tokenizer.Expect(runtime, TokenType::Identifier);
             Integer localNumber = CurrentContext()->StartDefineLocal(runtime, identifier);
-            CompileExpression(runtime);
+            CompileExpression(runtime, false);
             Integer top = CurrentContext()->StackTop();
             CurrentContext()->StackPop();
             CurrentContext()->FinishDefineLocal(runtime, localNumber);
@@ -879,7 +907,7 @@ struct Compiler {
         tokenizer.Expect(runtime, TokenType::RightParen);
 
         // let body
-        CompileExpression(runtime);
+        CompileExpression(runtime, isTail);
         tokenizer.Expect(runtime, TokenType::RightParen);
 
         // ensure the location from the inner scope is in the right place in the outer scope
@@ -889,7 +917,7 @@ struct Compiler {
         CurrentContext()->Emit(runtime, ByteCodeType::Copy, dest, source);
     }
 
-    void CompileDo(Runtime* runtime) {
+    void CompileDo(Runtime* runtime, bool isTail) {
         tokenizer.Expect(runtime, TokenType::LeftParen);
         tokenizer.Expect(runtime, TokenType::Do);
 
@@ -900,7 +928,7 @@ struct Compiler {
                 break;
             }
 
-            CompileExpression(runtime);
+            CompileExpression(runtime, isTail && tokenizer.IsLastExpression());
 
             curr = tokenizer.Next();
             tokenizer.PutBack(&curr);
@@ -938,7 +966,7 @@ struct Compiler {
                 break;
             }
             gotExpression = true;
-            CompileExpression(runtime);
+            CompileExpression(runtime, tokenizer.IsLastExpression());
             Token next = tokenizer.Next();
             tokenizer.PutBack(&next);
             // middle statement, pop
@@ -985,24 +1013,79 @@ struct Compiler {
         if (localNumer.Unwrap() < 0) {
             // invalid local
             Integer constantNumber = CurrentContext()->NewStringConstant(runtime, ident.source, ident.length);
-            CurrentContext()->EmitLong(runtime, ByteCodeType::LoadConstant, registerDest, constantNumber);
-            CurrentContext()->Emit(runtime, ByteCodeType::LoadGlobal, registerDest, registerDest);
+            CurrentContext()->EmitLong(runtime, ByteCodeType::LoadGlobalConstant, registerDest, constantNumber);
         } else {
             // valid local
             CurrentContext()->Emit(runtime, ByteCodeType::Copy, registerDest, localNumer);
         }
     }
 
-    void CompileInvoke(Runtime* runtime) {
+    // looks ahead at the arguments left in a call, without consuming them,
+    // and reports whether they are all constants or locals, which cannot
+    // throw or redefine a global
+    bool ArgumentsAreSimple() {
+        std::int64_t savedIndex = tokenizer.index;
+        Stack<Token, 2> savedBuffer = tokenizer.tokenBuffer;
+
+        bool simple = true;
+        while (simple) {
+            Token curr = tokenizer.Next();
+            if (curr.type == TokenType::RightParen || curr.type == TokenType::EndOfFile) {
+                break;
+            }
+            switch (curr.type) {
+                case TokenType::Boolean:
+                case TokenType::Integer:
+                case TokenType::String:
+                case TokenType::Double:
+                case TokenType::Nil: {
+                    break;
+                }
+                case TokenType::Identifier: {
+                    simple = CurrentContext()->ResolveLocal(&curr).Unwrap() >= 0;
+                    break;
+                }
+                default: {
+                    simple = false;
+                    break;
+                }
+            }
+        }
+
+        tokenizer.index = savedIndex;
+        tokenizer.tokenBuffer = savedBuffer;
+        return simple;
+    }
+
+    void CompileInvoke(Runtime* runtime, bool isTail) {
 
         tokenizer.Expect(runtime, TokenType::LeftParen);
 
         std::int64_t argumentCount = 1;
 
-        // target
-        CompileExpression(runtime);
+        // A global target is loaded with the invoke, after the arguments,
+        // when none of them can tell: they only read constants and locals.
+        // Otherwise it is loaded first, as any other target. -1 unless fused
+        Integer globalConstant = Integer{-1};
 
-        Integer startRegister = CurrentContext()->StackTop();
+        Token target = tokenizer.Next();
+        tokenizer.PutBack(&target);
+
+        Integer startRegister = Integer{0};
+
+        if (target.type == TokenType::Identifier && CurrentContext()->ResolveLocal(&target).Unwrap() < 0) {
+            tokenizer.Expect(runtime, TokenType::Identifier);
+            Integer constantNumber = CurrentContext()->NewStringConstant(runtime, target.source, target.length);
+            startRegister = CurrentContext()->StackPush(runtime);
+            if (ArgumentsAreSimple()) {
+                globalConstant = constantNumber;
+            } else {
+                CurrentContext()->EmitLong(runtime, ByteCodeType::LoadGlobalConstant, startRegister, constantNumber);
+            }
+        } else {
+            CompileExpression(runtime, false);
+            startRegister = CurrentContext()->StackTop();
+        }
 
         while (true) {
             Token current = tokenizer.Next();
@@ -1012,13 +1095,27 @@ struct Compiler {
                 break;
             }
 
-            CompileExpression(runtime);
+            CompileExpression(runtime, false);
             argumentCount++;
         }
 
         tokenizer.Expect(runtime, TokenType::RightParen);
 
-        CurrentContext()->Emit(runtime, ByteCodeType::Invoke, startRegister, Integer{argumentCount});
+        constexpr std::int64_t MAX_SMALL_ARGUMENT = bits::ARG3_BITS >> bits::ARG3_SHIFT;
+
+        // a tail call replaces the current frame, the instructions that
+        // follow it are never reached
+        if (globalConstant.Unwrap() >= 0 && globalConstant.Unwrap() <= MAX_SMALL_ARGUMENT) {
+            ByteCodeType invokeType = isTail ? ByteCodeType::InvokeGlobalTail : ByteCodeType::InvokeGlobal;
+            CurrentContext()->Emit(runtime, invokeType, startRegister, Integer{argumentCount}, globalConstant);
+        } else {
+            if (globalConstant.Unwrap() >= 0) {
+                // constant index too large for arg3
+                CurrentContext()->EmitLong(runtime, ByteCodeType::LoadGlobalConstant, startRegister, globalConstant);
+            }
+            ByteCodeType invokeType = isTail ? ByteCodeType::InvokeTail : ByteCodeType::Invoke;
+            CurrentContext()->Emit(runtime, invokeType, startRegister, Integer{argumentCount});
+        }
 
         if (CurrentContext()->StackTop().Unwrap() < startRegister.Unwrap()) {
             Panic("Invalid register handling in invoke");
@@ -1082,6 +1179,7 @@ struct Compiler {
 };
 
 void Compile(Runtime* rt) {
+    prof::Span span{rt, "compile", "compiler::Compile"};
     rt->Local(Integer{0})->SetFunction(rt->NewFunction());
     Function* dest = rt->Local(Integer{0})->GetFunction(rt);
     String* source = rt->Local(Integer{1})->GetString(rt);
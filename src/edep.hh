@@ -6,6 +6,9 @@
 #include <cstdio>
 #include <cctype>
 #include <cmath>
+#include <limits>
 #include <cerrno>
 #include <stdexcept>
-#include <functional>
\ No newline at end of file
+#include <functional>
+#include <chrono>
+#include <bit>
\ No newline at end of file
@@ -0,0 +1,908 @@
+#include "ejit.hh"
+#include "ert.hh"
+#include "esdt.hh"
+
+#include <exception>
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace espresso {
+
+namespace jit {
+
+// Generated code keeps the Context in rbx and register 0 of the running
+// frame in r12, and operates on the registers of the frame in place. It
+// leaves through one of two exits, returning 1 when the frame returned and
+// 0 when the frame changed or an error was raised. Everything that may
+// allocate, run the gc or raise an error is done by a helper, which hands
+// back the possibly moved register 0, or nullptr to leave the code.
+//
+// Calls between functions do not nest, the callee's frame is pushed and
+// the code of the caller left. Run then enters the callee, and the caller
+// again at the instruction after the call once the callee returned.
+
+struct Context {
+    Runtime* rt;
+    // C++ exceptions cannot unwind through generated code, so helpers
+    // hold on to them until Run is back in C++
+    std::exception_ptr error;
+    // set when a native called in tail position returned the frame
+    bool returned;
+    // a call of try or throw, which Run performs, see Control
+    bool control;
+    std::int64_t controlBase;
+    std::int64_t controlCount;
+    bool controlTail;
+};
+
+using Entry = std::int64_t (*)(Context* cx, Value* registers, const void* resume);
+
+// Start of every mapping, followed by the code and a table with the offset
+// of each instruction's code.
+struct Header {
+    std::uint32_t table;
+    std::uint32_t count;
+};
+
+static constexpr std::size_t CODE_OFFSET = 16;
+static_assert(sizeof(Header) <= CODE_OFFSET);
+
+static_assert(sizeof(Value) == 16, "templates copy a Value with one movups");
+static_assert(sizeof(ValueType) == 4, "templates compare types as dwords");
+
+static Entry EntryOf(Header* header) {
+    return reinterpret_cast<Entry>(reinterpret_cast<std::uint8_t*>(header) + CODE_OFFSET);
+}
+
+static const void* ResumeAt(Header* header, std::int64_t pc) {
+    std::uint8_t* head = reinterpret_cast<std::uint8_t*>(header);
+    const std::uint32_t* offsets = reinterpret_cast<const std::uint32_t*>(head + header->table);
+    return head + offsets[pc];
+}
+
+// Runs body, which returns false when the frame was changed. Errors are
+// kept in the Context.
+template<typename Body>
+static Value* Guard(Context* cx, Body body) {
+    try {
+        if (!body()) {
+            return nullptr;
+        }
+        return cx->rt->Local<VerifiedPolicy>(Integer{0});
+    } catch (...) {
+        cx->error = std::current_exception();
+        return nullptr;
+    }
+}
+
+static Value* LoadGlobal(Context* cx, std::int64_t dest, std::int64_t key) {
+    return Guard(cx, [=]() {
+        cx->rt->LoadGlobal(Integer{dest}, Integer{key});
+        return true;
+    });
+}
+
+static Value* LoadGlobalCached(Context* cx, std::int64_t dest, Value* key, GlobalCache* cache) {
+    return Guard(cx, [=]() {
+        cx->rt->LoadGlobal(Integer{dest}, key, cache);
+        return true;
+    });
+}
+
+static Value* StoreGlobal(Context* cx, std::int64_t key, std::int64_t value) {
+    return Guard(cx, [=]() {
+        cx->rt->StoreGlobal(Integer{key}, Integer{value});
+        return true;
+    });
+}
+
+// Calls that push or take over a frame in Run fire the probes and are
+// traced from there to the return that pops the frame, as in
+// Runtime::Resume
+static void TraceCall(Runtime* rt, Function* callee, std::int64_t count) {
+    ESPRESSO_PROBE3(function__entry, callee, count, false);
+    if (prof::tracing) {
+        prof::BeginCall(rt, "function", callee);
+    }
+}
+
+// the function running in the frame returns first
+static void TraceTailCall(Runtime* rt, Function* callee, std::int64_t count) {
+    ESPRESSO_PROBE2(function__return, rt->ProbedCallee(rt->Local<VerifiedPolicy>(Integer{0})), false);
+    ESPRESSO_PROBE3(function__entry, callee, count, false);
+    if (prof::tracing) {
+        prof::End(rt);
+        prof::BeginCall(rt, "function", callee);
+    }
+}
+
+// try and throw are run by Run, like the interpreter runs them
+static bool IsControl(Runtime* rt, Value* callee) {
+    if (callee->GetType() != ValueType::NativeFunction) {
+        return false;
+    }
+    Intrinsic intrinsic = callee->GetNativeFunction(rt)->GetIntrinsic();
+    return intrinsic == Intrinsic::Try || intrinsic == Intrinsic::Throw;
+}
+
+// Functions are counted and left to Run, in a new frame or in place of this one when
+// the call is in tail position. A function calling itself in tail position
+// stays in its code, which starts over. Natives and errors are called right
+// away, and their result returned when in tail position.
+template<bool TAIL>
+static Value* Invoke(Context* cx, std::int64_t base, std::int64_t count, std::int64_t next) {
+    return Guard(cx, [=]() {
+        Runtime* rt = cx->rt;
+        rt->CurrentFrame<VerifiedPolicy>()->SetProgramCounter(Integer{next});
+        Value* target = rt->Local<VerifiedPolicy>(Integer{base});
+        if (target->GetType() == ValueType::Function) {
+            Function* callee = target->GetFunction(rt);
+            if (callee->GetArity().Unwrap() == count) {
+                if (callee->CountInvocation()) {
+                    rt->Promote(callee);
+                }
+                if (TAIL) {
+                    Function* running = rt->Local<VerifiedPolicy>(Integer{0})->GetFunction(rt);
+                    TraceTailCall(rt, callee, count);
+                    rt->ReuseFrame(Integer{base}, Integer{count}, callee->GetLocalCount());
+                    return callee == running;
+                }
+                TraceCall(rt, callee, count);
+                rt->PushFrame(Integer{base}, Integer{count}, callee->GetLocalCount());
+                return false;
+            }
+        }
+        if (IsControl(rt, target)) {
+            cx->control = true;
+            cx->controlBase = base;
+            cx->controlCount = count;
+            cx->controlTail = TAIL;
+            return false;
+        }
+        rt->Invoke(Integer{base}, Integer{count});
+        if (TAIL) {
+            rt->Local<VerifiedPolicy>(Integer{0})->Copy(rt->Local<VerifiedPolicy>(Integer{base}));
+            cx->returned = true;
+            return false;
+        }
+        return true;
+    });
+}
+
+static Value* Overrun(Context* cx) {
+    return Guard(cx, []() {
+        Panic("Ran past the end of a compiled function");
+        return true;
+    });
+}
+
+class Assembler {
+public:
+    Assembler() = default;
+    ~Assembler() = default;
+
+    Assembler(const Assembler&) = delete;
+    Assembler& operator=(const Assembler&) = delete;
+
+    Assembler(Assembler&&) = delete;
+    Assembler& operator=(Assembler&&) = delete;
+
+    void Init(Runtime* rt) {
+        this->rt = rt;
+        this->code.Init(rt);
+    }
+
+    void DeInit() {
+        this->code.DeInit(this->rt);
+    }
+
+    void Emit(std::initializer_list<std::uint8_t> bytes) {
+        for (std::uint8_t byte : bytes) {
+            *this->code.Push(this->rt) = byte;
+        }
+    }
+
+    void Emit32(std::uint32_t value) {
+        std::memcpy(this->code.Extend(this->rt, Integer{4}), &value, 4);
+    }
+
+    void Emit64(std::uint64_t value) {
+        std::memcpy(this->code.Extend(this->rt, Integer{8}), &value, 8);
+    }
+
+    void EmitPointer(const void* pointer) {
+        Emit64(reinterpret_cast<std::uint64_t>(pointer));
+    }
+
+    // a disp32 operand based on r12 with reg in the ModRM byte
+    void EmitRegisterOperand(std::uint8_t reg, std::int32_t disp) {
+        Emit({static_cast<std::uint8_t>(0x84 | (reg << 3)), 0x24});
+        Emit32(static_cast<std::uint32_t>(disp));
+    }
+
+    // Emits a rel32 jump with the given opcode and returns where the offset
+    // goes, for Bind or Patch.
+    std::int64_t Jump(std::initializer_list<std::uint8_t> opcode) {
+        Emit(opcode);
+        std::int64_t at = Position();
+        Emit32(0);
+        return at;
+    }
+
+    void JumpTo(std::initializer_list<std::uint8_t> opcode, std::int64_t target) {
+        Patch(Jump(opcode), target);
+    }
+
+    // points the jump at the current position
+    void Bind(std::int64_t at) {
+        Patch(at, Position());
+    }
+
+    void Patch(std::int64_t at, std::int64_t target) {
+        std::int32_t rel = static_cast<std::int32_t>(target - (at + 4));
+        std::memcpy(this->code.At(Integer{at}), &rel, 4);
+    }
+
+    std::int64_t Position() const {
+        return this->code.Length().Unwrap();
+    }
+
+    const std::uint8_t* Head() const {
+        return this->code.RawHeadPointer();
+    }
+
+private:
+    Runtime* rt{nullptr};
+    Vector<std::uint8_t> code;
+};
+
+static const std::initializer_list<std::uint8_t> JMP = {0xE9};
+static const std::initializer_list<std::uint8_t> JE = {0x0F, 0x84};
+static const std::initializer_list<std::uint8_t> JNE = {0x0F, 0x85};
+
+static std::int32_t TypeOf(std::int64_t reg) {
+    return static_cast<std::int32_t>(reg * sizeof(Value) + Value::TypeOffset());
+}
+
+static std::int32_t PayloadOf(std::int64_t reg) {
+    return static_cast<std::int32_t>(reg * sizeof(Value) + Value::PayloadOffset());
+}
+
+static std::uint32_t TypeTag(ValueType type) {
+    return static_cast<std::uint32_t>(type);
+}
+
+// where the templates leave the code
+struct Exits {
+    std::int64_t leave;
+    std::int64_t returned;
+    // the first instruction, where calls of the function to itself in
+    // tail position continue
+    std::int64_t start;
+};
+
+static void EmitCopy(Assembler* a, std::int64_t dest, std::int64_t source) {
+    // movups xmm0, [r12 + source]; movups [r12 + dest], xmm0
+    a->Emit({0x41, 0x0F, 0x10});
+    a->EmitRegisterOperand(0, TypeOf(source));
+    a->Emit({0x41, 0x0F, 0x11});
+    a->EmitRegisterOperand(0, TypeOf(dest));
+}
+
+// copies the value at rax into a register
+static void EmitCopyFromRax(Assembler* a, std::int64_t dest) {
+    // movups xmm0, [rax]; movups [r12 + dest], xmm0
+    a->Emit({0x0F, 0x10, 0x00});
+    a->Emit({0x41, 0x0F, 0x11});
+    a->EmitRegisterOperand(0, TypeOf(dest));
+}
+
+static std::uint64_t Immediate(std::int64_t value) {
+    return static_cast<std::uint64_t>(value);
+}
+
+static std::uint64_t Immediate(const void* pointer) {
+    return reinterpret_cast<std::uint64_t>(pointer);
+}
+
+template<typename... Args>
+static void EmitCall(Assembler* a, const Exits& exits, const void* helper, Args... args) {
+    static_assert(sizeof...(Args) <= 3);
+    // the Context goes in rdi, the rest in rsi, rdx and rcx
+    static constexpr std::uint8_t LOADS[] = {0xBE, 0xBA, 0xB9};
+    std::uint64_t values[] = {Immediate(args)..., 0};
+    a->Emit({0x48, 0x89, 0xDF});
+    for (std::size_t i = 0; i < sizeof...(Args); i++) {
+        a->Emit({0x48, LOADS[i]});
+        a->Emit64(values[i]);
+    }
+    // mov rax, helper; call rax; test rax, rax; jz leave; mov r12, rax
+    a->Emit({0x48, 0xB8});
+    a->EmitPointer(helper);
+    a->Emit({0xFF, 0xD0});
+    a->Emit({0x48, 0x85, 0xC0});
+    a->JumpTo(JE, exits.leave);
+    a->Emit({0x49, 0x89, 0xC4});
+}
+
+static void EmitReturn(Assembler* a, const Exits& exits, std::int64_t source) {
+    EmitCopy(a, 0, source);
+    a->JumpTo(JMP, exits.returned);
+}
+
+// Compares the cache of a global load against the globals version, and
+// leaves the slot in rax when it is warm. Returns the jump taken on a miss.
+static std::int64_t EmitCacheCheck(Assembler* a, Runtime* rt, GlobalCache* cache) {
+    // mov rax, &version; mov rax, [rax]
+    a->Emit({0x48, 0xB8});
+    a->EmitPointer(rt->GetGlobals()->VersionAddress());
+    a->Emit({0x48, 0x8B, 0x00});
+    // mov rcx, cache; cmp rax, [rcx + version]; jne miss
+    a->Emit({0x48, 0xB9});
+    a->EmitPointer(cache);
+    a->Emit({0x48, 0x3B, 0x41, static_cast<std::uint8_t>(offsetof(GlobalCache, version))});
+    std::int64_t miss = a->Jump(JNE);
+    // mov rax, [rcx + slot]
+    a->Emit({0x48, 0x8B, 0x41, static_cast<std::uint8_t>(offsetof(GlobalCache, slot))});
+    return miss;
+}
+
+static void EmitLoadGlobalCached(Assembler* a, Runtime* rt, const Exits& exits,
+        std::int64_t dest, Value* key, GlobalCache* cache) {
+    std::int64_t miss = EmitCacheCheck(a, rt, cache);
+    EmitCopyFromRax(a, dest);
+    std::int64_t done = a->Jump(JMP);
+    a->Bind(miss);
+    EmitCall(a, exits, reinterpret_cast<const void*>(&LoadGlobalCached), dest, key, cache);
+    a->Bind(done);
+}
+
+// The intrinsic a global names when the function is compiled, if its
+// integer form has a template.
+static Intrinsic CompiledIntrinsic(Runtime* rt, Value* key, NativeFunction** native) {
+    Value* global = rt->GetGlobals()->Get(rt, key);
+    if (global == nullptr || global->GetType() != ValueType::NativeFunction) {
+        return Intrinsic::None;
+    }
+    *native = global->GetNativeFunction(rt);
+    Intrinsic intrinsic = (*native)->GetIntrinsic();
+    switch (intrinsic) {
+        case Intrinsic::Equal:
+        case Intrinsic::Less:
+        case Intrinsic::LessEqual:
+        case Intrinsic::Greater:
+        case Intrinsic::GreaterEqual:
+        case Intrinsic::Add:
+        case Intrinsic::Subtract:
+        case Intrinsic::Multiply:
+            return intrinsic;
+        case Intrinsic::None:
+        case Intrinsic::Divide:
+        case Intrinsic::Try:
+        case Intrinsic::Throw:
+            break;
+    }
+    return Intrinsic::None;
+}
+
+// Performs the intrinsic on two integers while the global still names the
+// native it named at compile time. The guards jump to generic otherwise,
+// and done is the jump past the generic call, if there is one.
+static void EmitIntrinsic(Assembler* a, Runtime* rt, const Exits& exits, std::int64_t base,
+        GlobalCache* cache, NativeFunction* native, Intrinsic intrinsic, bool tail,
+        std::int64_t* generic, std::int64_t* done) {
+    std::int64_t lhs = base + 1;
+    std::int64_t rhs = base + 2;
+
+    generic[0] = EmitCacheCheck(a, rt, cache);
+    // cmp dword [rax + type], NativeFunction; jne generic
+    a->Emit({0x81, 0x78, static_cast<std::uint8_t>(Value::TypeOffset())});
+    a->Emit32(TypeTag(ValueType::NativeFunction));
+    generic[1] = a->Jump(JNE);
+    // mov rdx, native; cmp [rax + payload], rdx; jne generic
+    a->Emit({0x48, 0xBA});
+    a->EmitPointer(native);
+    a->Emit({0x48, 0x39, 0x50, static_cast<std::uint8_t>(Value::PayloadOffset())});
+    generic[2] = a->Jump(JNE);
+    // cmp dword [r12 + lhs/rhs type], Integer; jne generic
+    a->Emit({0x41, 0x81});
+    a->EmitRegisterOperand(7, TypeOf(lhs));
+    a->Emit32(TypeTag(ValueType::Integer));
+    generic[3] = a->Jump(JNE);
+    a->Emit({0x41, 0x81});
+    a->EmitRegisterOperand(7, TypeOf(rhs));
+    a->Emit32(TypeTag(ValueType::Integer));
+    generic[4] = a->Jump(JNE);
+
+    // mov rax, [r12 + lhs payload]
+    a->Emit({0x49, 0x8B});
+    a->EmitRegisterOperand(0, PayloadOf(lhs));
+
+    ValueType result = ValueType::Boolean;
+    std::uint8_t setcc = 0;
+    switch (intrinsic) {
+        case Intrinsic::Add: {
+            a->Emit({0x49, 0x03});
+            a->EmitRegisterOperand(0, PayloadOf(rhs));
+            result = ValueType::Integer;
+            break;
+        }
+        case Intrinsic::Subtract: {
+            a->Emit({0x49, 0x2B});
+            a->EmitRegisterOperand(0, PayloadOf(rhs));
+            result = ValueType::Integer;
+            break;
+        }
+        case Intrinsic::Multiply: {
+            a->Emit({0x49, 0x0F, 0xAF});
+            a->EmitRegisterOperand(0, PayloadOf(rhs));
+            result = ValueType::Integer;
+            break;
+        }
+        case Intrinsic::Equal: { setcc = 0x94; break; }
+        case Intrinsic::Less: { setcc = 0x9C; break; }
+        case Intrinsic::LessEqual: { setcc = 0x9E; break; }
+        case Intrinsic::Greater: { setcc = 0x9F; break; }
+        case Intrinsic::GreaterEqual: { setcc = 0x9D; break; }
+        default: {
+            Panic("No template for intrinsic");
+            return;
+        }
+    }
+    if (result == ValueType::Boolean) {
+        // cmp rax, [r12 + rhs payload]; setcc al; movzx eax, al
+        a->Emit({0x49, 0x3B});
+        a->EmitRegisterOperand(0, PayloadOf(rhs));
+        a->Emit({0x0F, setcc, 0xC0});
+        a->Emit({0x0F, 0xB6, 0xC0});
+    }
+
+    // mov [r12 + base payload], rax; mov dword [r12 + base type], result
+    a->Emit({0x49, 0x89});
+    a->EmitRegisterOperand(0, PayloadOf(base));
+    a->Emit({0x41, 0xC7});
+    a->EmitRegisterOperand(0, TypeOf(base));
+    a->Emit32(TypeTag(result));
+
+    if (tail) {
+        EmitReturn(a, exits, base);
+        *done = -1;
+    } else {
+        *done = a->Jump(JMP);
+    }
+}
+
+static void WritePerfMap(Runtime* rt, Function* fn, const void* code, std::int64_t size) {
+    System* system = rt->GetSystem();
+
+    constexpr std::size_t BUFFER_SIZE = 100;
+    char path[BUFFER_SIZE];
+    std::snprintf(path, BUFFER_SIZE, "/tmp/perf-%d.map", static_cast<int>(getpid()));
+
+    FILE* fp = system->Open(path, "a");
+    if (fp == nullptr) {
+        return;
+    }
+    char line[BUFFER_SIZE];
+    int length = std::snprintf(line, BUFFER_SIZE, "%lx %lx espresso::Function@%p\n",
+        static_cast<unsigned long>(reinterpret_cast<std::uintptr_t>(code)),
+        static_cast<unsigned long>(size), static_cast<void*>(fn));
+    system->Write(fp, line, static_cast<std::size_t>(length));
+    system->Close(fp);
+}
+
+void Compile(Runtime* rt, Function* fn) {
+    #if defined(ESPRESSO_DEBUGGER) || defined(ESPRESSO_PROFILE)
+    // breakpoints are only taken, and instructions only counted, by the
+    // interpreter
+    fn->SetMachineCode(JitState::Unsupported, nullptr, 0);
+    return;
+    #endif
+
+    prof::Span span{rt, "compile", "jit::Compile"};
+
+    // hot functions have run already, unless they only loop
+    fn->Decode(rt);
+    Instruction* instructions = fn->InstructionHead();
+    GlobalCache* caches = fn->GlobalCacheHead();
+    std::int64_t count = fn->GetByteCodeCount().Unwrap();
+    if (instructions == nullptr) {
+        // unverified, the interpreter reports it
+        fn->SetMachineCode(JitState::Unsupported, nullptr, 0);
+        return;
+    }
+
+    Assembler a;
+    a.Init(rt);
+    Vector<std::uint32_t> offsets;
+    offsets.InitWithCapacity(rt, Integer{count});
+    // jumps to instructions, patched once every instruction has an offset
+    struct Fixup {
+        std::int64_t at;
+        std::int64_t target;
+    };
+    Vector<Fixup> fixups;
+    fixups.Init(rt);
+    Defer deInit{[&]() {
+        a.DeInit();
+        offsets.DeInit(rt);
+        fixups.DeInit(rt);
+    }};
+
+    // push rbp; mov rbp, rsp; push rbx; push r12; mov rbx, rdi;
+    // mov r12, rsi; jmp rdx
+    a.Emit({0x55, 0x48, 0x89, 0xE5, 0x53, 0x41, 0x54});
+    a.Emit({0x48, 0x89, 0xFB, 0x49, 0x89, 0xF4, 0xFF, 0xE2});
+
+    Exits exits;
+    // xor eax, eax; pop r12; pop rbx; pop rbp; ret
+    exits.leave = a.Position();
+    a.Emit({0x31, 0xC0, 0x41, 0x5C, 0x5B, 0x5D, 0xC3});
+    // mov eax, 1; pop r12; pop rbx; pop rbp; ret
+    exits.returned = a.Position();
+    a.Emit({0xB8, 0x01, 0x00, 0x00, 0x00, 0x41, 0x5C, 0x5B, 0x5D, 0xC3});
+
+    exits.start = a.Position();
+
+    auto jumpToInstruction = [&](std::initializer_list<std::uint8_t> opcode, std::int64_t target) {
+        Fixup* fixup = fixups.Push(rt);
+        fixup->at = a.Jump(opcode);
+        fixup->target = target;
+    };
+
+    for (std::int64_t i = 0; i < count; i++) {
+        *offsets.Push(rt) = static_cast<std::uint32_t>(CODE_OFFSET + a.Position());
+
+        // the bytecode gives the opcode, which the interpreter may have
+        // quickened in the instruction since
+        ByteCode* bc = fn->ByteCodeAt(Integer{i});
+        Instruction* ip = &instructions[i];
+        std::int64_t arg1 = bc->SmallArgument1().Unwrap();
+        std::int64_t arg2 = bc->SmallArgument2().Unwrap();
+
+        switch (bc->Type()) {
+            case ByteCodeType::NoOp: {
+                break;
+            }
+            case ByteCodeType::LoadConstant: {
+                // mov rax, constant
+                a.Emit({0x48, 0xB8});
+                a.EmitPointer(ip->operand.constant);
+                EmitCopyFromRax(&a, arg1);
+                break;
+            }
+            case ByteCodeType::Copy: {
+                EmitCopy(&a, arg1, arg2);
+                break;
+            }
+            case ByteCodeType::Jump: {
+                jumpToInstruction(JMP, bc->LargeArgument().Unwrap());
+                break;
+            }
+            case ByteCodeType::JumpIfFalse: {
+                // only nil and false are falsy, see Value::IsTruthy
+                // mov eax, [r12 + type]
+                a.Emit({0x41, 0x8B});
+                a.EmitRegisterOperand(0, TypeOf(arg1));
+                // cmp eax, Nil; je target
+                a.Emit({0x3D});
+                a.Emit32(TypeTag(ValueType::Nil));
+                jumpToInstruction(JE, bc->LargeArgument().Unwrap());
+                // cmp eax, Boolean; jne next
+                a.Emit({0x3D});
+                a.Emit32(TypeTag(ValueType::Boolean));
+                std::int64_t next = a.Jump(JNE);
+                // cmp qword [r12 + payload], 0; je target
+                a.Emit({0x49, 0x83});
+                a.EmitRegisterOperand(7, PayloadOf(arg1));
+                a.Emit({0x00});
+                jumpToInstruction(JE, bc->LargeArgument().Unwrap());
+                a.Bind(next);
+                break;
+            }
+            case ByteCodeType::LoadGlobal: {
+                EmitCall(&a, exits, reinterpret_cast<const void*>(&LoadGlobal), arg1, arg2);
+                break;
+            }
+            case ByteCodeType::LoadGlobalConstant: {
+                EmitLoadGlobalCached(&a, rt, exits, arg1, ip->operand.constant, &caches[ip->cache]);
+                break;
+            }
+            case ByteCodeType::StoreGlobal: {
+                EmitCall(&a, exits, reinterpret_cast<const void*>(&StoreGlobal), arg1, arg2);
+                break;
+            }
+            case ByteCodeType::Return: {
+                EmitReturn(&a, exits, arg1);
+                break;
+            }
+            case ByteCodeType::Invoke: {
+                EmitCall(&a, exits, reinterpret_cast<const void*>(&Invoke<false>), arg1, arg2, i + 1);
+                break;
+            }
+            case ByteCodeType::InvokeTail: {
+                EmitCall(&a, exits, reinterpret_cast<const void*>(&Invoke<true>), arg1, arg2, i + 1);
+                a.JumpTo(JMP, exits.start);
+                break;
+            }
+            case ByteCodeType::InvokeGlobal:
+            case ByteCodeType::InvokeGlobalTail: {
+                bool tail = bc->Type() == ByteCodeType::InvokeGlobalTail;
+                GlobalCache* cache = &caches[ip->cache];
+
+                NativeFunction* native = nullptr;
+                Intrinsic intrinsic = arg2 == 3
+                    ? CompiledIntrinsic(rt, ip->operand.constant, &native)
+                    : Intrinsic::None;
+                std::int64_t generic[5];
+                std::int64_t done = -1;
+                if (intrinsic != Intrinsic::None) {
+                    EmitIntrinsic(&a, rt, exits, arg1, cache, native, intrinsic, tail, generic, &done);
+                    for (std::int64_t guard : generic) {
+                        a.Bind(guard);
+                    }
+                }
+
+                EmitLoadGlobalCached(&a, rt, exits, arg1, ip->operand.constant, cache);
+                EmitCall(&a, exits, tail
+                    ? reinterpret_cast<const void*>(&Invoke<true>)
+                    : reinterpret_cast<const void*>(&Invoke<false>), arg1, arg2, i + 1);
+                if (tail) {
+                    a.JumpTo(JMP, exits.start);
+                }
+                if (done >= 0) {
+                    a.Bind(done);
+                }
+                break;
+            }
+            default: {
+                fn->SetMachineCode(JitState::Unsupported, nullptr, 0);
+                return;
+            }
+        }
+    }
+    EmitCall(&a, exits, reinterpret_cast<const void*>(&Overrun));
+
+    std::int64_t fixupCount = fixups.Length().Unwrap();
+    for (std::int64_t i = 0; i < fixupCount; i++) {
+        Fixup* fixup = fixups.At(Integer{i});
+        a.Patch(fixup->at, *offsets.At(Integer{fixup->target}) - CODE_OFFSET);
+    }
+
+    std::size_t codeSize = static_cast<std::size_t>(a.Position());
+    std::size_t table = (CODE_OFFSET + codeSize + 3) & ~static_cast<std::size_t>(3);
+    std::size_t size = table + sizeof(std::uint32_t) * count;
+
+    void* head = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (head == MAP_FAILED) {
+        fn->SetMachineCode(JitState::Unsupported, nullptr, 0);
+        return;
+    }
+    std::uint8_t* bytes = static_cast<std::uint8_t*>(head);
+    Header* header = static_cast<Header*>(head);
+    header->table = static_cast<std::uint32_t>(table);
+    header->count = static_cast<std::uint32_t>(count);
+    std::memcpy(bytes + CODE_OFFSET, a.Head(), codeSize);
+    if (count > 0) {
+        std::memcpy(bytes + table, offsets.RawHeadPointer(), sizeof(std::uint32_t) * count);
+    }
+    if (mprotect(head, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(head, size);
+        fn->SetMachineCode(JitState::Unsupported, nullptr, 0);
+        return;
+    }
+
+    fn->SetMachineCode(JitState::Compiled, head, size);
+    WritePerfMap(rt, fn, bytes + CODE_OFFSET, static_cast<std::int64_t>(codeSize));
+}
+
+// what the current frame does once Run has the control back
+enum class Next {
+    // run it, at its saved pc
+    Continue,
+    // return the source register
+    Return,
+};
+
+// Calls the handler Unwind staged at base. In tail position it takes over
+// the frame that was running tail.
+static Next CallHandler(Runtime* rt, std::int64_t base, Function* tail, std::int64_t* source) {
+    [[maybe_unused]] const Function* returning = tail == nullptr || tail->GetOriginal() == nullptr
+        ? tail : tail->GetOriginal();
+    Value* handler = rt->Local(Integer{base});
+    if (handler->GetType() == ValueType::Function
+            && handler->GetFunction(rt)->GetArity().Unwrap() == 2) {
+        Function* callee = handler->GetFunction(rt);
+        if (tail != nullptr) {
+            // register 0 is the handler already, see TraceTailCall
+            ESPRESSO_PROBE2(function__return, returning, false);
+            if (prof::tracing) {
+                prof::End(rt);
+            }
+            if (callee->CountInvocation()) {
+                rt->Promote(callee);
+            }
+            ESPRESSO_PROBE3(function__entry, callee, 2, false);
+            if (prof::tracing) {
+                prof::BeginCall(rt, "function", callee);
+            }
+            rt->ReuseFrame(Integer{base}, Integer{2}, callee->GetLocalCount());
+        } else {
+            if (callee->CountInvocation()) {
+                rt->Promote(callee);
+            }
+            TraceCall(rt, callee, 2);
+            rt->PushFrame(Integer{base}, Integer{2}, callee->GetLocalCount());
+        }
+        return Next::Continue;
+    }
+    if (tail != nullptr) {
+        // the frame runs the handler and the result takes its place, see
+        // call_Handler in Runtime::Resume
+        [[maybe_unused]] const Object* callee = rt->ProbedCallee(handler);
+        [[maybe_unused]] bool native = handler->GetType() == ValueType::NativeFunction;
+        ESPRESSO_PROBE2(function__return, returning, false);
+        ESPRESSO_PROBE3(function__entry, callee, 2, native);
+        rt->Invoke(Integer{base}, Integer{2});
+        ESPRESSO_PROBE2(function__return, callee, native);
+        *source = base;
+        return Next::Return;
+    }
+    rt->Invoke(Integer{base}, Integer{2});
+    *source = base;
+    return Next::Continue;
+}
+
+// try runs its body as a call from this frame with a handler on top,
+// throw goes straight to that handler when it is one of this Run's. See
+// call_Control in Runtime::Resume.
+static Next Control(Runtime* rt, Context* cx, std::int64_t entryDepth, std::int64_t* source) {
+    std::int64_t base = cx->controlBase;
+    std::int64_t count = cx->controlCount;
+    bool tail = cx->controlTail;
+    cx->control = false;
+
+    Intrinsic intrinsic = rt->Local(Integer{base})->GetNativeFunction(rt)->GetIntrinsic();
+    std::int64_t depth = rt->FrameCount().Unwrap();
+    if (intrinsic == Intrinsic::Try && count == 3 && !tail) {
+        rt->PushHandler(Integer{depth + 1}, rt->CurrentFrame()->AbsoluteIndex(Integer{base}),
+            false, rt->Local(Integer{base + 2}));
+        rt->Local(Integer{base})->Copy(rt->Local(Integer{base + 1}));
+        Value* body = rt->Local(Integer{base});
+        if (body->GetType() == ValueType::Function
+                && body->GetFunction(rt)->GetArity().Unwrap() == 1) {
+            Function* callee = body->GetFunction(rt);
+            if (callee->CountInvocation()) {
+                rt->Promote(callee);
+            }
+            TraceCall(rt, callee, 1);
+            rt->PushFrame(Integer{base}, Integer{1}, callee->GetLocalCount());
+            return Next::Continue;
+        }
+        rt->Invoke(Integer{base}, Integer{1});
+        rt->PopHandlers(Integer{depth + 1});
+        return Next::Continue;
+    }
+    if (intrinsic == Intrinsic::Try && count == 3) {
+        rt->PushHandler(Integer{depth}, Integer{0}, true, rt->Local(Integer{base + 2}));
+        Value* body = rt->Local(Integer{base + 1});
+        if (body->GetType() == ValueType::Function
+                && body->GetFunction(rt)->GetArity().Unwrap() == 1) {
+            Function* callee = body->GetFunction(rt);
+            if (callee->CountInvocation()) {
+                rt->Promote(callee);
+            }
+            TraceTailCall(rt, callee, 1);
+            rt->ReuseFrame(Integer{base + 1}, Integer{1}, callee->GetLocalCount());
+            return Next::Continue;
+        }
+        rt->Invoke(Integer{base + 1}, Integer{1});
+        ESPRESSO_PROBE2(function__return, rt->ProbedCallee(rt->Local(Integer{0})), false);
+        *source = base + 1;
+        return Next::Return;
+    }
+    std::int64_t handlerBase = -1;
+    Function* handlerTail = nullptr;
+    if (intrinsic == Intrinsic::Throw && count == 2
+            && rt->UnwindThrow(entryDepth, rt->CurrentFrame()->AbsoluteIndex(Integer{base + 1}),
+                &handlerBase, &handlerTail)) {
+        return CallHandler(rt, handlerBase, handlerTail, source);
+    }
+    // the native raises the errors, or throws to the frames below
+    rt->Invoke(Integer{base}, Integer{count});
+    *source = base;
+    if (tail) {
+        ESPRESSO_PROBE2(function__return, rt->ProbedCallee(rt->Local(Integer{0})), false);
+        return Next::Return;
+    }
+    return Next::Continue;
+}
+
+// Runs the current frame until it returns or leaves for another frame.
+static Next Step(Runtime* rt, Context* cx, std::int64_t entryDepth, std::int64_t* source) {
+    rt->SafePoint();
+    Function* fn = rt->Local<VerifiedPolicy>(Integer{0})->GetFunction(rt);
+    *source = 0;
+    if (fn->GetJitState() != JitState::Compiled) {
+        rt->Interpret();
+        return Next::Return;
+    }
+
+    Header* header = static_cast<Header*>(fn->GetMachineCode());
+    std::int64_t pc = rt->CurrentFrame<VerifiedPolicy>()->ProgramCounter().Unwrap();
+    std::int64_t returned = EntryOf(header)(
+        cx, rt->Local<VerifiedPolicy>(Integer{0}), ResumeAt(header, pc));
+    if (cx->error) {
+        std::exception_ptr error = cx->error;
+        cx->error = nullptr;
+        std::rethrow_exception(error);
+    }
+    if (returned || cx->returned) {
+        cx->returned = false;
+        ESPRESSO_PROBE2(function__return, fn->GetOriginal() != nullptr ? fn->GetOriginal() : fn, false);
+        return Next::Return;
+    }
+    if (cx->control) {
+        return Control(rt, cx, entryDepth, source);
+    }
+    // entered a callee, or a tail call took over the frame
+    return Next::Continue;
+}
+
+// Runs the frames above entryDepth, first calling the handler at
+// handlerBase when it is not negative. See Runtime::Resume.
+static void Resume(Runtime* rt, std::int64_t entryDepth, std::int64_t handlerBase, Function* handlerTail) {
+    Context cx{rt, nullptr, false, false, 0, 0, false};
+    std::int64_t source = 0;
+    Next next = handlerBase >= 0
+        ? CallHandler(rt, handlerBase, handlerTail, &source)
+        : Next::Continue;
+
+    while (true) {
+        if (next == Next::Continue) {
+            next = Step(rt, &cx, entryDepth, &source);
+            continue;
+        }
+
+        // the result goes to register 0, the caller resumes at its saved pc
+        rt->Local<VerifiedPolicy>(Integer{0})->Copy(rt->Local<VerifiedPolicy>(Integer{source}));
+        std::int64_t depth = rt->FrameCount().Unwrap();
+        rt->PopHandlers(Integer{depth});
+        if (depth == entryDepth) {
+            return;
+        }
+        if (prof::tracing) {
+            prof::End(rt);
+        }
+        rt->PopFrame();
+        next = Next::Continue;
+    }
+}
+
+void Run(Runtime* rt) {
+    // frames below belong to whoever called Run
+    std::int64_t entryDepth = rt->FrameCount().Unwrap();
+
+    // as in Runtime::Interpret, errors raised by natives and the runtime
+    // resume in a handler of these frames when there is one
+    std::int64_t handlerBase = -1;
+    Function* handlerTail = nullptr;
+    while (true) {
+        try {
+            Resume(rt, entryDepth, handlerBase, handlerTail);
+            return;
+        } catch (const ThrowException& e) {
+            if (!rt->Unwind(entryDepth, e.GetAbsoluteStackIndex(), &handlerBase, &handlerTail)) {
+                throw;
+            }
+        }
+    }
+}
+
+void Release(void* code, std::size_t size) {
+    munmap(code, size);
+}
+
+} // jit
+
+} // espresso
@@ -0,0 +1,26 @@
+#pragma once
+
+#include "edep.hh"
+
+namespace espresso {
+
+class Function;
+class Runtime;
+
+namespace jit {
+
+// Runs the function in register 0 of the current frame, and every function
+// it calls, until that frame returns. Functions that have not been
+// compiled are interpreted.
+void Run(Runtime* rt);
+
+// Translates a function to machine code, or marks it as one that stays
+// interpreted. See Runtime::Promote.
+void Compile(Runtime* rt, Function* fn);
+
+// unmaps the machine code of a function
+void Release(void* code, std::size_t size);
+
+} // jit
+
+} // espresso
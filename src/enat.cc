@@ -11,10 +11,13 @@ struct Entry {
     std::int64_t arity;
     std::int64_t localCount;
     NativeFunction::Handle handle;
+    Intrinsic intrinsic = Intrinsic::None;
 };
 
 void Print(Runtime* rt, Value* toPrint);
 
+void PrintFeedback(Runtime* rt, Function* fn);
+
 static constexpr Entry ENTRIES[] = {
     {"readFile", 2, 2, [](Runtime* rt) {
         String* fileName = rt->Local(Integer{1})->GetString(rt);
@@ -53,22 +56,39 @@ static constexpr Entry ENTRIES[] = {
         rt->GetSystem()->Write(rt->GetSystem()->Stdout(), "\n", 1);
         rt->Local(Integer{0})->SetNil();
     }},
-    {"try", 2, 3, [](Runtime* rt) {
-        Integer result{0};
-        const char* key = "result";
+    {"try", 3, 4, [](Runtime* rt) {
+        // (try body handler) gives what body gives, or what handler gives
+        // for what body threw. It replaced (try body), which gave a map
+        // with the key "result" or "error".
+        //
+        // Bytecode has the interpreter run try, this is used by natives.
+        // The body is called above the handler, which its frame would
+        // otherwise overlap. A function body runs with a handler record
+        // as that of a try in tail position, so what it throws reaches the
+        // handler without an exception. Natives raise exceptions.
+        rt->Copy(Integer{3}, Integer{1});
+        Value* body = rt->Local(Integer{3});
+        if (body->GetType() == ValueType::Function && body->GetFunction(rt)->GetArity().Unwrap() == 1) {
+            Integer depth = Integer{rt->FrameCount().Unwrap() + 1};
+            rt->PushHandler(depth, Integer{0}, true, rt->Local(Integer{2}));
+            // the body's return or a throw to the handler pops it, an
+            // error before the body runs does not
+            Defer popHandler{[=](){
+                rt->PopHandlers(depth);
+            }};
+            rt->Invoke(Integer{3}, Integer{1});
+            rt->Copy(Integer{0}, Integer{3});
+            return;
+        }
         try {
-            rt->Invoke(Integer{1}, Integer{1});
-            result = rt->CurrentFrame()->AbsoluteIndex(Integer{1});
+            rt->Invoke(Integer{3}, Integer{1});
+            rt->Copy(Integer{0}, Integer{3});
         } catch (const ThrowException& e) {
-            result = e.GetAbsoluteStackIndex();
-            key = "error";
-        }
-        rt->Local(Integer{2})->SetMap(rt->NewMap());
-        rt->Local(Integer{0})->SetString(rt->NewString(key));
-        Map* map = rt->Local(Integer{2})->GetMap(rt);
-        map->Put(rt, rt->Local(Integer{0}), rt->StackAtAbsoluteIndex(result));
-        rt->Copy(Integer{0}, Integer{2});
-    }},
+            rt->Local(Integer{3})->Copy(rt->StackAtAbsoluteIndex(e.GetAbsoluteStackIndex()));
+            rt->Invoke(Integer{2}, Integer{2});
+            rt->Copy(Integer{0}, Integer{2});
+        }
+    }, Intrinsic::Try},
     {"endsWith", 3, 3, [](Runtime* rt) {
         String* haystack = rt->Local(Integer{1})->GetString(rt);
         String* needle = rt->Local(Integer{2})->GetString(rt);
@@ -227,57 +247,56 @@ static constexpr Entry ENTRIES[] = {
         // invoke the bytecode
     }},
     {"throw", 2, 2, [](Runtime* rt) {
-        Integer absoluteIndex = rt->CurrentFrame()->AbsoluteIndex(Integer{1});
-        throw ThrowException{absoluteIndex};
-    }},
+        rt->Throw(Integer{1});
+    }, Intrinsic::Throw},
     {"=", 3, 3, [](Runtime* rt) {
         Value* v1 = rt->Local(Integer{1});
         Value* v2 = rt->Local(Integer{2});
         bool result = v1->Equals(rt, v2);
         rt->Local(Integer{0})->SetBoolean(result);
-    }},
+    }, Intrinsic::Equal},
     {"<=", 3, 3, [](Runtime* rt) {
         std::int64_t v1 = rt->Local(Integer{1})->GetInteger(rt).Unwrap();
         std::int64_t v2 = rt->Local(Integer{2})->GetInteger(rt).Unwrap();
         bool result = v1 <= v2;
         rt->Local(Integer{0})->SetBoolean(result);
-    }},
+    }, Intrinsic::LessEqual},
     {">=", 3, 3, [](Runtime* rt) {
         std::int64_t v1 = rt->Local(Integer{1})->GetInteger(rt).Unwrap();
         std::int64_t v2 = rt->Local(Integer{2})->GetInteger(rt).Unwrap();
         bool result = v1 >= v2;
         rt->Local(Integer{0})->SetBoolean(result);
-    }},
+    }, Intrinsic::GreaterEqual},
     {"<", 3, 3, [](Runtime* rt) {
         std::int64_t v1 = rt->Local(Integer{1})->GetInteger(rt).Unwrap();
         std::int64_t v2 = rt->Local(Integer{2})->GetInteger(rt).Unwrap();
         bool result = v1 < v2;
         rt->Local(Integer{0})->SetBoolean(result);
-    }},
+    }, Intrinsic::Less},
     {">", 3, 3, [](Runtime* rt) {
         std::int64_t v1 = rt->Local(Integer{1})->GetInteger(rt).Unwrap();
         std::int64_t v2 = rt->Local(Integer{2})->GetInteger(rt).Unwrap();
         bool result = v1 > v2;
         rt->Local(Integer{0})->SetBoolean(result);
-    }},
+    }, Intrinsic::Greater},
     {"+", 3, 3, [](Runtime* rt) {
         std::int64_t v1 = rt->Local(Integer{1})->GetInteger(rt).Unwrap();
         std::int64_t v2 = rt->Local(Integer{2})->GetInteger(rt).Unwrap();
         std::int64_t result = v1 + v2;
         rt->Local(Integer{0})->SetInteger(Integer{result});
-    }},
+    }, Intrinsic::Add},
     {"-", 3, 3, [](Runtime* rt) {
         std::int64_t v1 = rt->Local(Integer{1})->GetInteger(rt).Unwrap();
         std::int64_t v2 = rt->Local(Integer{2})->GetInteger(rt).Unwrap();
         std::int64_t result = v1 - v2;
         rt->Local(Integer{0})->SetInteger(Integer{result});
-    }},
+    }, Intrinsic::Subtract},
     {"*", 3, 3, [](Runtime* rt) {
         std::int64_t v1 = rt->Local(Integer{1})->GetInteger(rt).Unwrap();
         std::int64_t v2 = rt->Local(Integer{2})->GetInteger(rt).Unwrap();
         std::int64_t result = v1 * v2;
         rt->Local(Integer{0})->SetInteger(Integer{result});
-    }},
+    }, Intrinsic::Multiply},
     {"/", 3, 3, [](Runtime* rt) {
         std::int64_t v1 = rt->Local(Integer{1})->GetInteger(rt).Unwrap();
         std::int64_t v2 = rt->Local(Integer{2})->GetInteger(rt).Unwrap();
@@ -287,19 +306,65 @@ static constexpr Entry ENTRIES[] = {
         }
         std::int64_t result = v1 / v2;
         rt->Local(Integer{0})->SetInteger(Integer{result});
-    }},
+    }, Intrinsic::Divide},
     {"globals", 1, 1, [](Runtime* rt) {
         rt->Local(Integer{0})->SetMap(rt->GetGlobals());
     }},
+    {"allocations", 1, 1, [](Runtime* rt) {
+        rt->Local(Integer{0})->SetInteger(rt->AllocationCount());
+    }},
+    {"tier", 2, 2, [](Runtime* rt) {
+        // how a function currently runs, see Function::GetTier
+        Value* target = rt->Local(Integer{1});
+        if (target->GetType() == ValueType::NativeFunction) {
+            rt->Local(Integer{0})->SetString(rt->NewString("native"));
+            return;
+        }
+        if (target->GetType() != ValueType::Function) {
+            rt->Local(Integer{0})->SetString(rt->NewString("Tier of a non function"));
+            rt->Throw(Integer{0});
+        }
+        switch (target->GetFunction(rt)->GetTier()) {
+        case Tier::ByteCode:
+            rt->Local(Integer{0})->SetString(rt->NewString("bytecode"));
+            return;
+        case Tier::Interpreted:
+            rt->Local(Integer{0})->SetString(rt->NewString("interpreted"));
+            return;
+        case Tier::Optimized:
+            rt->Local(Integer{0})->SetString(rt->NewString("optimized"));
+            return;
+        case Tier::Compiled:
+            rt->Local(Integer{0})->SetString(rt->NewString("compiled"));
+            return;
+        }
+    }},
+    {"feedback", 2, 2, [](Runtime* rt) {
+        // prints what the interpreter has seen the function do
+        Value* target = rt->Local(Integer{1});
+        if (target->GetType() != ValueType::Function) {
+            rt->Local(Integer{0})->SetString(rt->NewString("Feedback of a non function"));
+            rt->Throw(Integer{0});
+        }
+        PrintFeedback(rt, target->GetFunction(rt));
+        rt->Local(Integer{0})->SetNil();
+    }},
+    {"clock", 1, 1, [](Runtime* rt) {
+        // monotonic nanoseconds, only meaningful as a difference
+        auto now = std::chrono::steady_clock::now().time_since_epoch();
+        std::int64_t nanos = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+        rt->Local(Integer{0})->SetInteger(Integer{nanos});
+    }},
 };
 
 void RegisterNatives(Runtime* rt) {
     for (const Entry& entry : ENTRIES) {
-        rt->Local(Integer{0})->SetString(rt->NewString(entry.name));
+        rt->Local(Integer{0})->SetString(rt->InternString(entry.name));
 
         rt->Local(Integer{1})->SetNativeFunction(
             rt->NewNativeFunction(
                 Integer{entry.arity}, Integer{entry.localCount}, entry.handle));
+        rt->Local(Integer{1})->GetNativeFunction(rt)->SetIntrinsic(entry.intrinsic);
 
         rt->StoreGlobal(Integer{0}, Integer{1});
 
@@ -310,6 +375,15 @@ void RegisterNatives(Runtime* rt) {
     rt->Local(Integer{0})->SetNil();
 }
 
+const char* NameOf(void (*handle)(Runtime*)) {
+    for (const Entry& entry : ENTRIES) {
+        if (entry.handle == handle) {
+            return entry.name;
+        }
+    }
+    return nullptr;
+}
+
 struct Printed {
     Object* object;
     Printed* next;
@@ -412,6 +486,84 @@ void Print(Runtime* rt, Value* val) {
     DoPrint(rt, val, nullptr, false);
 }
 
+static const char* TypeName(ValueType type) {
+    switch (type) {
+        case ValueType::Nil: return "nil";
+        case ValueType::Integer: return "integer";
+        case ValueType::Double: return "double";
+        case ValueType::Function: return "function";
+        case ValueType::NativeFunction: return "native";
+        case ValueType::String: return "string";
+        case ValueType::Boolean: return "boolean";
+        case ValueType::Map: return "map";
+    }
+    return "unknown";
+}
+
+static void PrintTypes(Runtime* rt, TypeSet types) {
+    System* system = rt->GetSystem();
+    FILE* out = system->Stdout();
+    if (types == 0) {
+        system->Write(out, "-", 1);
+        return;
+    }
+    bool first = true;
+    for (ValueType type : {ValueType::Nil, ValueType::Integer, ValueType::Double,
+            ValueType::Function, ValueType::NativeFunction, ValueType::String,
+            ValueType::Boolean, ValueType::Map}) {
+        if ((types & TypeBit(type)) == 0) {
+            continue;
+        }
+        if (!first) {
+            system->Write(out, "|", 1);
+        }
+        const char* name = TypeName(type);
+        system->Write(out, name, std::strlen(name));
+        first = false;
+    }
+}
+
+// One line for each instruction with feedback, by pc:
+//   3 call native arguments integer integer results integer
+//   7 branch jumped 2 fell through 5
+void PrintFeedback(Runtime* rt, Function* fn) {
+    System* system = rt->GetSystem();
+    FILE* out = system->Stdout();
+    Feedback* sites = fn->FeedbackHead();
+    if (sites == nullptr) {
+        // never ran
+        return;
+    }
+    constexpr std::size_t BUFFER_SIZE = 100;
+    char line[BUFFER_SIZE];
+    std::int64_t count = fn->GetByteCodeCount().Unwrap();
+    for (std::int64_t pc = 0; pc < count; pc++) {
+        Feedback* site = &sites[pc];
+        if (site->callees != CalleeFeedback::None) {
+            const char* callee = "polymorphic";
+            if (site->callees == CalleeFeedback::Monomorphic) {
+                callee = site->callee == nullptr ? "error"
+                    : site->callee->Type() == ObjectType::Function ? "function" : "native";
+            }
+            int length = std::snprintf(line, BUFFER_SIZE, "%lld call %s arguments",
+                static_cast<long long>(pc), callee);
+            system->Write(out, line, static_cast<std::size_t>(length));
+            for (std::int64_t i = 0; i < Feedback::ARGUMENTS && site->arguments[i] != 0; i++) {
+                system->Write(out, " ", 1);
+                PrintTypes(rt, site->arguments[i]);
+            }
+            system->Write(out, " results ", 9);
+            PrintTypes(rt, site->results);
+            system->Write(out, "\n", 1);
+        }
+        if (site->jumped != 0 || site->fellThrough != 0) {
+            int length = std::snprintf(line, BUFFER_SIZE, "%lld branch jumped %u fell through %u\n",
+                static_cast<long long>(pc), site->jumped, site->fellThrough);
+            system->Write(out, line, static_cast<std::size_t>(length));
+        }
+    }
+}
+
 namespace debugger {
 
 void PrintByteCode(Runtime* rt, Function* fn, ByteCode* bc) {
@@ -442,6 +594,33 @@ void PrintByteCode(Runtime* rt, Function* fn, ByteCode* bc) {
                 bc->SmallArgument1().Unwrap(), bc->SmallArgument2().Unwrap());
             break;
         }
+        case ByteCodeType::LoadGlobalConstant: {
+            std::printf(fmt, "loadgc");
+            std::printf("R%lld ", static_cast<long long>(bc->SmallArgument1().Unwrap()));
+            DoPrint(rt, fn->ConstantAt(bc->LargeArgument()), nullptr, true);
+            std::printf("\n");
+            break;
+        }
+        case ByteCodeType::InvokeGlobal: {
+            std::printf(fmt, "invokeg");
+            std::printf(
+                "R%lld %lld ",
+                static_cast<long long>(bc->SmallArgument1().Unwrap()),
+                static_cast<long long>(bc->SmallArgument2().Unwrap()));
+            DoPrint(rt, fn->ConstantAt(bc->SmallArgument3()), nullptr, true);
+            std::printf("\n");
+            break;
+        }
+        case ByteCodeType::InvokeGlobalTail: {
+            std::printf(fmt, "invokegtail");
+            std::printf(
+                "R%lld %lld ",
+                static_cast<long long>(bc->SmallArgument1().Unwrap()),
+                static_cast<long long>(bc->SmallArgument2().Unwrap()));
+            DoPrint(rt, fn->ConstantAt(bc->SmallArgument3()), nullptr, true);
+            std::printf("\n");
+            break;
+        }
         case ByteCodeType::InvokeTail: {
             std::printf(fmt, "invoketail");
             std::printf(
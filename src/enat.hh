@@ -8,6 +8,10 @@ namespace native {
 
 void RegisterNatives(Runtime* rt);
 
+// the name a native of the natives table is registered under, nullptr for
+// any other native
+const char* NameOf(void (*handle)(Runtime*));
+
 namespace debugger {
 
 void Breakpoint(Runtime* runtime);
@@ -0,0 +1,2484 @@
+#include "eopt.hh"
+#include "ert.hh"
+
+#include <limits>
+
+namespace espresso {
+
+namespace opt {
+
+// A function is optimized in four steps. Its bytecode is lifted into a
+// graph of blocks of nodes in SSA form, inlining the small leaf functions
+// it was seen to call. Calls of intrinsics on constants are then folded and
+// repeated ones reused, and nodes that nothing needs are dropped. What is
+// left is lowered back to Instructions with registers allocated anew:
+// values that are used once, right where they are made, live in a stack of
+// registers above all others, the rest share registers by coloring.
+//
+// Globals that name functions when the function is optimized are assumed
+// to keep naming them. Calls into the optimized version check that they
+// still do, and so do Guards after the calls and stores that may redefine
+// them, wherever the code that follows relies on them. A failing Guard
+// resumes the original function, see Runtime::Deoptimize.
+
+using NodeId = std::int32_t;
+using BlockId = std::int32_t;
+
+static constexpr std::int32_t NONE = -1;
+
+// registers of a frame, and the words of a set of them
+static constexpr std::int64_t REGISTERS = 256;
+static constexpr std::int64_t WORDS = REGISTERS / 64;
+
+// larger functions stay interpreted, which keeps optimizing cheap
+static constexpr std::int64_t MAX_BYTECODE = 1024;
+static constexpr std::int64_t MAX_INLINED_BYTECODE = 32;
+static constexpr std::int64_t MAX_NODES = 16384;
+
+enum class Op : std::uint8_t {
+    // register index of the function on entry
+    Param,
+    // value index, also held by the global named by value name if any
+    Constant,
+    // what a call leaves in the registers above its result
+    Undefined,
+    // the global named by value name
+    Global,
+    // the global named by operand 0
+    LoadGlobal,
+    // operand 0 called with the others
+    Call,
+    // stores operand 1 in the global named by operand 0
+    StoreGlobal,
+    // operand i when entered from predecessor i of the block
+    Phi,
+};
+
+struct Node {
+    Op op;
+    // Call: of an intrinsic, which does nothing but compute its result
+    bool pure;
+    // Call: in tail position, ends its block
+    bool tail;
+    // Global: loaded by the InvokeGlobal of the call it is the callee of
+    bool fused;
+    // Call and StoreGlobal: followed by a Guard
+    bool guarded;
+    bool live;
+    BlockId block;
+    std::int32_t index;
+    std::int32_t name;
+    std::int32_t operands;
+    std::int32_t count;
+    // Call and StoreGlobal of the optimized function itself: its registers
+    // live afterwards, and the pc of the original to resume at
+    std::int32_t state;
+    std::int32_t stateCount;
+    std::int64_t pc;
+    NodeId replacement;
+};
+
+struct StateEntry {
+    std::int64_t reg;
+    NodeId node;
+};
+
+enum class Exit : std::uint8_t {
+    None,
+    // to next[0]
+    Goto,
+    // on value to next[0], else to next[1]
+    Branch,
+    Return,
+    // value is the Call
+    TailCall,
+};
+
+struct Block {
+    std::int32_t first;
+    std::int32_t count;
+    std::int32_t preds;
+    std::int32_t predCount;
+    Exit exit;
+    NodeId value;
+    BlockId next[2];
+    // nodes from this index on rely on the assumptions, NONE if none do
+    std::int32_t dependent;
+    bool reachesDependent;
+    bool reachable;
+    std::int32_t order;
+    BlockId idom;
+    std::int64_t exitPos;
+    std::int64_t start;
+};
+
+struct Assumed {
+    std::int32_t name;
+    std::int32_t value;
+};
+
+// how a node is lowered
+struct Lowered {
+    std::int64_t pos;
+    std::int32_t uses;
+    std::int64_t usePos;
+    BlockId useBlock;
+    bool phiUse;
+    bool stateUse;
+    std::int64_t stateFirst;
+    std::int64_t stateLast;
+    // temps sit in slot above the variables, from where their one user
+    // takes them
+    bool temp;
+    std::int32_t slot;
+    // where the operands of the node go, relative to the first slot
+    std::int32_t base;
+    std::int32_t var;
+};
+
+struct Emitted {
+    ByteCodeType type;
+    std::int64_t arg1;
+    std::int64_t arg2;
+    // LoadConstant: the value, LoadGlobalConstant and InvokeGlobal(Tail):
+    // the value of the name
+    std::int32_t value;
+    // Jump and JumpIfFalse: a block, or stub -target - 1
+    std::int32_t target;
+    // Guard: the deopt point
+    std::int32_t point;
+};
+
+struct Point {
+    std::int64_t pc;
+    std::int64_t first;
+    std::int64_t count;
+};
+
+struct PointValue {
+    std::int64_t reg;
+    std::int64_t source;
+    std::int32_t value;
+};
+
+static bool Has(const std::uint64_t* set, std::int64_t bit) {
+    return ((set[bit / 64] >> (bit % 64)) & 1) != 0;
+}
+
+static void Add(std::uint64_t* set, std::int64_t bit) {
+    set[bit / 64] |= std::uint64_t{1} << (bit % 64);
+}
+
+static void Remove(std::uint64_t* set, std::int64_t bit) {
+    set[bit / 64] &= ~(std::uint64_t{1} << (bit % 64));
+}
+
+template<typename T>
+static void Fill(Runtime* rt, Vector<T>* vector, std::int64_t count, T value) {
+    vector->Truncate(Integer{0});
+    T* head = vector->Extend(rt, Integer{count});
+    for (std::int64_t i = 0; i < count; i++) {
+        head[i] = value;
+    }
+}
+
+static bool IsPureIntrinsic(Intrinsic intrinsic) {
+    switch (intrinsic) {
+        case Intrinsic::Equal:
+        case Intrinsic::Less:
+        case Intrinsic::LessEqual:
+        case Intrinsic::Greater:
+        case Intrinsic::GreaterEqual:
+        case Intrinsic::Add:
+        case Intrinsic::Subtract:
+        case Intrinsic::Multiply:
+        case Intrinsic::Divide:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static Intrinsic PureIntrinsicOf(Runtime* rt, Value* value) {
+    if (value == nullptr || value->GetType() != ValueType::NativeFunction) {
+        return Intrinsic::None;
+    }
+    Intrinsic intrinsic = value->GetNativeFunction(rt)->GetIntrinsic();
+    return IsPureIntrinsic(intrinsic) ? intrinsic : Intrinsic::None;
+}
+
+// registers an instruction reads and writes, a call writes all of them
+// from its base up as the frame of the callee lies over them
+static void Effects(ByteCode* bc, std::int64_t regs, std::uint64_t* uses, std::uint64_t* defs) {
+    for (std::int64_t i = 0; i < WORDS; i++) {
+        uses[i] = 0;
+        defs[i] = 0;
+    }
+    std::int64_t arg1 = bc->SmallArgument1().Unwrap();
+    std::int64_t arg2 = bc->SmallArgument2().Unwrap();
+    switch (bc->Type()) {
+        case ByteCodeType::LoadConstant:
+        case ByteCodeType::LoadGlobalConstant: {
+            Add(defs, arg1);
+            break;
+        }
+        case ByteCodeType::LoadGlobal:
+        case ByteCodeType::Copy: {
+            Add(uses, arg2);
+            Add(defs, arg1);
+            break;
+        }
+        case ByteCodeType::Invoke:
+        case ByteCodeType::InvokeTail:
+        case ByteCodeType::InvokeGlobal:
+        case ByteCodeType::InvokeGlobalTail: {
+            bool global = bc->Type() == ByteCodeType::InvokeGlobal
+                || bc->Type() == ByteCodeType::InvokeGlobalTail;
+            for (std::int64_t i = global ? 1 : 0; i < arg2; i++) {
+                Add(uses, arg1 + i);
+            }
+            for (std::int64_t r = arg1; r < regs; r++) {
+                Add(defs, r);
+            }
+            break;
+        }
+        case ByteCodeType::Return:
+        case ByteCodeType::JumpIfFalse: {
+            Add(uses, arg1);
+            break;
+        }
+        case ByteCodeType::StoreGlobal: {
+            Add(uses, arg1);
+            Add(uses, arg2);
+            break;
+        }
+        default: {
+            break;
+        }
+    }
+}
+
+static std::int64_t NextPcs(ByteCode* bc, std::int64_t pc, std::int64_t* next) {
+    switch (bc->Type()) {
+        case ByteCodeType::Return:
+        case ByteCodeType::InvokeTail:
+        case ByteCodeType::InvokeGlobalTail: {
+            return 0;
+        }
+        case ByteCodeType::Jump: {
+            next[0] = bc->LargeArgument().Unwrap();
+            return 1;
+        }
+        case ByteCodeType::JumpIfFalse: {
+            next[0] = pc + 1;
+            next[1] = bc->LargeArgument().Unwrap();
+            return 2;
+        }
+        default: {
+            next[0] = pc + 1;
+            return 1;
+        }
+    }
+}
+
+// a run of bytecode of one function, lifted into one or more blocks
+struct LocalBlock {
+    std::int64_t start;
+    std::int64_t end;
+    std::int32_t succ[2];
+    std::int32_t succCount;
+    std::int32_t preds;
+    std::int32_t predCount;
+    std::int32_t visit;
+    bool reachable;
+    bool processed;
+    BlockId head;
+    BlockId exit;
+};
+
+// The optimized function, or one inlined into it, while it is lifted.
+struct Scope {
+    void Init(Runtime* rt, Function* fn, bool inlined) {
+        this->fn = fn;
+        this->inlined = inlined;
+        this->count = fn->GetByteCodeCount().Unwrap();
+        this->regs = fn->GetLocalCount().Unwrap();
+        this->join = NONE;
+        this->blockAt.Init(rt);
+        this->blocks.Init(rt);
+        this->preds.Init(rt);
+        this->order.Init(rt);
+        this->liveIn.Init(rt);
+        this->liveOut.Init(rt);
+        this->exitStates.Init(rt);
+        this->returnBlocks.Init(rt);
+        this->returnValues.Init(rt);
+    }
+
+    void DeInit(Runtime* rt) {
+        this->blockAt.DeInit(rt);
+        this->blocks.DeInit(rt);
+        this->preds.DeInit(rt);
+        this->order.DeInit(rt);
+        this->liveIn.DeInit(rt);
+        this->liveOut.DeInit(rt);
+        this->exitStates.DeInit(rt);
+        this->returnBlocks.DeInit(rt);
+        this->returnValues.DeInit(rt);
+    }
+
+    Function* fn;
+    bool inlined;
+    std::int64_t count;
+    std::int64_t regs;
+    // the LocalBlock starting at each pc, NONE inside of one
+    Vector<std::int32_t> blockAt;
+    Vector<LocalBlock> blocks;
+    Vector<std::int32_t> preds;
+    // reverse post order of the reachable blocks
+    Vector<std::int32_t> order;
+    // registers live before and after each pc
+    Vector<std::uint64_t> liveIn;
+    Vector<std::uint64_t> liveOut;
+    // register values at the end of each block
+    Vector<NodeId> exitStates;
+    // inlined: where returns go, and where they come from with what
+    BlockId join;
+    Vector<BlockId> returnBlocks;
+    Vector<NodeId> returnValues;
+};
+
+class Optimizer {
+public:
+    void Init(Runtime* rt, Function* root) {
+        this->rt = rt;
+        this->root = root;
+        this->failed = false;
+        this->nodes.Init(rt);
+        this->operands.Init(rt);
+        this->blocks.Init(rt);
+        this->preds.Init(rt);
+        this->schedule.Init(rt);
+        this->states.Init(rt);
+        this->values.Init(rt);
+        this->assumed.Init(rt);
+        this->layout.Init(rt);
+        this->work.Init(rt);
+        this->lowered.Init(rt);
+        this->vars.Init(rt);
+        this->varLive.Init(rt);
+        this->interference.Init(rt);
+        this->colors.Init(rt);
+        this->hints.Init(rt);
+        this->code.Init(rt);
+        this->stubs.Init(rt);
+        this->points.Init(rt);
+        this->pointValues.Init(rt);
+    }
+
+    void DeInit() {
+        this->nodes.DeInit(rt);
+        this->operands.DeInit(rt);
+        this->blocks.DeInit(rt);
+        this->preds.DeInit(rt);
+        this->schedule.DeInit(rt);
+        this->states.DeInit(rt);
+        this->values.DeInit(rt);
+        this->assumed.DeInit(rt);
+        this->layout.DeInit(rt);
+        this->work.DeInit(rt);
+        this->lowered.DeInit(rt);
+        this->vars.DeInit(rt);
+        this->varLive.DeInit(rt);
+        this->interference.DeInit(rt);
+        this->colors.DeInit(rt);
+        this->hints.DeInit(rt);
+        this->code.DeInit(rt);
+        this->stubs.DeInit(rt);
+        this->points.DeInit(rt);
+        this->pointValues.DeInit(rt);
+    }
+
+    // false when the function cannot be optimized
+    bool Run() {
+        if (!Build()) {
+            return false;
+        }
+        RemoveTrivialPhis();
+        Order();
+        Dominators();
+        Simplify();
+        Order();
+        RemoveDeadEdges();
+        RemoveTrivialPhis();
+        PlaceGuards();
+        if (!MarkLive()) {
+            return false;
+        }
+        if (!Lower()) {
+            return false;
+        }
+        Install();
+        return true;
+    }
+
+private:
+    Node* N(NodeId id) const {
+        return this->nodes.At(Integer{id});
+    }
+
+    Block* B(BlockId id) const {
+        return this->blocks.At(Integer{id});
+    }
+
+    Lowered* L(NodeId id) const {
+        return this->lowered.At(Integer{id});
+    }
+
+    Value* V(std::int32_t index) const {
+        return this->values.At(Integer{index});
+    }
+
+    NodeId OperandOf(NodeId id, std::int64_t i) const {
+        return *this->operands.At(Integer{N(id)->operands + i});
+    }
+
+    NodeId ScheduledAt(BlockId b, std::int64_t i) const {
+        return *this->schedule.At(Integer{B(b)->first + i});
+    }
+
+    BlockId PredOf(BlockId b, std::int64_t i) const {
+        return *this->preds.At(Integer{B(b)->preds + i});
+    }
+
+    NodeId Resolve(NodeId id) const {
+        while (N(id)->replacement != NONE) {
+            id = N(id)->replacement;
+        }
+        return id;
+    }
+
+    NodeId NewNode(Op op) {
+        if (this->nodes.Length().Unwrap() >= MAX_NODES) {
+            this->failed = true;
+        }
+        NodeId id = static_cast<NodeId>(this->nodes.Length().Unwrap());
+        Node* node = this->nodes.Push(rt);
+        node->op = op;
+        node->pure = false;
+        node->tail = false;
+        node->fused = false;
+        node->guarded = false;
+        node->live = false;
+        node->block = NONE;
+        node->index = NONE;
+        node->name = NONE;
+        node->operands = 0;
+        node->count = 0;
+        node->state = NONE;
+        node->stateCount = 0;
+        node->pc = 0;
+        node->replacement = NONE;
+        return id;
+    }
+
+    // appends a node to the current block
+    NodeId Emit(Op op, const NodeId* ops, std::int64_t count) {
+        NodeId id = NewNode(op);
+        std::int32_t first = static_cast<std::int32_t>(this->operands.Length().Unwrap());
+        for (std::int64_t i = 0; i < count; i++) {
+            *this->operands.Push(rt) = ops == nullptr ? NONE : ops[i];
+        }
+        N(id)->operands = first;
+        N(id)->count = static_cast<std::int32_t>(count);
+        N(id)->block = this->current;
+        *this->schedule.Push(rt) = id;
+        B(this->current)->count++;
+        return id;
+    }
+
+    NodeId NewPhi(std::int32_t reg, std::int64_t count) {
+        NodeId phi = Emit(Op::Phi, nullptr, count);
+        N(phi)->index = reg;
+        return phi;
+    }
+
+    std::int32_t AddValue(Value* value) {
+        std::int32_t index = static_cast<std::int32_t>(this->values.Length().Unwrap());
+        Value* slot = this->values.Push(rt);
+        slot->SetNil();
+        slot->Copy(value);
+        return index;
+    }
+
+    NodeId NewConstant(std::int32_t value, std::int32_t name) {
+        NodeId id = NewNode(Op::Constant);
+        N(id)->index = value;
+        N(id)->name = name;
+        return id;
+    }
+
+    BlockId NewBlock() {
+        BlockId id = static_cast<BlockId>(this->blocks.Length().Unwrap());
+        Block* block = this->blocks.Push(rt);
+        block->first = 0;
+        block->count = 0;
+        block->preds = 0;
+        block->predCount = 0;
+        block->exit = Exit::None;
+        block->value = NONE;
+        block->next[0] = NONE;
+        block->next[1] = NONE;
+        block->dependent = NONE;
+        block->reachesDependent = false;
+        block->reachable = false;
+        block->order = NONE;
+        block->idom = NONE;
+        block->exitPos = 0;
+        block->start = 0;
+        return id;
+    }
+
+    // nodes are appended to the block opened last
+    void Open(BlockId b) {
+        B(b)->first = static_cast<std::int32_t>(this->schedule.Length().Unwrap());
+        B(b)->count = 0;
+        this->current = b;
+    }
+
+    void SetExit(BlockId b, Exit exit, NodeId value, BlockId next0, BlockId next1) {
+        Block* block = B(b);
+        block->exit = exit;
+        block->value = value;
+        block->next[0] = next0;
+        block->next[1] = next1;
+    }
+
+    void SetPreds(BlockId b, const BlockId* list, std::int64_t count) {
+        B(b)->preds = static_cast<std::int32_t>(this->preds.Length().Unwrap());
+        B(b)->predCount = static_cast<std::int32_t>(count);
+        for (std::int64_t i = 0; i < count; i++) {
+            *this->preds.Push(rt) = list[i];
+        }
+    }
+
+    void MarkDependent(BlockId b, std::int32_t index) {
+        if (B(b)->dependent == NONE || B(b)->dependent > index) {
+            B(b)->dependent = index;
+        }
+    }
+
+    std::int64_t Successors(BlockId b, BlockId* next) const {
+        switch (B(b)->exit) {
+            case Exit::Goto: {
+                next[0] = B(b)->next[0];
+                return 1;
+            }
+            case Exit::Branch: {
+                next[0] = B(b)->next[0];
+                next[1] = B(b)->next[1];
+                return 2;
+            }
+            default: {
+                return 0;
+            }
+        }
+    }
+
+    // A global naming a function becomes a constant that the function
+    // assumes it keeps, anything else is loaded.
+    NodeId GlobalValue(Value* name, bool fused) {
+        Value* current = rt->GetGlobals()->Get(rt, name);
+        std::int32_t nameIndex = AddValue(name);
+        if (current != nullptr
+                && (current->GetType() == ValueType::Function
+                    || current->GetType() == ValueType::NativeFunction)) {
+            std::int32_t valueIndex = AddValue(current);
+            Assume(nameIndex, valueIndex);
+            return NewConstant(valueIndex, nameIndex);
+        }
+        NodeId global = Emit(Op::Global, nullptr, 0);
+        N(global)->name = nameIndex;
+        N(global)->fused = fused;
+        return global;
+    }
+
+    void Assume(std::int32_t name, std::int32_t value) {
+        std::int64_t count = this->assumed.Length().Unwrap();
+        for (std::int64_t i = 0; i < count; i++) {
+            if (V(this->assumed.At(Integer{i})->name)->Equals(rt, V(name))) {
+                return;
+            }
+        }
+        Assumed* assumption = this->assumed.Push(rt);
+        assumption->name = name;
+        assumption->value = value;
+    }
+
+    bool Build() {
+        std::int64_t arity = root->GetArity().Unwrap();
+        std::int64_t regs = root->GetLocalCount().Unwrap();
+        if (regs > REGISTERS) {
+            return false;
+        }
+
+        Value nil;
+        nil.SetNil();
+        this->nil = AddValue(&nil);
+        this->undefined = NewNode(Op::Undefined);
+
+        Scope scope;
+        scope.Init(rt, root, false);
+        Defer deinit{[&]() {
+            scope.DeInit(rt);
+        }};
+
+        this->entry = NewBlock();
+        Open(this->entry);
+        NodeId state[REGISTERS];
+        Value self;
+        self.SetFunction(root);
+        state[0] = NewConstant(AddValue(&self), NONE);
+        for (std::int64_t r = 1; r < regs; r++) {
+            if (r < arity) {
+                state[r] = Emit(Op::Param, nullptr, 0);
+                N(state[r])->index = static_cast<std::int32_t>(r);
+            } else {
+                state[r] = NewConstant(this->nil, NONE);
+            }
+        }
+        return Lift(&scope, this->entry, state) && !this->failed;
+    }
+
+    // Finds the blocks of a function, the order to lift them in and the
+    // registers live at each pc.
+    bool Analyze(Scope* s) {
+        std::int64_t count = s->count;
+        if (count == 0 || count > MAX_BYTECODE || s->regs > REGISTERS) {
+            return false;
+        }
+        // leaders are marked 0 first
+        Fill<std::int32_t>(rt, &s->blockAt, count + 1, NONE);
+        *s->blockAt.At(Integer{0}) = 0;
+        for (std::int64_t pc = 0; pc < count; pc++) {
+            ByteCode* bc = s->fn->ByteCodeAt(Integer{pc});
+            switch (bc->Type()) {
+                case ByteCodeType::Jump:
+                case ByteCodeType::JumpIfFalse: {
+                    std::int64_t target = bc->LargeArgument().Unwrap();
+                    if (target >= count || pc + 1 >= count) {
+                        return false;
+                    }
+                    *s->blockAt.At(Integer{target}) = 0;
+                    *s->blockAt.At(Integer{pc + 1}) = 0;
+                    break;
+                }
+                case ByteCodeType::Return:
+                case ByteCodeType::InvokeTail:
+                case ByteCodeType::InvokeGlobalTail: {
+                    *s->blockAt.At(Integer{pc + 1}) = 0;
+                    break;
+                }
+                case ByteCodeType::NoOp:
+                case ByteCodeType::LoadConstant:
+                case ByteCodeType::LoadGlobal:
+                case ByteCodeType::LoadGlobalConstant:
+                case ByteCodeType::Copy:
+                case ByteCodeType::Invoke:
+                case ByteCodeType::InvokeGlobal:
+                case ByteCodeType::StoreGlobal: {
+                    // falling off the end is left to the interpreter
+                    if (pc + 1 >= count) {
+                        return false;
+                    }
+                    break;
+                }
+                default: {
+                    return false;
+                }
+            }
+        }
+
+        for (std::int64_t pc = 0; pc < count; pc++) {
+            if (*s->blockAt.At(Integer{pc}) != 0) {
+                continue;
+            }
+            std::int32_t index = static_cast<std::int32_t>(s->blocks.Length().Unwrap());
+            if (index > 0) {
+                s->blocks.At(Integer{index - 1})->end = pc;
+            }
+            LocalBlock* block = s->blocks.Push(rt);
+            block->start = pc;
+            block->end = count;
+            block->succCount = 0;
+            block->preds = 0;
+            block->predCount = 0;
+            block->visit = 0;
+            block->reachable = false;
+            block->processed = false;
+            block->head = NONE;
+            block->exit = NONE;
+            *s->blockAt.At(Integer{pc}) = index;
+        }
+
+        std::int64_t blockCount = s->blocks.Length().Unwrap();
+        for (std::int64_t b = 0; b < blockCount; b++) {
+            LocalBlock* block = s->blocks.At(Integer{b});
+            std::int64_t next[2];
+            ByteCode* last = s->fn->ByteCodeAt(Integer{block->end - 1});
+            std::int64_t n = NextPcs(last, block->end - 1, next);
+            block->succCount = static_cast<std::int32_t>(n);
+            for (std::int64_t i = 0; i < n; i++) {
+                block->succ[i] = *s->blockAt.At(Integer{next[i]});
+            }
+        }
+
+        // reverse post order by depth first search
+        Vector<std::int32_t>* stack = &this->work;
+        stack->Truncate(Integer{0});
+        Fill<std::int32_t>(rt, &s->order, blockCount, NONE);
+        std::int64_t remaining = blockCount;
+        *stack->Push(rt) = 0;
+        s->blocks.At(Integer{0})->reachable = true;
+        std::int64_t reachable = 0;
+        while (stack->Length().Unwrap() > 0) {
+            std::int32_t b = *stack->At(Integer{stack->Length().Unwrap() - 1});
+            LocalBlock* block = s->blocks.At(Integer{b});
+            if (block->visit < block->succCount) {
+                std::int32_t succ = block->succ[block->visit++];
+                LocalBlock* next = s->blocks.At(Integer{succ});
+                if (!next->reachable) {
+                    next->reachable = true;
+                    *stack->Push(rt) = succ;
+                }
+                continue;
+            }
+            stack->Pop();
+            *s->order.At(Integer{--remaining}) = b;
+            reachable++;
+        }
+        // the unreachable blocks are left out
+        for (std::int64_t i = 0; i < reachable; i++) {
+            *s->order.At(Integer{i}) = *s->order.At(Integer{blockCount - reachable + i});
+        }
+        s->order.Truncate(Integer{reachable});
+
+        for (std::int64_t i = 0; i < reachable; i++) {
+            LocalBlock* block = s->blocks.At(Integer{*s->order.At(Integer{i})});
+            for (std::int32_t j = 0; j < block->succCount; j++) {
+                s->blocks.At(Integer{block->succ[j]})->predCount++;
+            }
+        }
+        std::int32_t first = 0;
+        for (std::int64_t b = 0; b < blockCount; b++) {
+            LocalBlock* block = s->blocks.At(Integer{b});
+            block->preds = first;
+            first += block->predCount;
+            block->predCount = 0;
+        }
+        Fill<std::int32_t>(rt, &s->preds, first, NONE);
+        for (std::int64_t i = 0; i < reachable; i++) {
+            std::int32_t b = *s->order.At(Integer{i});
+            LocalBlock* block = s->blocks.At(Integer{b});
+            for (std::int32_t j = 0; j < block->succCount; j++) {
+                LocalBlock* succ = s->blocks.At(Integer{block->succ[j]});
+                *s->preds.At(Integer{succ->preds + succ->predCount++}) = b;
+            }
+        }
+
+        Fill<std::uint64_t>(rt, &s->liveIn, count * WORDS, 0);
+        Fill<std::uint64_t>(rt, &s->liveOut, count * WORDS, 0);
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (std::int64_t pc = count - 1; pc >= 0; pc--) {
+                ByteCode* bc = s->fn->ByteCodeAt(Integer{pc});
+                std::uint64_t uses[WORDS];
+                std::uint64_t defs[WORDS];
+                Effects(bc, s->regs, uses, defs);
+                std::int64_t next[2];
+                std::int64_t n = NextPcs(bc, pc, next);
+                std::uint64_t* out = s->liveOut.At(Integer{pc * WORDS});
+                std::uint64_t* in = s->liveIn.At(Integer{pc * WORDS});
+                for (std::int64_t w = 0; w < WORDS; w++) {
+                    std::uint64_t word = 0;
+                    for (std::int64_t i = 0; i < n; i++) {
+                        word |= s->liveIn.At(Integer{next[i] * WORDS + w})[0];
+                    }
+                    out[w] = word;
+                    word = uses[w] | (word & ~defs[w]);
+                    if (word != in[w]) {
+                        in[w] = word;
+                        changed = true;
+                    }
+                }
+            }
+        }
+
+        Fill<NodeId>(rt, &s->exitStates, blockCount * s->regs, NONE);
+        return true;
+    }
+
+    // Lifts a function entered from block from with the registers in
+    // entry. Returns leave an inlined function through its join block.
+    bool Lift(Scope* s, BlockId from, const NodeId* entry) {
+        if (!Analyze(s)) {
+            return false;
+        }
+        std::int64_t reachable = s->order.Length().Unwrap();
+        for (std::int64_t i = 0; i < reachable; i++) {
+            s->blocks.At(Integer{*s->order.At(Integer{i})})->head = NewBlock();
+        }
+        SetExit(from, Exit::Goto, NONE, s->blocks.At(Integer{0})->head, NONE);
+
+        std::int64_t regs = s->regs;
+        NodeId state[REGISTERS];
+        for (std::int64_t i = 0; i < reachable; i++) {
+            std::int32_t b = *s->order.At(Integer{i});
+            LocalBlock block = *s->blocks.At(Integer{b});
+            Open(block.head);
+            std::int64_t predTotal = block.predCount + (b == 0 ? 1 : 0);
+            std::int32_t single = NONE;
+            if (predTotal == 1 && b != 0) {
+                single = *s->preds.At(Integer{block.preds});
+            }
+            if (predTotal == 1 && b == 0) {
+                for (std::int64_t r = 0; r < regs; r++) {
+                    state[r] = entry[r];
+                }
+            } else if (single != NONE && s->blocks.At(Integer{single})->processed) {
+                for (std::int64_t r = 0; r < regs; r++) {
+                    state[r] = *s->exitStates.At(Integer{single * regs + r});
+                }
+            } else {
+                // register 0 is never written
+                state[0] = entry[0];
+                const std::uint64_t* live = s->liveIn.At(Integer{block.start * WORDS});
+                for (std::int64_t r = 1; r < regs; r++) {
+                    state[r] = Has(live, r)
+                        ? NewPhi(static_cast<std::int32_t>(r), predTotal)
+                        : this->undefined;
+                }
+            }
+            if (!Translate(s, b, state)) {
+                return false;
+            }
+            LocalBlock* done = s->blocks.At(Integer{b});
+            done->processed = true;
+            done->exit = this->current;
+            for (std::int64_t r = 0; r < regs; r++) {
+                *s->exitStates.At(Integer{b * regs + r}) = state[r];
+            }
+        }
+
+        BlockId list[MAX_BYTECODE + 1];
+        for (std::int64_t i = 0; i < reachable; i++) {
+            std::int32_t b = *s->order.At(Integer{i});
+            LocalBlock block = *s->blocks.At(Integer{b});
+            std::int64_t count = 0;
+            if (b == 0) {
+                list[count++] = from;
+            }
+            for (std::int32_t j = 0; j < block.predCount; j++) {
+                std::int32_t pred = *s->preds.At(Integer{block.preds + j});
+                list[count++] = s->blocks.At(Integer{pred})->exit;
+            }
+            SetPreds(block.head, list, count);
+            for (std::int32_t j = 0; j < B(block.head)->count; j++) {
+                NodeId phi = ScheduledAt(block.head, j);
+                if (N(phi)->op != Op::Phi) {
+                    break;
+                }
+                std::int64_t r = N(phi)->index;
+                std::int64_t k = 0;
+                if (b == 0) {
+                    *this->operands.At(Integer{N(phi)->operands + k++}) = entry[r];
+                }
+                for (std::int32_t p = 0; p < block.predCount; p++) {
+                    std::int32_t pred = *s->preds.At(Integer{block.preds + p});
+                    *this->operands.At(Integer{N(phi)->operands + k++}) =
+                        *s->exitStates.At(Integer{pred * regs + r});
+                }
+            }
+        }
+        return true;
+    }
+
+    void Return(Scope* s, NodeId value) {
+        if (s->inlined) {
+            SetExit(this->current, Exit::Goto, NONE, s->join, NONE);
+            *s->returnBlocks.Push(rt) = this->current;
+            *s->returnValues.Push(rt) = value;
+        } else {
+            SetExit(this->current, Exit::Return, value, NONE, NONE);
+        }
+    }
+
+    BlockId HeadAt(Scope* s, std::int64_t pc) const {
+        std::int32_t b = *s->blockAt.At(Integer{pc});
+        return s->blocks.At(Integer{b})->head;
+    }
+
+    bool Translate(Scope* s, std::int32_t b, NodeId* state) {
+        LocalBlock block = *s->blocks.At(Integer{b});
+        for (std::int64_t pc = block.start; pc < block.end; pc++) {
+            if (this->failed) {
+                return false;
+            }
+            ByteCode* bc = s->fn->ByteCodeAt(Integer{pc});
+            std::int64_t arg1 = bc->SmallArgument1().Unwrap();
+            std::int64_t arg2 = bc->SmallArgument2().Unwrap();
+            std::int64_t arg3 = bc->SmallArgument3().Unwrap();
+            std::int64_t large = bc->LargeArgument().Unwrap();
+            switch (bc->Type()) {
+                case ByteCodeType::NoOp: {
+                    break;
+                }
+                case ByteCodeType::LoadConstant: {
+                    state[arg1] = NewConstant(AddValue(s->fn->ConstantAt(Integer{large})), NONE);
+                    break;
+                }
+                case ByteCodeType::LoadGlobalConstant: {
+                    state[arg1] = GlobalValue(s->fn->ConstantAt(Integer{large}), false);
+                    break;
+                }
+                case ByteCodeType::LoadGlobal: {
+                    NodeId key = state[arg2];
+                    state[arg1] = Emit(Op::LoadGlobal, &key, 1);
+                    break;
+                }
+                case ByteCodeType::Copy: {
+                    state[arg1] = state[arg2];
+                    break;
+                }
+                case ByteCodeType::StoreGlobal: {
+                    NodeId ops[2] = {state[arg1], state[arg2]};
+                    NodeId store = Emit(Op::StoreGlobal, ops, 2);
+                    if (!s->inlined) {
+                        Snapshot(s, store, pc, state);
+                    }
+                    break;
+                }
+                case ByteCodeType::Return: {
+                    Return(s, state[arg1]);
+                    return true;
+                }
+                case ByteCodeType::Jump: {
+                    SetExit(this->current, Exit::Goto, NONE, HeadAt(s, large), NONE);
+                    return true;
+                }
+                case ByteCodeType::JumpIfFalse: {
+                    SetExit(this->current, Exit::Branch, state[arg1], HeadAt(s, pc + 1), HeadAt(s, large));
+                    return true;
+                }
+                case ByteCodeType::Invoke:
+                case ByteCodeType::InvokeTail:
+                case ByteCodeType::InvokeGlobal:
+                case ByteCodeType::InvokeGlobalTail: {
+                    bool global = bc->Type() == ByteCodeType::InvokeGlobal
+                        || bc->Type() == ByteCodeType::InvokeGlobalTail;
+                    bool tail = bc->Type() == ByteCodeType::InvokeTail
+                        || bc->Type() == ByteCodeType::InvokeGlobalTail;
+                    NodeId callee = global
+                        ? GlobalValue(s->fn->ConstantAt(Integer{arg3}), true)
+                        : state[arg1];
+                    bool inlined = false;
+                    NodeId result = Call(s, pc, callee, &state[arg1 + 1], arg2 - 1, tail, &inlined);
+                    if (result == NONE) {
+                        return false;
+                    }
+                    if (tail) {
+                        if (inlined || s->inlined) {
+                            Return(s, result);
+                        }
+                        return true;
+                    }
+                    state[arg1] = result;
+                    for (std::int64_t r = arg1 + 1; r < s->regs; r++) {
+                        state[r] = this->undefined;
+                    }
+                    if (!inlined && !s->inlined && !N(result)->pure) {
+                        Snapshot(s, result, pc, state);
+                    }
+                    break;
+                }
+                default: {
+                    return false;
+                }
+            }
+        }
+        SetExit(this->current, Exit::Goto, NONE, HeadAt(s, block.end), NONE);
+        return true;
+    }
+
+    // the registers of the original function that a Guard after the node
+    // has to rebuild
+    void Snapshot(Scope* s, NodeId node, std::int64_t pc, const NodeId* state) {
+        std::int32_t first = static_cast<std::int32_t>(this->states.Length().Unwrap());
+        const std::uint64_t* live = s->liveOut.At(Integer{pc * WORDS});
+        for (std::int64_t r = 1; r < s->regs; r++) {
+            if (Has(live, r)) {
+                StateEntry* entry = this->states.Push(rt);
+                entry->reg = r;
+                entry->node = state[r];
+            }
+        }
+        N(node)->state = first;
+        N(node)->stateCount = static_cast<std::int32_t>(this->states.Length().Unwrap() - first);
+        N(node)->pc = pc + 1;
+    }
+
+    bool IsPure(NodeId callee, std::int64_t count) const {
+        return count == 3
+            && N(callee)->op == Op::Constant
+            && PureIntrinsicOf(rt, V(N(callee)->index)) != Intrinsic::None;
+    }
+
+    NodeId Call(Scope* s, std::int64_t pc, NodeId callee, const NodeId* args,
+            std::int64_t argc, bool tail, bool* inlined) {
+        if (!s->inlined) {
+            Function* fn = Inlinable(pc, callee, argc);
+            if (fn != nullptr) {
+                *inlined = true;
+                return Inline(fn, callee, args, argc);
+            }
+        }
+        NodeId ops[REGISTERS];
+        ops[0] = callee;
+        for (std::int64_t i = 0; i < argc; i++) {
+            ops[i + 1] = args[i];
+        }
+        NodeId call = Emit(Op::Call, ops, argc + 1);
+        N(call)->pure = IsPure(callee, argc + 1);
+        N(call)->pc = pc;
+        if (tail && !s->inlined) {
+            N(call)->tail = true;
+            SetExit(this->current, Exit::TailCall, call, NONE, NONE);
+        }
+        return call;
+    }
+
+    // the callee, if it is always the same small function that calls
+    // nothing but intrinsics
+    Function* Inlinable(std::int64_t pc, NodeId callee, std::int64_t argc) const {
+        if (N(callee)->op != Op::Constant) {
+            return nullptr;
+        }
+        Value* value = V(N(callee)->index);
+        if (value->GetType() != ValueType::Function) {
+            return nullptr;
+        }
+        Function* fn = value->GetFunction(rt);
+        if (fn == root
+                || !fn->IsVerified()
+                || fn->GetArity().Unwrap() != argc + 1
+                || fn->GetByteCodeCount().Unwrap() > MAX_INLINED_BYTECODE) {
+            return nullptr;
+        }
+        Feedback* feedback = root->FeedbackHead();
+        if (feedback == nullptr
+                || feedback[pc].callees != CalleeFeedback::Monomorphic
+                || feedback[pc].callee != fn) {
+            return nullptr;
+        }
+        std::int64_t count = fn->GetByteCodeCount().Unwrap();
+        for (std::int64_t i = 0; i < count; i++) {
+            ByteCode* bc = fn->ByteCodeAt(Integer{i});
+            switch (bc->Type()) {
+                case ByteCodeType::NoOp:
+                case ByteCodeType::LoadConstant:
+                case ByteCodeType::LoadGlobal:
+                case ByteCodeType::LoadGlobalConstant:
+                case ByteCodeType::Copy:
+                case ByteCodeType::Return:
+                case ByteCodeType::Jump:
+                case ByteCodeType::JumpIfFalse: {
+                    break;
+                }
+                case ByteCodeType::InvokeGlobal:
+                case ByteCodeType::InvokeGlobalTail: {
+                    Value* name = fn->ConstantAt(bc->SmallArgument3());
+                    if (bc->SmallArgument2().Unwrap() != 3
+                            || PureIntrinsicOf(rt, rt->GetGlobals()->Get(rt, name)) == Intrinsic::None) {
+                        return nullptr;
+                    }
+                    break;
+                }
+                default: {
+                    return nullptr;
+                }
+            }
+        }
+        return fn;
+    }
+
+    NodeId Inline(Function* fn, NodeId callee, const NodeId* args, std::int64_t argc) {
+        Scope scope;
+        scope.Init(rt, fn, true);
+        Defer deinit{[&]() {
+            scope.DeInit(rt);
+        }};
+        if (scope.regs > REGISTERS) {
+            return NONE;
+        }
+        NodeId entry[REGISTERS];
+        entry[0] = NewConstant(N(callee)->index, NONE);
+        for (std::int64_t r = 1; r < scope.regs; r++) {
+            entry[r] = r <= argc ? args[r - 1] : NewConstant(this->nil, NONE);
+        }
+
+        // running the callee's code in place of calling it is what
+        // relies on the global not being redefined
+        BlockId from = this->current;
+        MarkDependent(from, B(from)->count);
+        scope.join = NewBlock();
+        if (!Lift(&scope, from, entry)) {
+            return NONE;
+        }
+        std::int64_t returns = scope.returnBlocks.Length().Unwrap();
+        if (returns == 0) {
+            return NONE;
+        }
+        Open(scope.join);
+        SetPreds(scope.join, scope.returnBlocks.RawHeadPointer(), returns);
+        if (returns == 1) {
+            return *scope.returnValues.At(Integer{0});
+        }
+        NodeId phi = NewPhi(NONE, returns);
+        for (std::int64_t i = 0; i < returns; i++) {
+            *this->operands.At(Integer{N(phi)->operands + i}) = *scope.returnValues.At(Integer{i});
+        }
+        return phi;
+    }
+
+    // a phi of one value, and itself, is that value
+    void RemoveTrivialPhis() {
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            std::int64_t count = this->nodes.Length().Unwrap();
+            for (NodeId id = 0; id < count; id++) {
+                if (N(id)->op != Op::Phi || N(id)->replacement != NONE) {
+                    continue;
+                }
+                NodeId same = NONE;
+                bool trivial = true;
+                for (std::int32_t i = 0; i < N(id)->count; i++) {
+                    NodeId operand = Resolve(OperandOf(id, i));
+                    if (operand == id || operand == this->undefined) {
+                        continue;
+                    }
+                    if (same != NONE && same != operand) {
+                        trivial = false;
+                        break;
+                    }
+                    same = operand;
+                }
+                if (trivial) {
+                    N(id)->replacement = same == NONE ? this->undefined : same;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    // reverse post order of the reachable blocks
+    void Order() {
+        std::int64_t blockCount = this->blocks.Length().Unwrap();
+        for (BlockId b = 0; b < blockCount; b++) {
+            B(b)->reachable = false;
+            B(b)->order = 0;
+        }
+        Vector<std::int32_t>* stack = &this->work;
+        stack->Truncate(Integer{0});
+        this->layout.Truncate(Integer{0});
+        B(this->entry)->reachable = true;
+        *stack->Push(rt) = this->entry;
+        while (stack->Length().Unwrap() > 0) {
+            BlockId b = *stack->At(Integer{stack->Length().Unwrap() - 1});
+            BlockId next[2];
+            std::int64_t n = Successors(b, next);
+            if (B(b)->order < n) {
+                BlockId succ = next[B(b)->order++];
+                if (!B(succ)->reachable) {
+                    B(succ)->reachable = true;
+                    *stack->Push(rt) = succ;
+                }
+                continue;
+            }
+            stack->Pop();
+            *this->layout.Push(rt) = b;
+        }
+        std::int64_t count = this->layout.Length().Unwrap();
+        for (std::int64_t i = 0; i < count / 2; i++) {
+            BlockId swap = *this->layout.At(Integer{i});
+            *this->layout.At(Integer{i}) = *this->layout.At(Integer{count - 1 - i});
+            *this->layout.At(Integer{count - 1 - i}) = swap;
+        }
+        for (std::int64_t i = 0; i < count; i++) {
+            B(*this->layout.At(Integer{i}))->order = static_cast<std::int32_t>(i);
+        }
+    }
+
+    BlockId Intersect(BlockId a, BlockId b) const {
+        while (a != b) {
+            while (B(a)->order > B(b)->order) {
+                a = B(a)->idom;
+            }
+            while (B(b)->order > B(a)->order) {
+                b = B(b)->idom;
+            }
+        }
+        return a;
+    }
+
+    // immediate dominators, as by Cooper, Harvey and Kennedy
+    void Dominators() {
+        std::int64_t count = this->layout.Length().Unwrap();
+        for (std::int64_t i = 0; i < count; i++) {
+            B(*this->layout.At(Integer{i}))->idom = NONE;
+        }
+        B(this->entry)->idom = this->entry;
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (std::int64_t i = 1; i < count; i++) {
+                BlockId b = *this->layout.At(Integer{i});
+                BlockId idom = NONE;
+                for (std::int32_t p = 0; p < B(b)->predCount; p++) {
+                    BlockId pred = PredOf(b, p);
+                    if (!B(pred)->reachable || B(pred)->idom == NONE) {
+                        continue;
+                    }
+                    idom = idom == NONE ? pred : Intersect(pred, idom);
+                }
+                if (B(b)->idom != idom) {
+                    B(b)->idom = idom;
+                    changed = true;
+                }
+            }
+        }
+    }
+
+    bool Dominates(BlockId a, BlockId b) const {
+        while (b != a) {
+            if (b == this->entry) {
+                return false;
+            }
+            b = B(b)->idom;
+        }
+        return true;
+    }
+
+    bool SameValue(NodeId a, NodeId b) const {
+        if (a == b) {
+            return true;
+        }
+        return N(a)->op == Op::Constant
+            && N(b)->op == Op::Constant
+            && V(N(a)->index)->Equals(rt, V(N(b)->index));
+    }
+
+    bool SameCall(NodeId a, NodeId b) const {
+        if (N(a)->count != N(b)->count) {
+            return false;
+        }
+        for (std::int32_t i = 0; i < N(a)->count; i++) {
+            if (!SameValue(OperandOf(a, i), OperandOf(b, i))) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // the constant result of an intrinsic applied to constants, if it
+    // would not raise an error
+    NodeId Fold(NodeId call) {
+        NodeId lhs = OperandOf(call, 1);
+        NodeId rhs = OperandOf(call, 2);
+        if (N(lhs)->op != Op::Constant || N(rhs)->op != Op::Constant) {
+            return NONE;
+        }
+        Intrinsic intrinsic = PureIntrinsicOf(rt, V(N(OperandOf(call, 0))->index));
+        Value* x = V(N(lhs)->index);
+        Value* y = V(N(rhs)->index);
+        Value result;
+        if (intrinsic == Intrinsic::Equal) {
+            result.SetBoolean(x->Equals(rt, y));
+            return NewConstant(AddValue(&result), NONE);
+        }
+        if (x->GetType() != ValueType::Integer || y->GetType() != ValueType::Integer) {
+            return NONE;
+        }
+        std::int64_t a = x->GetInteger(rt).Unwrap();
+        std::int64_t b = y->GetInteger(rt).Unwrap();
+        std::uint64_t ua = static_cast<std::uint64_t>(a);
+        std::uint64_t ub = static_cast<std::uint64_t>(b);
+        switch (intrinsic) {
+            case Intrinsic::Less: result.SetBoolean(a < b); break;
+            case Intrinsic::LessEqual: result.SetBoolean(a <= b); break;
+            case Intrinsic::Greater: result.SetBoolean(a > b); break;
+            case Intrinsic::GreaterEqual: result.SetBoolean(a >= b); break;
+            case Intrinsic::Add: result.SetInteger(Integer{static_cast<std::int64_t>(ua + ub)}); break;
+            case Intrinsic::Subtract: result.SetInteger(Integer{static_cast<std::int64_t>(ua - ub)}); break;
+            case Intrinsic::Multiply: result.SetInteger(Integer{static_cast<std::int64_t>(ua * ub)}); break;
+            case Intrinsic::Divide: {
+                if (b == 0 || (a == std::numeric_limits<std::int64_t>::min() && b == -1)) {
+                    return NONE;
+                }
+                result.SetInteger(Integer{a / b});
+                break;
+            }
+            default: {
+                return NONE;
+            }
+        }
+        return NewConstant(AddValue(&result), NONE);
+    }
+
+    void RemoveEdge(BlockId from, BlockId to) {
+        Block* block = B(to);
+        std::int32_t k = NONE;
+        for (std::int32_t i = 0; i < block->predCount; i++) {
+            if (PredOf(to, i) == from) {
+                k = i;
+                break;
+            }
+        }
+        if (k == NONE) {
+            return;
+        }
+        for (std::int32_t i = k; i + 1 < block->predCount; i++) {
+            *this->preds.At(Integer{block->preds + i}) = PredOf(to, i + 1);
+        }
+        block->predCount--;
+        for (std::int32_t i = 0; i < block->count; i++) {
+            NodeId phi = ScheduledAt(to, i);
+            if (N(phi)->op != Op::Phi) {
+                break;
+            }
+            for (std::int32_t j = k; j + 1 < N(phi)->count; j++) {
+                *this->operands.At(Integer{N(phi)->operands + j}) = OperandOf(phi, j + 1);
+            }
+            N(phi)->count--;
+        }
+    }
+
+    // Folds intrinsics of constants and the branches on them, and reuses
+    // the result of an intrinsic already applied to the same values in a
+    // dominating block, or of a global loaded earlier in the same one.
+    void Simplify() {
+        Vector<std::int32_t>* available = &this->work;
+        available->Truncate(Integer{0});
+        std::int64_t count = this->layout.Length().Unwrap();
+        for (std::int64_t l = 0; l < count; l++) {
+            BlockId b = *this->layout.At(Integer{l});
+            std::int64_t globals = available->Length().Unwrap();
+            for (std::int32_t i = 0; i < B(b)->count; i++) {
+                NodeId id = ScheduledAt(b, i);
+                if (N(id)->replacement != NONE) {
+                    continue;
+                }
+                for (std::int32_t k = 0; k < N(id)->count; k++) {
+                    NodeId operand = OperandOf(id, k);
+                    if (operand != NONE) {
+                        *this->operands.At(Integer{N(id)->operands + k}) = Resolve(operand);
+                    }
+                }
+                if (N(id)->op == Op::Call && N(id)->pure && !N(id)->tail) {
+                    NodeId same = Fold(id);
+                    for (std::int64_t j = 0; same == NONE && j < globals; j++) {
+                        NodeId other = *available->At(Integer{j});
+                        if (N(other)->op == Op::Call && SameCall(id, other) && Dominates(N(other)->block, b)) {
+                            same = other;
+                        }
+                    }
+                    if (same != NONE) {
+                        N(id)->replacement = same;
+                        MarkDependent(b, i);
+                        continue;
+                    }
+                    // kept ahead of the globals of this block
+                    *available->Push(rt) = NONE;
+                    for (std::int64_t j = available->Length().Unwrap() - 1; j > globals; j--) {
+                        *available->At(Integer{j}) = *available->At(Integer{j - 1});
+                    }
+                    *available->At(Integer{globals++}) = id;
+                } else if (N(id)->op == Op::Global && !N(id)->fused) {
+                    NodeId same = NONE;
+                    std::int64_t end = available->Length().Unwrap();
+                    for (std::int64_t j = globals; same == NONE && j < end; j++) {
+                        NodeId other = *available->At(Integer{j});
+                        if (V(N(other)->name)->Equals(rt, V(N(id)->name))) {
+                            same = other;
+                        }
+                    }
+                    if (same != NONE) {
+                        N(id)->replacement = same;
+                        MarkDependent(b, i);
+                        continue;
+                    }
+                    *available->Push(rt) = id;
+                } else if (N(id)->op == Op::StoreGlobal || (N(id)->op == Op::Call && !N(id)->pure)) {
+                    available->Truncate(Integer{globals});
+                }
+            }
+            available->Truncate(Integer{globals});
+
+            Block* block = B(b);
+            if (block->value != NONE) {
+                block->value = Resolve(block->value);
+            }
+            if (block->exit == Exit::Branch && N(block->value)->op == Op::Constant) {
+                bool truthy = V(N(block->value)->index)->IsTruthy();
+                BlockId keep = block->next[truthy ? 0 : 1];
+                BlockId drop = block->next[truthy ? 1 : 0];
+                SetExit(b, Exit::Goto, NONE, keep, NONE);
+                RemoveEdge(b, drop);
+            }
+        }
+    }
+
+    // edges out of blocks that can no longer be reached
+    void RemoveDeadEdges() {
+        std::int64_t blockCount = this->blocks.Length().Unwrap();
+        for (BlockId b = 0; b < blockCount; b++) {
+            if (B(b)->reachable) {
+                continue;
+            }
+            BlockId next[2];
+            std::int64_t n = Successors(b, next);
+            for (std::int64_t i = 0; i < n; i++) {
+                RemoveEdge(b, next[i]);
+            }
+            B(b)->exit = Exit::None;
+        }
+    }
+
+    // A call or store that may redefine a global needs a Guard when code
+    // relying on the assumptions may run after it in the same frame.
+    void PlaceGuards() {
+        if (this->assumed.Length().Unwrap() == 0) {
+            return;
+        }
+        std::int64_t count = this->layout.Length().Unwrap();
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (std::int64_t l = count - 1; l >= 0; l--) {
+                BlockId b = *this->layout.At(Integer{l});
+                bool reaches = B(b)->dependent != NONE;
+                BlockId next[2];
+                std::int64_t n = Successors(b, next);
+                for (std::int64_t i = 0; i < n; i++) {
+                    reaches = reaches || B(next[i])->reachesDependent;
+                }
+                if (reaches != B(b)->reachesDependent) {
+                    B(b)->reachesDependent = reaches;
+                    changed = true;
+                }
+            }
+        }
+        for (std::int64_t l = 0; l < count; l++) {
+            BlockId b = *this->layout.At(Integer{l});
+            BlockId next[2];
+            std::int64_t n = Successors(b, next);
+            bool later = false;
+            for (std::int64_t i = 0; i < n; i++) {
+                later = later || B(next[i])->reachesDependent;
+            }
+            for (std::int32_t i = 0; i < B(b)->count; i++) {
+                NodeId id = ScheduledAt(b, i);
+                if (N(id)->replacement != NONE || N(id)->state == NONE) {
+                    continue;
+                }
+                N(id)->guarded = later || B(b)->dependent > i;
+            }
+        }
+    }
+
+    void Live(NodeId id) {
+        id = Resolve(id);
+        if (!N(id)->live) {
+            N(id)->live = true;
+            *this->work.Push(rt) = id;
+        }
+    }
+
+    // Marks the nodes that have effects and what they need. Fails when a
+    // needed value is one a call left behind.
+    bool MarkLive() {
+        this->work.Truncate(Integer{0});
+        std::int64_t count = this->layout.Length().Unwrap();
+        for (std::int64_t l = 0; l < count; l++) {
+            BlockId b = *this->layout.At(Integer{l});
+            for (std::int32_t i = 0; i < B(b)->count; i++) {
+                NodeId id = ScheduledAt(b, i);
+                Node* node = N(id);
+                if (node->replacement != NONE) {
+                    continue;
+                }
+                bool effects = false;
+                switch (node->op) {
+                    case Op::Call: {
+                        // the others raise errors on the wrong types
+                        effects = !node->pure
+                            || node->tail
+                            || PureIntrinsicOf(rt, V(N(OperandOf(id, 0))->index)) != Intrinsic::Equal;
+                        break;
+                    }
+                    case Op::Global: {
+                        effects = !node->fused;
+                        break;
+                    }
+                    case Op::LoadGlobal:
+                    case Op::StoreGlobal: {
+                        effects = true;
+                        break;
+                    }
+                    default: {
+                        break;
+                    }
+                }
+                if (effects) {
+                    Live(id);
+                }
+                if (N(id)->guarded) {
+                    for (std::int32_t k = 0; k < N(id)->stateCount; k++) {
+                        Live(this->states.At(Integer{N(id)->state + k})->node);
+                    }
+                }
+            }
+            if (B(b)->exit == Exit::Branch || B(b)->exit == Exit::Return) {
+                Live(B(b)->value);
+            }
+        }
+        while (this->work.Length().Unwrap() > 0) {
+            NodeId id = *this->work.At(Integer{this->work.Length().Unwrap() - 1});
+            this->work.Pop();
+            for (std::int32_t k = 0; k < N(id)->count; k++) {
+                Live(OperandOf(id, k));
+            }
+        }
+        std::int64_t nodeCount = this->nodes.Length().Unwrap();
+        for (NodeId id = 0; id < nodeCount; id++) {
+            if (!N(id)->live || N(id)->op == Op::Phi) {
+                continue;
+            }
+            if (id == this->undefined) {
+                return false;
+            }
+            for (std::int32_t k = 0; k < N(id)->count; k++) {
+                if (Resolve(OperandOf(id, k)) == this->undefined) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    bool IsGlobalCallee(NodeId id) const {
+        return (N(id)->op == Op::Global && N(id)->fused)
+            || (N(id)->op == Op::Constant && N(id)->name != NONE);
+    }
+
+    // nodes with a result that something reads, where one is needed
+    bool HasResult(NodeId id) const {
+        switch (N(id)->op) {
+            case Op::Call: return !N(id)->tail;
+            case Op::Global: return !N(id)->fused;
+            case Op::LoadGlobal:
+            case Op::Param:
+            case Op::Phi: return true;
+            default: return false;
+        }
+    }
+
+    bool IsTemp(NodeId id) const {
+        return HasResult(id) && N(id)->live && L(id)->temp;
+    }
+
+    bool IsVar(NodeId id) const {
+        return HasResult(id) && N(id)->live && L(id)->var != NONE;
+    }
+
+    void Use(NodeId id, std::int64_t pos, BlockId b, bool phi) {
+        Lowered* lowered = L(Resolve(id));
+        lowered->uses++;
+        lowered->usePos = pos;
+        lowered->useBlock = b;
+        lowered->phiUse = lowered->phiUse || phi;
+    }
+
+    void StateUse(NodeId id, std::int64_t pos) {
+        Lowered* lowered = L(Resolve(id));
+        if (!lowered->stateUse || pos < lowered->stateFirst) {
+            lowered->stateFirst = pos;
+        }
+        if (!lowered->stateUse || pos > lowered->stateLast) {
+            lowered->stateLast = pos;
+        }
+        lowered->stateUse = true;
+    }
+
+    // the slot of operand k of a node, relative to its base
+    static std::int64_t OperandSlot(Op op, std::int64_t k) {
+        return op == Op::LoadGlobal ? 0 : k;
+    }
+
+    bool Lower() {
+        std::int64_t nodeCount = this->nodes.Length().Unwrap();
+        this->lowered.Truncate(Integer{0});
+        Lowered* head = this->lowered.Extend(rt, Integer{nodeCount});
+        for (std::int64_t i = 0; i < nodeCount; i++) {
+            head[i] = Lowered{0, 0, 0, NONE, false, false, 0, 0, false, NONE, 0, NONE};
+        }
+
+        std::int64_t count = this->layout.Length().Unwrap();
+        std::int64_t pos = 0;
+        for (std::int64_t l = 0; l < count; l++) {
+            BlockId b = *this->layout.At(Integer{l});
+            for (std::int32_t i = 0; i < B(b)->count; i++) {
+                NodeId id = ScheduledAt(b, i);
+                if (N(id)->replacement == NONE && N(id)->live) {
+                    L(id)->pos = pos++;
+                }
+            }
+            B(b)->exitPos = pos++;
+        }
+        for (std::int64_t l = 0; l < count; l++) {
+            BlockId b = *this->layout.At(Integer{l});
+            for (std::int32_t i = 0; i < B(b)->count; i++) {
+                NodeId id = ScheduledAt(b, i);
+                if (N(id)->replacement != NONE || !N(id)->live) {
+                    continue;
+                }
+                if (N(id)->op == Op::Phi) {
+                    for (std::int32_t k = 0; k < N(id)->count; k++) {
+                        BlockId pred = PredOf(b, k);
+                        if (B(pred)->reachable) {
+                            Use(OperandOf(id, k), B(pred)->exitPos, pred, true);
+                        }
+                    }
+                    continue;
+                }
+                for (std::int32_t k = 0; k < N(id)->count; k++) {
+                    Use(OperandOf(id, k), L(id)->pos, b, false);
+                }
+                if (N(id)->guarded) {
+                    for (std::int32_t k = 0; k < N(id)->stateCount; k++) {
+                        StateUse(this->states.At(Integer{N(id)->state + k})->node, L(id)->pos);
+                    }
+                }
+            }
+            if (B(b)->exit == Exit::Branch || B(b)->exit == Exit::Return) {
+                Use(B(b)->value, B(b)->exitPos, b, false);
+            }
+        }
+
+        // used once, in the block it is made in, and never needed by a
+        // Guard past that use
+        for (NodeId id = 0; id < nodeCount; id++) {
+            Node* node = N(id);
+            Lowered* lowered = L(id);
+            if (!node->live || node->replacement != NONE || !HasResult(id)) {
+                continue;
+            }
+            lowered->temp = node->op != Op::Param
+                && node->op != Op::Phi
+                && lowered->uses == 1
+                && !lowered->phiUse
+                && lowered->useBlock == node->block
+                && (!lowered->stateUse
+                    || (lowered->stateFirst >= lowered->pos && lowered->stateLast < lowered->usePos));
+        }
+
+        while (true) {
+            AssignSlots();
+            NodeId bad = Simulate();
+            if (this->failed) {
+                return false;
+            }
+            if (bad == NONE) {
+                break;
+            }
+            L(bad)->temp = false;
+        }
+
+        if (!Allocate()) {
+            return false;
+        }
+        return Generate();
+    }
+
+    // Lays temps out from their users down: the operands of a node go to
+    // its base on, and the base of a node that is itself a temp is its slot.
+    void AssignSlots() {
+        std::int64_t count = this->layout.Length().Unwrap();
+        for (std::int64_t l = 0; l < count; l++) {
+            BlockId b = *this->layout.At(Integer{l});
+            if (B(b)->exit == Exit::Branch || B(b)->exit == Exit::Return) {
+                NodeId value = Resolve(B(b)->value);
+                if (IsTemp(value)) {
+                    L(value)->slot = 0;
+                }
+            }
+            for (std::int32_t i = B(b)->count - 1; i >= 0; i--) {
+                NodeId id = ScheduledAt(b, i);
+                if (N(id)->replacement != NONE || !N(id)->live || N(id)->op == Op::Phi) {
+                    continue;
+                }
+                std::int32_t base = IsTemp(id) ? L(id)->slot : 0;
+                L(id)->base = base;
+                for (std::int32_t k = 0; k < N(id)->count; k++) {
+                    NodeId operand = Resolve(OperandOf(id, k));
+                    if (IsTemp(operand)) {
+                        L(operand)->slot = static_cast<std::int32_t>(base + OperandSlot(N(id)->op, k));
+                    }
+                }
+            }
+        }
+    }
+
+    // Runs through the code as it would be emitted and returns a temp that
+    // would be overwritten or is not where its user expects it.
+    NodeId Simulate() {
+        NodeId pending[REGISTERS];
+        std::int64_t count = this->layout.Length().Unwrap();
+
+        auto fits = [&](std::int64_t slot) {
+            if (slot >= REGISTERS) {
+                this->failed = true;
+                return false;
+            }
+            return true;
+        };
+
+        for (std::int64_t l = 0; l < count; l++) {
+            BlockId b = *this->layout.At(Integer{l});
+            for (std::int64_t s = 0; s < REGISTERS; s++) {
+                pending[s] = NONE;
+            }
+            for (std::int32_t i = 0; i < B(b)->count; i++) {
+                NodeId id = ScheduledAt(b, i);
+                Node* node = N(id);
+                if (node->replacement != NONE || !node->live
+                        || node->op == Op::Phi || node->op == Op::Param) {
+                    continue;
+                }
+                std::int64_t base = L(id)->base;
+                for (std::int32_t k = 0; k < node->count; k++) {
+                    NodeId operand = Resolve(OperandOf(id, k));
+                    std::int64_t slot = base + OperandSlot(node->op, k);
+                    if (!fits(slot)) {
+                        return NONE;
+                    }
+                    if (IsTemp(operand)) {
+                        if (pending[slot] != operand) {
+                            return operand;
+                        }
+                        pending[slot] = NONE;
+                        continue;
+                    }
+                    // only calls copy variables into place
+                    bool written = node->op == Op::Call
+                        ? !(k == 0 && IsGlobalCallee(operand))
+                        : N(operand)->op == Op::Constant || operand == this->undefined;
+                    if (written && pending[slot] != NONE) {
+                        return pending[slot];
+                    }
+                }
+                if (node->op == Op::Call) {
+                    // the frame of the callee lies over everything above
+                    for (std::int64_t s = base; s < REGISTERS; s++) {
+                        if (pending[s] != NONE) {
+                            return pending[s];
+                        }
+                    }
+                }
+                if (HasResult(id)) {
+                    std::int64_t dest = IsTemp(id) ? L(id)->slot : base;
+                    if (!fits(dest)) {
+                        return NONE;
+                    }
+                    if (IsTemp(id) || !IsVar(id)) {
+                        if (pending[dest] != NONE) {
+                            return pending[dest];
+                        }
+                    }
+                    if (IsTemp(id)) {
+                        pending[dest] = id;
+                    }
+                }
+                if (N(id)->guarded) {
+                    for (std::int32_t k = 0; k < N(id)->stateCount; k++) {
+                        NodeId value = Resolve(this->states.At(Integer{N(id)->state + k})->node);
+                        if (IsTemp(value) && pending[L(value)->slot] != value) {
+                            return value;
+                        }
+                    }
+                }
+            }
+            if (B(b)->exit == Exit::Branch || B(b)->exit == Exit::Return) {
+                NodeId value = Resolve(B(b)->value);
+                if (!fits(0)) {
+                    return NONE;
+                }
+                if (IsTemp(value)) {
+                    if (pending[0] != value) {
+                        return value;
+                    }
+                    pending[0] = NONE;
+                } else if (!IsVar(value) && pending[0] != NONE) {
+                    return pending[0];
+                }
+            }
+        }
+        return NONE;
+    }
+
+    // Colors the variables so that those live at the same time get
+    // different registers, with parameters kept in theirs.
+    bool Allocate() {
+        std::int64_t nodeCount = this->nodes.Length().Unwrap();
+        this->vars.Truncate(Integer{0});
+        for (NodeId id = 0; id < nodeCount; id++) {
+            Lowered* lowered = L(id);
+            if (N(id)->live && N(id)->replacement == NONE && HasResult(id) && !lowered->temp
+                    && (lowered->uses > 0 || lowered->stateUse || N(id)->op == Op::Param)) {
+                lowered->var = static_cast<std::int32_t>(this->vars.Length().Unwrap());
+                *this->vars.Push(rt) = id;
+            }
+        }
+        std::int64_t varCount = this->vars.Length().Unwrap();
+        this->words = varCount / 64 + 1;
+        std::int64_t blockCount = this->blocks.Length().Unwrap();
+        Fill<std::uint64_t>(rt, &this->varLive, blockCount * this->words + this->words, 0);
+        Fill<std::uint64_t>(rt, &this->interference, varCount * this->words, 0);
+
+        std::int64_t count = this->layout.Length().Unwrap();
+        std::uint64_t* live = this->varLive.At(Integer{blockCount * this->words});
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (std::int64_t l = count - 1; l >= 0; l--) {
+                BlockId b = *this->layout.At(Integer{l});
+                LiveOut(b, live);
+                Walk(b, live, false);
+                std::uint64_t* in = this->varLive.At(Integer{b * this->words});
+                for (std::int64_t w = 0; w < this->words; w++) {
+                    if (in[w] != live[w]) {
+                        in[w] = live[w];
+                        changed = true;
+                    }
+                }
+            }
+        }
+        for (std::int64_t l = 0; l < count; l++) {
+            BlockId b = *this->layout.At(Integer{l});
+            LiveOut(b, live);
+            Walk(b, live, true);
+        }
+
+        // phis and their operands like to share a register, saving moves
+        Fill<std::int32_t>(rt, &this->hints, varCount, NONE);
+        for (std::int64_t v = 0; v < varCount; v++) {
+            NodeId id = *this->vars.At(Integer{v});
+            if (N(id)->op != Op::Phi) {
+                continue;
+            }
+            for (std::int32_t k = 0; k < N(id)->count; k++) {
+                NodeId operand = Resolve(OperandOf(id, k));
+                if (IsVar(operand) && *this->hints.At(Integer{L(operand)->var}) == NONE) {
+                    *this->hints.At(Integer{L(operand)->var}) = static_cast<std::int32_t>(v);
+                }
+            }
+        }
+
+        Fill<std::int32_t>(rt, &this->colors, varCount, NONE);
+        this->maxColor = root->GetArity().Unwrap() - 1;
+        for (std::int64_t v = 0; v < varCount; v++) {
+            NodeId id = *this->vars.At(Integer{v});
+            if (N(id)->op == Op::Param) {
+                *this->colors.At(Integer{v}) = N(id)->index;
+            }
+        }
+        for (std::int64_t v = 0; v < varCount; v++) {
+            NodeId id = *this->vars.At(Integer{v});
+            if (N(id)->op == Op::Param) {
+                continue;
+            }
+            std::uint64_t taken[WORDS] = {0};
+            const std::uint64_t* edges = this->interference.At(Integer{v * this->words});
+            for (std::int64_t w = 0; w < varCount; w++) {
+                std::int32_t color = *this->colors.At(Integer{w});
+                if (color != NONE && Has(edges, w)) {
+                    Add(taken, color);
+                }
+            }
+            std::int32_t color = NONE;
+            if (N(id)->op == Op::Phi) {
+                for (std::int32_t k = 0; color == NONE && k < N(id)->count; k++) {
+                    NodeId operand = Resolve(OperandOf(id, k));
+                    if (IsVar(operand)) {
+                        std::int32_t hint = *this->colors.At(Integer{L(operand)->var});
+                        if (hint != NONE && !Has(taken, hint)) {
+                            color = hint;
+                        }
+                    }
+                }
+            }
+            std::int32_t phi = *this->hints.At(Integer{v});
+            if (color == NONE && phi != NONE) {
+                std::int32_t hint = *this->colors.At(Integer{phi});
+                if (hint != NONE && !Has(taken, hint)) {
+                    color = hint;
+                }
+            }
+            for (std::int32_t r = 1; color == NONE && r < REGISTERS; r++) {
+                if (!Has(taken, r)) {
+                    color = r;
+                }
+            }
+            if (color == NONE) {
+                return false;
+            }
+            *this->colors.At(Integer{v}) = color;
+            if (color > this->maxColor) {
+                this->maxColor = color;
+            }
+        }
+        return true;
+    }
+
+    std::int32_t PredIndex(BlockId to, BlockId from) const {
+        for (std::int32_t i = 0; i < B(to)->predCount; i++) {
+            if (PredOf(to, i) == from) {
+                return i;
+            }
+        }
+        return NONE;
+    }
+
+    // variables live on leaving a block, phi operands included
+    void LiveOut(BlockId b, std::uint64_t* live) {
+        for (std::int64_t w = 0; w < this->words; w++) {
+            live[w] = 0;
+        }
+        BlockId next[2];
+        std::int64_t n = Successors(b, next);
+        for (std::int64_t i = 0; i < n; i++) {
+            const std::uint64_t* in = this->varLive.At(Integer{next[i] * this->words});
+            for (std::int64_t w = 0; w < this->words; w++) {
+                live[w] |= in[w];
+            }
+            std::int32_t k = PredIndex(next[i], b);
+            for (std::int32_t j = 0; k != NONE && j < B(next[i])->count; j++) {
+                NodeId phi = ScheduledAt(next[i], j);
+                if (N(phi)->op != Op::Phi) {
+                    break;
+                }
+                if (!IsVar(phi)) {
+                    continue;
+                }
+                NodeId operand = Resolve(OperandOf(phi, k));
+                if (IsVar(operand)) {
+                    Add(live, L(operand)->var);
+                }
+            }
+        }
+    }
+
+    void Interfere(std::int64_t v, const std::uint64_t* live) {
+        std::int64_t varCount = this->vars.Length().Unwrap();
+        std::uint64_t* edges = this->interference.At(Integer{v * this->words});
+        for (std::int64_t w = 0; w < varCount; w++) {
+            if (w != v && Has(live, w)) {
+                Add(edges, w);
+                Add(this->interference.At(Integer{w * this->words}), v);
+            }
+        }
+    }
+
+    // from the variables live at the end of a block to those live at its
+    // start
+    void Walk(BlockId b, std::uint64_t* live, bool interfere) {
+        if (B(b)->exit == Exit::Branch || B(b)->exit == Exit::Return) {
+            NodeId value = Resolve(B(b)->value);
+            if (IsVar(value)) {
+                Add(live, L(value)->var);
+            }
+        }
+        for (std::int32_t i = B(b)->count - 1; i >= 0; i--) {
+            NodeId id = ScheduledAt(b, i);
+            if (N(id)->replacement != NONE || !N(id)->live || N(id)->op == Op::Phi) {
+                continue;
+            }
+            if (N(id)->guarded) {
+                for (std::int32_t k = 0; k < N(id)->stateCount; k++) {
+                    NodeId value = Resolve(this->states.At(Integer{N(id)->state + k})->node);
+                    if (IsVar(value)) {
+                        Add(live, L(value)->var);
+                    }
+                }
+            }
+            if (IsVar(id)) {
+                if (interfere) {
+                    Interfere(L(id)->var, live);
+                }
+                Remove(live, L(id)->var);
+            }
+            for (std::int32_t k = 0; k < N(id)->count; k++) {
+                NodeId operand = Resolve(OperandOf(id, k));
+                if (IsVar(operand)) {
+                    Add(live, L(operand)->var);
+                }
+            }
+        }
+        for (std::int32_t i = 0; i < B(b)->count; i++) {
+            NodeId phi = ScheduledAt(b, i);
+            if (N(phi)->op != Op::Phi) {
+                break;
+            }
+            if (IsVar(phi) && interfere) {
+                Interfere(L(phi)->var, live);
+            }
+        }
+        for (std::int32_t i = 0; i < B(b)->count; i++) {
+            NodeId phi = ScheduledAt(b, i);
+            if (N(phi)->op != Op::Phi) {
+                break;
+            }
+            if (IsVar(phi)) {
+                Remove(live, L(phi)->var);
+            }
+        }
+    }
+
+    std::int64_t Register(NodeId id) const {
+        if (IsTemp(id)) {
+            return this->firstSlot + L(id)->slot;
+        }
+        if (IsVar(id)) {
+            return *this->colors.At(Integer{L(id)->var});
+        }
+        return NONE;
+    }
+
+    void Instr(ByteCodeType type, std::int64_t arg1, std::int64_t arg2, std::int32_t value,
+            std::int32_t target, std::int32_t point) {
+        Emitted* emitted = this->code.Push(rt);
+        emitted->type = type;
+        emitted->arg1 = arg1;
+        emitted->arg2 = arg2;
+        emitted->value = value;
+        emitted->target = target;
+        emitted->point = point;
+    }
+
+    void Touch(std::int64_t reg) {
+        if (reg > this->maxRegister) {
+            this->maxRegister = reg;
+        }
+    }
+
+    // puts a value in a register, temps are there already
+    void Materialize(NodeId id, std::int64_t dest) {
+        Touch(dest);
+        Node* node = N(id);
+        if (node->op == Op::Constant) {
+            if (node->name != NONE) {
+                Instr(ByteCodeType::LoadGlobalConstant, dest, 0, node->name, NONE, NONE);
+            } else {
+                Instr(ByteCodeType::LoadConstant, dest, 0, node->index, NONE, NONE);
+            }
+        } else if (id == this->undefined) {
+            Instr(ByteCodeType::LoadConstant, dest, 0, this->nil, NONE, NONE);
+        } else if (IsVar(id) && Register(id) != dest) {
+            Instr(ByteCodeType::Copy, dest, Register(id), NONE, NONE, NONE);
+        }
+    }
+
+    // a register holding the value, scratch when it has none
+    std::int64_t Read(NodeId id, std::int64_t scratch) {
+        std::int64_t reg = Register(id);
+        if (reg != NONE) {
+            return reg;
+        }
+        Materialize(id, scratch);
+        return scratch;
+    }
+
+    void EmitGuard(NodeId id) {
+        std::int32_t index = static_cast<std::int32_t>(this->points.Length().Unwrap());
+        Point* point = this->points.Push(rt);
+        point->pc = N(id)->pc;
+        point->first = this->pointValues.Length().Unwrap();
+        point->count = N(id)->stateCount;
+        for (std::int32_t k = 0; k < N(id)->stateCount; k++) {
+            StateEntry* entry = this->states.At(Integer{N(id)->state + k});
+            NodeId value = Resolve(entry->node);
+            PointValue* pointValue = this->pointValues.Push(rt);
+            pointValue->reg = entry->reg;
+            pointValue->source = 0;
+            pointValue->value = NONE;
+            if (N(value)->op == Op::Constant) {
+                // the register was loaded while the assumption held
+                pointValue->value = N(value)->index;
+            } else if (Register(value) != NONE) {
+                pointValue->source = Register(value);
+            } else {
+                pointValue->value = this->nil;
+            }
+        }
+        Instr(ByteCodeType::Guard, 0, 0, NONE, NONE, index);
+    }
+
+    void EmitNode(NodeId id) {
+        Node* node = N(id);
+        std::int64_t base = this->firstSlot + L(id)->base;
+        switch (node->op) {
+            case Op::Call: {
+                NodeId callee = Resolve(OperandOf(id, 0));
+                std::int32_t name = NONE;
+                if (IsGlobalCallee(callee)) {
+                    name = N(callee)->name;
+                } else {
+                    Materialize(callee, base);
+                }
+                std::int64_t count = N(id)->count;
+                for (std::int64_t k = 1; k < count; k++) {
+                    Materialize(Resolve(OperandOf(id, k)), base + k);
+                }
+                Touch(base + count - 1);
+                bool tail = N(id)->tail;
+                ByteCodeType type = name != NONE
+                    ? (tail ? ByteCodeType::InvokeGlobalTail : ByteCodeType::InvokeGlobal)
+                    : (tail ? ByteCodeType::InvokeTail : ByteCodeType::Invoke);
+                Instr(type, base, count, name, NONE, NONE);
+                if (!tail && IsVar(id)) {
+                    Instr(ByteCodeType::Copy, Register(id), base, NONE, NONE, NONE);
+                }
+                break;
+            }
+            case Op::StoreGlobal: {
+                std::int64_t key = Read(Resolve(OperandOf(id, 0)), base);
+                std::int64_t value = Read(Resolve(OperandOf(id, 1)), base + 1);
+                Instr(ByteCodeType::StoreGlobal, key, value, NONE, NONE, NONE);
+                break;
+            }
+            case Op::LoadGlobal: {
+                std::int64_t key = Read(Resolve(OperandOf(id, 0)), base);
+                std::int64_t dest = Register(id) != NONE ? Register(id) : base;
+                Touch(dest);
+                Instr(ByteCodeType::LoadGlobal, dest, key, NONE, NONE, NONE);
+                break;
+            }
+            case Op::Global: {
+                if (node->fused) {
+                    break;
+                }
+                std::int64_t dest = Register(id) != NONE ? Register(id) : base;
+                Touch(dest);
+                Instr(ByteCodeType::LoadGlobalConstant, dest, 0, node->name, NONE, NONE);
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+        if (N(id)->guarded) {
+            EmitGuard(id);
+        }
+    }
+
+    // Copies the phi operands of the edge into place, all at once: a copy
+    // waits until no other still reads its destination, and a cycle is
+    // broken through the first slot, which is free between blocks.
+    std::int64_t EmitMoves(BlockId from, BlockId to, bool emit) {
+        std::int32_t k = PredIndex(to, from);
+        if (k == NONE) {
+            return 0;
+        }
+        std::int64_t dests[REGISTERS];
+        std::int64_t sources[REGISTERS];
+        std::int64_t moves = 0;
+        std::int64_t constants = 0;
+        for (std::int32_t i = 0; i < B(to)->count; i++) {
+            NodeId phi = ScheduledAt(to, i);
+            if (N(phi)->op != Op::Phi) {
+                break;
+            }
+            if (!IsVar(phi)) {
+                continue;
+            }
+            NodeId operand = Resolve(OperandOf(phi, k));
+            if (IsVar(operand) && Register(operand) != Register(phi)) {
+                dests[moves] = Register(phi);
+                sources[moves] = Register(operand);
+                moves++;
+            } else if (N(operand)->op == Op::Constant) {
+                constants++;
+            }
+        }
+        if (!emit) {
+            return moves + constants;
+        }
+        while (moves > 0) {
+            std::int64_t ready = NONE;
+            for (std::int64_t i = 0; ready == NONE && i < moves; i++) {
+                bool read = false;
+                for (std::int64_t j = 0; j < moves; j++) {
+                    read = read || (j != i && sources[j] == dests[i]);
+                }
+                if (!read) {
+                    ready = i;
+                }
+            }
+            if (ready == NONE) {
+                std::int64_t cycle = sources[0];
+                Touch(this->firstSlot);
+                Instr(ByteCodeType::Copy, this->firstSlot, cycle, NONE, NONE, NONE);
+                for (std::int64_t j = 0; j < moves; j++) {
+                    if (sources[j] == cycle) {
+                        sources[j] = this->firstSlot;
+                    }
+                }
+                continue;
+            }
+            Instr(ByteCodeType::Copy, dests[ready], sources[ready], NONE, NONE, NONE);
+            dests[ready] = dests[moves - 1];
+            sources[ready] = sources[moves - 1];
+            moves--;
+        }
+        for (std::int32_t i = 0; i < B(to)->count; i++) {
+            NodeId phi = ScheduledAt(to, i);
+            if (N(phi)->op != Op::Phi) {
+                break;
+            }
+            NodeId operand = Resolve(OperandOf(phi, k));
+            if (IsVar(phi) && N(operand)->op == Op::Constant) {
+                Materialize(operand, Register(phi));
+            }
+        }
+        return 0;
+    }
+
+    void EmitExit(BlockId b, BlockId next) {
+        Block* block = B(b);
+        Exit exit = block->exit;
+        BlockId target = block->next[0];
+        if (exit == Exit::Branch && N(Resolve(block->value))->op == Op::Constant) {
+            exit = Exit::Goto;
+            target = block->next[V(N(Resolve(block->value))->index)->IsTruthy() ? 0 : 1];
+        }
+        switch (exit) {
+            case Exit::Goto: {
+                EmitMoves(b, target, true);
+                if (target != next) {
+                    Instr(ByteCodeType::Jump, 0, 0, NONE, target, NONE);
+                }
+                break;
+            }
+            case Exit::Branch: {
+                BlockId onTrue = block->next[0];
+                BlockId onFalse = block->next[1];
+                std::int64_t condition = Read(Resolve(block->value), this->firstSlot);
+                bool stub = EmitMoves(b, onFalse, false) > 0;
+                std::int32_t label = static_cast<std::int32_t>(this->stubs.Length().Unwrap());
+                if (stub) {
+                    *this->stubs.Push(rt) = 0;
+                    Instr(ByteCodeType::JumpIfFalse, condition, 0, NONE, -label - 1, NONE);
+                } else {
+                    Instr(ByteCodeType::JumpIfFalse, condition, 0, NONE, onFalse, NONE);
+                }
+                EmitMoves(b, onTrue, true);
+                if (stub || onTrue != next) {
+                    Instr(ByteCodeType::Jump, 0, 0, NONE, onTrue, NONE);
+                }
+                if (stub) {
+                    *this->stubs.At(Integer{label}) = this->code.Length().Unwrap();
+                    EmitMoves(b, onFalse, true);
+                    if (onFalse != next) {
+                        Instr(ByteCodeType::Jump, 0, 0, NONE, onFalse, NONE);
+                    }
+                }
+                break;
+            }
+            case Exit::Return: {
+                std::int64_t source = Read(Resolve(block->value), this->firstSlot);
+                Instr(ByteCodeType::Return, source, 0, NONE, NONE, NONE);
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
+
+    bool Generate() {
+        this->firstSlot = this->maxColor + 1;
+        this->maxRegister = this->maxColor;
+        this->code.Truncate(Integer{0});
+        std::int64_t count = this->layout.Length().Unwrap();
+        for (std::int64_t l = 0; l < count; l++) {
+            BlockId b = *this->layout.At(Integer{l});
+            BlockId next = l + 1 < count ? *this->layout.At(Integer{l + 1}) : NONE;
+            B(b)->start = this->code.Length().Unwrap();
+            for (std::int32_t i = 0; i < B(b)->count; i++) {
+                NodeId id = ScheduledAt(b, i);
+                if (N(id)->replacement == NONE && N(id)->live) {
+                    EmitNode(id);
+                }
+            }
+            EmitExit(b, next);
+        }
+        return this->maxRegister < REGISTERS;
+    }
+
+    void Install() {
+        Function* optimized = rt->NewFunction();
+        std::int64_t arity = root->GetArity().Unwrap();
+        std::int64_t localCount = this->maxRegister + 1 > arity ? this->maxRegister + 1 : arity;
+        optimized->SetStack(root->GetArity(), Integer{localCount});
+
+        // instructions point at the constants, which must never move
+        std::int64_t valueCount = this->values.Length().Unwrap();
+        optimized->ReserveConstants(rt, Integer{valueCount});
+        for (std::int64_t i = 0; i < valueCount; i++) {
+            optimized->PushConstant(rt)->Copy(V(static_cast<std::int32_t>(i)));
+        }
+
+        std::int64_t count = this->code.Length().Unwrap();
+        optimized->ReserveInstructions(rt, Integer{count});
+        Instruction* head = nullptr;
+        for (std::int64_t i = 0; i < count; i++) {
+            Emitted* emitted = this->code.At(Integer{i});
+            Instruction* instruction = optimized->PushInstruction(rt);
+            if (head == nullptr) {
+                head = instruction;
+            }
+            instruction->opcode = OpCode(emitted->type);
+            instruction->arg1 = static_cast<std::uint8_t>(emitted->arg1);
+            instruction->arg2 = static_cast<std::uint8_t>(emitted->arg2);
+            instruction->arg3 = 0;
+            instruction->cache = 0;
+            instruction->operand.constant = nullptr;
+            switch (emitted->type) {
+                case ByteCodeType::LoadConstant: {
+                    instruction->operand.constant = optimized->ConstantAt(Integer{emitted->value});
+                    break;
+                }
+                case ByteCodeType::LoadGlobalConstant:
+                case ByteCodeType::InvokeGlobal:
+                case ByteCodeType::InvokeGlobalTail: {
+                    instruction->operand.constant = optimized->ConstantAt(Integer{emitted->value});
+                    instruction->cache = optimized->NewGlobalCache(rt);
+                    break;
+                }
+                case ByteCodeType::Jump:
+                case ByteCodeType::JumpIfFalse: {
+                    std::int64_t target = emitted->target >= 0
+                        ? B(emitted->target)->start
+                        : *this->stubs.At(Integer{-emitted->target - 1});
+                    // the instructions were reserved, so this never moves
+                    instruction->operand.target = head + target;
+                    break;
+                }
+                case ByteCodeType::Guard: {
+                    instruction->cache = static_cast<std::uint32_t>(emitted->point);
+                    break;
+                }
+                default: {
+                    break;
+                }
+            }
+        }
+
+        std::int64_t assumptions = this->assumed.Length().Unwrap();
+        for (std::int64_t i = 0; i < assumptions; i++) {
+            Assumed* assumption = this->assumed.At(Integer{i});
+            optimized->PushAssumption(rt,
+                optimized->ConstantAt(Integer{assumption->name}),
+                optimized->ConstantAt(Integer{assumption->value}));
+        }
+        std::int64_t pointCount = this->points.Length().Unwrap();
+        for (std::int64_t i = 0; i < pointCount; i++) {
+            Point* point = this->points.At(Integer{i});
+            DeoptPoint* deopt = optimized->PushDeoptPoint(rt);
+            deopt->pc = point->pc;
+            deopt->first = point->first;
+            deopt->count = point->count;
+        }
+        std::int64_t pointValueCount = this->pointValues.Length().Unwrap();
+        for (std::int64_t i = 0; i < pointValueCount; i++) {
+            PointValue* pointValue = this->pointValues.At(Integer{i});
+            DeoptValue* value = optimized->PushDeoptValue(rt);
+            value->constant = pointValue->value == NONE
+                ? nullptr
+                : optimized->ConstantAt(Integer{pointValue->value});
+            value->reg = static_cast<std::uint8_t>(pointValue->reg);
+            value->source = static_cast<std::uint8_t>(pointValue->source);
+        }
+
+        root->SetOptimized(rt, optimized);
+    }
+
+    Runtime* rt;
+    Function* root;
+    bool failed;
+    BlockId entry;
+    BlockId current;
+    NodeId undefined;
+    std::int32_t nil;
+    Vector<Node> nodes;
+    Vector<NodeId> operands;
+    Vector<Block> blocks;
+    Vector<BlockId> preds;
+    // the nodes of each block in order, see Block::first
+    Vector<NodeId> schedule;
+    Vector<StateEntry> states;
+    Vector<Value> values;
+    Vector<Assumed> assumed;
+    Vector<BlockId> layout;
+    Vector<std::int32_t> work;
+    Vector<Lowered> lowered;
+    // lowering
+    Vector<NodeId> vars;
+    std::int64_t words;
+    Vector<std::uint64_t> varLive;
+    Vector<std::uint64_t> interference;
+    Vector<std::int32_t> colors;
+    Vector<std::int32_t> hints;
+    std::int64_t maxColor;
+    std::int64_t firstSlot;
+    std::int64_t maxRegister;
+    Vector<Emitted> code;
+    Vector<std::int64_t> stubs;
+    Vector<Point> points;
+    Vector<PointValue> pointValues;
+};
+
+void Optimize(Runtime* rt, Function* fn) {
+    prof::Span span{rt, "compile", "opt::Optimize"};
+    // the optimizer holds on to values of the function and the globals
+    bool gcEnabled = rt->IsGcEnabled();
+    rt->SetGcEnabled(false);
+    Defer restore{[=]() {
+        rt->SetGcEnabled(gcEnabled);
+    }};
+
+    Optimizer optimizer;
+    optimizer.Init(rt, fn);
+    Defer deinit{[&]() {
+        optimizer.DeInit();
+    }};
+
+    if (!optimizer.Run()) {
+        fn->GiveUpOptimizing();
+    }
+}
+
+} // opt
+
+} // espresso
@@ -0,0 +1,17 @@
+#pragma once
+
+namespace espresso {
+
+class Function;
+class Runtime;
+
+namespace opt {
+
+// Builds an optimized version of a hot function and installs it with
+// Function::SetOptimized. Functions it cannot translate are given up on
+// and stay interpreted. See Runtime::Promote.
+void Optimize(Runtime* rt, Function* fn);
+
+} // opt
+
+} // espresso
@@ -0,0 +1,734 @@
+#include "eprof.hh"
+#include "ert.hh"
+#include "enat.hh"
+
+#if defined(__unix__) || defined(__APPLE__)
+#include <sys/time.h>
+#define ESPRESSO_PROF_SUPPORTED
+#endif
+
+namespace espresso {
+
+namespace prof {
+
+volatile std::sig_atomic_t pending = 0;
+
+namespace {
+
+// only the innermost frames of deeper stacks are kept, below a frame
+// named [truncated]
+constexpr std::int64_t MAX_DEPTH = 512;
+
+// Grows through the system allocator rather than the runtime, so that
+// sampling neither runs the gc nor shows up in the allocation counts.
+struct Buffer {
+    char* data;
+    std::size_t length;
+    std::size_t capacity;
+};
+
+// a distinct stack, its text in Profiler::text
+struct Stack {
+    std::uint64_t hash;
+    std::size_t offset;
+    std::size_t length;
+    std::int64_t ticks;
+};
+
+// the name of a function, its text in Names::text
+struct Symbol {
+    const void* object;
+    std::size_t offset;
+    std::size_t length;
+};
+
+// Names of the functions seen so far. They stay valid until a collection
+// may have reused an address, or a global was defined.
+struct Names {
+    Buffer text;
+    Symbol* symbols;
+    std::size_t symbolCount;
+    std::size_t symbolCapacity;
+    std::uint64_t collections;
+    std::uint64_t version;
+};
+
+struct Profiler {
+    Runtime* rt;
+    System* system;
+    FILE* out;
+    Buffer line;
+    Buffer text;
+    Stack* stacks;
+    std::size_t stackCount;
+    std::size_t stackCapacity;
+    Names names;
+    #ifdef ESPRESSO_PROF_SUPPORTED
+    struct sigaction previous;
+    #endif
+};
+
+Profiler profiler{};
+
+void Append(System* system, Buffer* buffer, const char* data, std::size_t length) {
+    if (buffer->length + length > buffer->capacity) {
+        std::size_t capacity = buffer->capacity == 0 ? 256 : buffer->capacity;
+        while (capacity < buffer->length + length) {
+            capacity *= 2;
+        }
+        buffer->data = static_cast<char*>(system->ReAllocate(buffer->data, buffer->capacity, capacity));
+        if (buffer->data == nullptr) {
+            Panic("Out Of Memory");
+        }
+        buffer->capacity = capacity;
+    }
+    std::memcpy(buffer->data + buffer->length, data, length);
+    buffer->length += length;
+}
+
+void Release(System* system, Buffer* buffer) {
+    system->ReAllocate(buffer->data, buffer->capacity, 0);
+    *buffer = Buffer{};
+}
+
+std::uint64_t Hash(const char* data, std::size_t length) {
+    // FNV-1a
+    std::uint64_t hash = 14695981039346656037ull;
+    for (std::size_t i = 0; i < length; i++) {
+        hash = (hash ^ static_cast<unsigned char>(data[i])) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Appends the name of the global that holds object, spaces and
+// semicolons replaced as they would split folded stacks. Functions that
+// no global holds are anonymous.
+void AppendGlobalName(Runtime* rt, System* system, Buffer* out, const void* object) {
+    std::size_t before = out->length;
+    Map::Iterator iter = rt->GetGlobals()->GetIterator();
+    while (iter.HasNext()) {
+        Value* value = iter.Value();
+        const void* candidate = nullptr;
+        if (value->GetType() == ValueType::Function) {
+            candidate = value->GetFunction(rt);
+        } else if (value->GetType() == ValueType::NativeFunction) {
+            candidate = value->GetNativeFunction(rt);
+        }
+        if (candidate != object || iter.Key()->GetType() != ValueType::String) {
+            continue;
+        }
+        String* key = iter.Key()->GetString(rt);
+        std::int64_t n = key->Length().Unwrap();
+        for (std::int64_t i = 0; i < n; i++) {
+            char c = key->At(Integer{i});
+            if (c == '\0') {
+                break;
+            }
+            c = (c == ' ' || c == ';') ? '_' : c;
+            Append(system, out, &c, 1);
+        }
+        break;
+    }
+    if (out->length == before) {
+        const char* anonymous = "anonymous";
+        Append(system, out, anonymous, std::strlen(anonymous));
+    }
+}
+
+Symbol* NameOf(Runtime* rt, System* system, Names* names, const void* object) {
+    Map* globals = rt->GetGlobals();
+    if (names->collections != rt->CollectionCount() || names->version != globals->Version()) {
+        names->collections = rt->CollectionCount();
+        names->version = globals->Version();
+        names->symbolCount = 0;
+        names->text.length = 0;
+    }
+
+    for (std::size_t i = names->symbolCount; i > 0; i--) {
+        Symbol* symbol = &names->symbols[i - 1];
+        if (symbol->object == object) {
+            return symbol;
+        }
+    }
+
+    std::size_t offset = names->text.length;
+    AppendGlobalName(rt, system, &names->text, object);
+
+    if (names->symbolCount == names->symbolCapacity) {
+        std::size_t capacity = names->symbolCapacity == 0 ? 64 : names->symbolCapacity * 2;
+        names->symbols = static_cast<Symbol*>(system->ReAllocate(
+            names->symbols, names->symbolCapacity * sizeof(Symbol), capacity * sizeof(Symbol)));
+        if (names->symbols == nullptr) {
+            Panic("Out Of Memory");
+        }
+        names->symbolCapacity = capacity;
+    }
+    Symbol* symbol = &names->symbols[names->symbolCount++];
+    *symbol = Symbol{object, offset, names->text.length - offset};
+    return symbol;
+}
+
+void Release(System* system, Names* names) {
+    Release(system, &names->text);
+    system->ReAllocate(names->symbols, names->symbolCapacity * sizeof(Symbol), 0);
+    *names = Names{};
+}
+
+void AppendName(Profiler* p, const void* object) {
+    Symbol* symbol = NameOf(p->rt, p->system, &p->names, object);
+    Append(p->system, &p->line, p->names.text.data + symbol->offset, symbol->length);
+}
+
+// Bytecode frames below the top name the call they are in, the program
+// counter of the frame being the instruction after it.
+void AppendFrame(Profiler* p, CallFrame* frame, bool top, const void* native) {
+    if (top && native != nullptr) {
+        AppendName(p, native);
+        return;
+    }
+    Value* callee = p->rt->StackAtAbsoluteIndex<Unchecked>(frame->AbsoluteIndex(Integer{0}));
+    switch (callee->GetType()) {
+        case ValueType::Function: {
+            Function* fn = callee->GetFunction(p->rt);
+            Function* original = fn->GetOriginal();
+            AppendName(p, original != nullptr ? original : fn);
+            std::int64_t pc = frame->ProgramCounter().Unwrap();
+            if (!top && original == nullptr && pc > 0) {
+                char buffer[32];
+                int length = std::snprintf(buffer, sizeof(buffer), "@%lld", static_cast<long long>(pc - 1));
+                Append(p->system, &p->line, buffer, static_cast<std::size_t>(length));
+            }
+            break;
+        }
+        case ValueType::NativeFunction: {
+            AppendName(p, callee->GetNativeFunction(p->rt));
+            break;
+        }
+        default: {
+            const char* unknown = "unknown";
+            Append(p->system, &p->line, unknown, std::strlen(unknown));
+            break;
+        }
+    }
+}
+
+void Grow(Profiler* p) {
+    std::size_t capacity = p->stackCapacity == 0 ? 256 : p->stackCapacity * 2;
+    Stack* stacks = static_cast<Stack*>(p->system->ReAllocate(nullptr, 0, capacity * sizeof(Stack)));
+    if (stacks == nullptr) {
+        Panic("Out Of Memory");
+    }
+    for (std::size_t i = 0; i < capacity; i++) {
+        stacks[i] = Stack{0, 0, 0, 0};
+    }
+    for (std::size_t i = 0; i < p->stackCapacity; i++) {
+        Stack* stack = &p->stacks[i];
+        if (stack->ticks == 0) {
+            continue;
+        }
+        std::size_t slot = stack->hash & (capacity - 1);
+        while (stacks[slot].ticks != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        stacks[slot] = *stack;
+    }
+    p->system->ReAllocate(p->stacks, p->stackCapacity * sizeof(Stack), 0);
+    p->stacks = stacks;
+    p->stackCapacity = capacity;
+}
+
+void Count(Profiler* p, std::int64_t ticks) {
+    if (2 * (p->stackCount + 1) > p->stackCapacity) {
+        Grow(p);
+    }
+    std::uint64_t hash = Hash(p->line.data, p->line.length);
+    std::size_t slot = hash & (p->stackCapacity - 1);
+    while (p->stacks[slot].ticks != 0) {
+        Stack* stack = &p->stacks[slot];
+        if (stack->hash == hash && stack->length == p->line.length
+                && std::memcmp(p->text.data + stack->offset, p->line.data, stack->length) == 0) {
+            stack->ticks += ticks;
+            return;
+        }
+        slot = (slot + 1) & (p->stackCapacity - 1);
+    }
+    p->stacks[slot] = Stack{hash, p->text.length, p->line.length, ticks};
+    p->stackCount++;
+    Append(p->system, &p->text, p->line.data, p->line.length);
+}
+
+#ifdef ESPRESSO_PROF_SUPPORTED
+void Tick(int) {
+    pending = pending + 1;
+}
+
+void SetTimer(std::int64_t interval) {
+    itimerval timer{};
+    timer.it_interval.tv_sec = static_cast<time_t>(interval / 1000000);
+    timer.it_interval.tv_usec = static_cast<suseconds_t>(interval % 1000000);
+    timer.it_value = timer.it_interval;
+    setitimer(ITIMER_PROF, &timer, nullptr);
+}
+#endif
+
+} // namespace
+
+bool Start(Runtime* rt, const char* output, std::int64_t interval) {
+    #ifdef ESPRESSO_PROF_SUPPORTED
+    if (profiler.rt != nullptr || interval <= 0) {
+        return false;
+    }
+    System* system = rt->GetSystem();
+    FILE* out = system->Open(output, "w");
+    if (out == nullptr) {
+        return false;
+    }
+    profiler = Profiler{};
+    profiler.rt = rt;
+    profiler.system = system;
+    profiler.out = out;
+    pending = 0;
+
+    struct sigaction action{};
+    action.sa_handler = Tick;
+    sigemptyset(&action.sa_mask);
+    // interrupted reads and writes carry on
+    action.sa_flags = SA_RESTART;
+    sigaction(SIGPROF, &action, &profiler.previous);
+    SetTimer(interval);
+    return true;
+    #else
+    (void)rt;
+    (void)output;
+    (void)interval;
+    return false;
+    #endif
+}
+
+void Stop(Runtime* rt) {
+    #ifdef ESPRESSO_PROF_SUPPORTED
+    if (profiler.rt != rt || rt == nullptr) {
+        return;
+    }
+    SetTimer(0);
+    sigaction(SIGPROF, &profiler.previous, nullptr);
+    pending = 0;
+
+    Profiler* p = &profiler;
+    for (std::size_t i = 0; i < p->stackCapacity; i++) {
+        Stack* stack = &p->stacks[i];
+        if (stack->ticks == 0) {
+            continue;
+        }
+        char buffer[32];
+        int length = std::snprintf(buffer, sizeof(buffer), " %lld\n", static_cast<long long>(stack->ticks));
+        p->system->Write(p->out, p->text.data + stack->offset, stack->length);
+        p->system->Write(p->out, buffer, static_cast<std::size_t>(length));
+    }
+    p->system->Close(p->out);
+
+    Release(p->system, &p->line);
+    Release(p->system, &p->text);
+    Release(p->system, &p->names);
+    p->system->ReAllocate(p->stacks, p->stackCapacity * sizeof(Stack), 0);
+    profiler = Profiler{};
+    #else
+    (void)rt;
+    #endif
+}
+
+void Sample(Runtime* rt, const void* native) {
+    std::int64_t ticks = pending;
+    pending = 0;
+    Profiler* p = &profiler;
+    if (p->rt != rt || ticks <= 0) {
+        return;
+    }
+
+    p->line.length = 0;
+    std::int64_t frameCount = rt->FrameCount().Unwrap();
+    std::int64_t first = 0;
+    if (frameCount > MAX_DEPTH) {
+        first = frameCount - MAX_DEPTH;
+        const char* truncated = "[truncated];";
+        Append(p->system, &p->line, truncated, std::strlen(truncated));
+    }
+    for (std::int64_t i = first; i < frameCount; i++) {
+        if (i > first) {
+            Append(p->system, &p->line, ";", 1);
+        }
+        AppendFrame(p, rt->FrameAt(Integer{i}), i == frameCount - 1, native);
+    }
+    Count(p, ticks);
+}
+
+bool tracing = false;
+
+namespace {
+
+struct Tracer {
+    Runtime* rt;
+    System* system;
+    FILE* out;
+    std::int64_t start;
+    bool first;
+    Names names;
+};
+
+Tracer tracer{};
+
+std::int64_t Nanos() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+}
+
+// names are written as they are, bar what JSON strings have to escape
+void WriteString(System* system, FILE* out, const char* data, std::size_t length) {
+    system->Write(out, "\"", 1);
+    std::size_t from = 0;
+    for (std::size_t i = 0; i < length; i++) {
+        unsigned char c = static_cast<unsigned char>(data[i]);
+        if (c != '"' && c != '\\' && c >= 0x20) {
+            continue;
+        }
+        system->Write(out, data + from, i - from);
+        char escaped[8];
+        int n = std::snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        system->Write(out, escaped, static_cast<std::size_t>(n));
+        from = i + 1;
+    }
+    system->Write(out, data + from, length - from);
+    system->Write(out, "\"", 1);
+}
+
+// timestamps are microseconds since the trace started
+void WriteEvent(const char* phase, const char* category, const char* name, std::size_t length) {
+    Tracer* t = &tracer;
+    std::int64_t ts = Nanos() - t->start;
+    char buffer[96];
+    int n = std::snprintf(buffer, sizeof(buffer), "%s{\"ph\":\"%s\",\"pid\":1,\"tid\":1,\"ts\":%lld.%03lld",
+        t->first ? "" : ",\n", phase, static_cast<long long>(ts / 1000), static_cast<long long>(ts % 1000));
+    t->first = false;
+    t->system->Write(t->out, buffer, static_cast<std::size_t>(n));
+    if (category != nullptr) {
+        t->system->Write(t->out, ",\"cat\":", 7);
+        WriteString(t->system, t->out, category, std::strlen(category));
+        t->system->Write(t->out, ",\"name\":", 8);
+        WriteString(t->system, t->out, name, length);
+    }
+    t->system->Write(t->out, "}", 1);
+}
+
+} // namespace
+
+bool StartTrace(Runtime* rt, const char* output) {
+    if (tracer.rt != nullptr) {
+        return false;
+    }
+    System* system = rt->GetSystem();
+    FILE* out = system->Open(output, "w");
+    if (out == nullptr) {
+        return false;
+    }
+    tracer = Tracer{rt, system, out, Nanos(), true, Names{}};
+    const char* header = "{\"traceEvents\":[\n";
+    system->Write(out, header, std::strlen(header));
+    tracing = true;
+    return true;
+}
+
+void StopTrace(Runtime* rt) {
+    if (tracer.rt != rt || rt == nullptr) {
+        return;
+    }
+    tracing = false;
+    const char* footer = "\n]}\n";
+    tracer.system->Write(tracer.out, footer, std::strlen(footer));
+    tracer.system->Close(tracer.out);
+    Release(tracer.system, &tracer.names);
+    tracer = Tracer{};
+}
+
+void Begin(Runtime* rt, const char* category, const char* name) {
+    if (tracer.rt != rt) {
+        return;
+    }
+    WriteEvent("B", category, name, std::strlen(name));
+}
+
+void BeginCall(Runtime* rt, const char* category, const void* callee) {
+    if (tracer.rt != rt) {
+        return;
+    }
+    Symbol* symbol = NameOf(rt, tracer.system, &tracer.names, callee);
+    WriteEvent("B", category, tracer.names.text.data + symbol->offset, symbol->length);
+}
+
+void End(Runtime* rt) {
+    if (tracer.rt != rt) {
+        return;
+    }
+    WriteEvent("E", nullptr, nullptr, 0);
+}
+
+#ifdef ESPRESSO_PROFILE
+
+namespace {
+
+// rows of each table printed, the most frequent first
+constexpr std::size_t TOP = 20;
+
+constexpr std::size_t OPCODE_COUNT = bits::OP_TABLE_SIZE;
+
+constexpr std::size_t NATIVE_CAPACITY = 64;
+
+// a function seen by the interpreter, its name in Counts::names
+struct FunctionCounts {
+    // nullptr once the function has been freed
+    const Function* fn;
+    std::size_t offset;
+    std::size_t length;
+    std::int64_t calls;
+    std::int64_t instructions;
+};
+
+struct NativeCounts {
+    void (*handle)(Runtime*);
+    std::int64_t calls;
+    std::int64_t nanos;
+};
+
+struct Counts {
+    std::int64_t opcodes[OPCODE_COUNT];
+    // by the opcode before, then the opcode after
+    std::int64_t pairs[OPCODE_COUNT][OPCODE_COUNT];
+    // pairs are only counted within a function
+    const Function* last;
+    std::size_t lastIndex;
+    std::uint8_t previous;
+    Buffer names;
+    FunctionCounts* functions;
+    std::size_t functionCount;
+    std::size_t functionCapacity;
+    NativeCounts natives[NATIVE_CAPACITY];
+    std::size_t nativeCount;
+};
+
+Counts counts{};
+
+const char* OpCodeName(std::size_t opcode) {
+    switch (static_cast<std::uint32_t>(opcode) << bits::OP_SHIFT) {
+        case bits::OP_LOAD_CONSTANT: return "LoadConstant";
+        case bits::OP_LOAD_GLOBAL: return "LoadGlobal";
+        case bits::OP_INVOKE: return "Invoke";
+        case bits::OP_RETURN: return "Return";
+        case bits::OP_COPY: return "Copy";
+        case bits::OP_Q_EQUAL: return "QuickEqual";
+        case bits::OP_Q_LT: return "QuickLess";
+        case bits::OP_Q_LTE: return "QuickLessEqual";
+        case bits::OP_Q_GT: return "QuickGreater";
+        case bits::OP_Q_GTE: return "QuickGreaterEqual";
+        case bits::OP_Q_ADD: return "QuickAdd";
+        case bits::OP_Q_SUB: return "QuickSubtract";
+        case bits::OP_Q_MULT: return "QuickMultiply";
+        case bits::OP_Q_DIV: return "QuickDivide";
+        case bits::OP_NOOP: return "NoOp";
+        case bits::OP_JUMPF: return "JumpIfFalse";
+        case bits::OP_JUMP: return "Jump";
+        case bits::OP_STORE_G: return "StoreGlobal";
+        case bits::OP_INVOKE_TAIL: return "InvokeTail";
+        case bits::OP_GUARD: return "Guard";
+        case bits::OP_LOAD_GLOBAL_C: return "LoadGlobalConstant";
+        case bits::OP_INVOKE_G: return "InvokeGlobal";
+        case bits::OP_INVOKE_G_TAIL: return "InvokeGlobalTail";
+        default: return "Unknown";
+    }
+}
+
+// optimized functions count towards the function they were made from
+const Function* KeyOf(const Function* fn) {
+    Function* original = fn->GetOriginal();
+    return original != nullptr ? original : fn;
+}
+
+FunctionCounts* CountsOf(Runtime* rt, const Function* fn) {
+    if (counts.last == fn) {
+        return &counts.functions[counts.lastIndex];
+    }
+    System* system = rt->GetSystem();
+    std::size_t index = counts.functionCount;
+    for (std::size_t i = 0; i < counts.functionCount; i++) {
+        if (counts.functions[i].fn == fn) {
+            index = i;
+            break;
+        }
+    }
+    if (index == counts.functionCount) {
+        if (counts.functionCount == counts.functionCapacity) {
+            std::size_t capacity = counts.functionCapacity == 0 ? 64 : counts.functionCapacity * 2;
+            counts.functions = static_cast<FunctionCounts*>(system->ReAllocate(counts.functions,
+                counts.functionCapacity * sizeof(FunctionCounts), capacity * sizeof(FunctionCounts)));
+            if (counts.functions == nullptr) {
+                Panic("Out Of Memory");
+            }
+            counts.functionCapacity = capacity;
+        }
+        // functions are named by the time they first run, or never
+        std::size_t offset = counts.names.length;
+        AppendGlobalName(rt, system, &counts.names, fn);
+        counts.functions[index] = FunctionCounts{fn, offset, counts.names.length - offset, 0, 0};
+        counts.functionCount++;
+    }
+    counts.last = fn;
+    counts.lastIndex = index;
+    return &counts.functions[index];
+}
+
+// Fills order with the indices of the largest values that are not zero,
+// at most TOP of them and the largest first, and returns how many.
+std::size_t Top(const std::int64_t* values, std::size_t count, std::size_t* order) {
+    std::size_t n = 0;
+    for (std::size_t i = 0; i < count; i++) {
+        if (values[i] == 0) {
+            continue;
+        }
+        std::size_t j = n < TOP ? n++ : TOP;
+        while (j > 0 && values[order[j - 1]] < values[i]) {
+            if (j < TOP) {
+                order[j] = order[j - 1];
+            }
+            j--;
+        }
+        if (j < TOP) {
+            order[j] = i;
+        }
+    }
+    return n;
+}
+
+double Percent(std::int64_t part, std::int64_t total) {
+    return total == 0 ? 0.0 : 100.0 * static_cast<double>(part) / static_cast<double>(total);
+}
+
+} // namespace
+
+void CountInstruction(Runtime* rt, const Function* fn, std::uint8_t opcode) {
+    fn = KeyOf(fn);
+    bool same = counts.last == fn;
+    FunctionCounts* function = CountsOf(rt, fn);
+    function->instructions++;
+    counts.opcodes[opcode]++;
+    if (same) {
+        counts.pairs[counts.previous][opcode]++;
+    }
+    counts.last = fn;
+    counts.previous = opcode;
+}
+
+void CountCall(Runtime* rt, const Function* fn) {
+    CountsOf(rt, KeyOf(fn))->calls++;
+    // the first instruction of the callee does not pair with the call
+    counts.last = nullptr;
+}
+
+void CountNative(void (*handle)(Runtime*), std::int64_t nanos) {
+    for (std::size_t i = 0; i < counts.nativeCount; i++) {
+        if (counts.natives[i].handle == handle) {
+            counts.natives[i].calls++;
+            counts.natives[i].nanos += nanos;
+            return;
+        }
+    }
+    if (counts.nativeCount == NATIVE_CAPACITY || native::NameOf(handle) == nullptr) {
+        return;
+    }
+    counts.natives[counts.nativeCount++] = NativeCounts{handle, 1, nanos};
+}
+
+void ForgetFunction(const Function* fn) {
+    for (std::size_t i = 0; i < counts.functionCount; i++) {
+        if (counts.functions[i].fn == fn) {
+            counts.functions[i].fn = nullptr;
+        }
+    }
+    if (counts.last == fn) {
+        counts.last = nullptr;
+    }
+}
+
+std::int64_t Now() {
+    return Nanos();
+}
+
+void PrintCounts(Runtime* rt) {
+    System* system = rt->GetSystem();
+    std::size_t order[TOP];
+
+    std::int64_t total = 0;
+    for (std::size_t i = 0; i < OPCODE_COUNT; i++) {
+        total += counts.opcodes[i];
+    }
+    std::fprintf(stderr, "[PROFILE] instructions %lld\n", static_cast<long long>(total));
+    std::size_t n = Top(counts.opcodes, OPCODE_COUNT, order);
+    for (std::size_t i = 0; i < n && i < TOP; i++) {
+        std::int64_t count = counts.opcodes[order[i]];
+        std::fprintf(stderr, "  %-20s %14lld %6.2f%%\n", OpCodeName(order[i]),
+            static_cast<long long>(count), Percent(count, total));
+    }
+
+    std::int64_t pairTotal = 0;
+    for (std::size_t i = 0; i < OPCODE_COUNT * OPCODE_COUNT; i++) {
+        pairTotal += counts.pairs[i / OPCODE_COUNT][i % OPCODE_COUNT];
+    }
+    std::fprintf(stderr, "[PROFILE] opcode pairs %lld\n", static_cast<long long>(pairTotal));
+    n = Top(&counts.pairs[0][0], OPCODE_COUNT * OPCODE_COUNT, order);
+    for (std::size_t i = 0; i < n && i < TOP; i++) {
+        std::size_t first = order[i] / OPCODE_COUNT;
+        std::size_t second = order[i] % OPCODE_COUNT;
+        std::int64_t count = counts.pairs[first][second];
+        std::fprintf(stderr, "  %-20s %-20s %14lld %6.2f%%\n", OpCodeName(first), OpCodeName(second),
+            static_cast<long long>(count), Percent(count, pairTotal));
+    }
+
+    std::fprintf(stderr, "[PROFILE] functions %lld\n", static_cast<long long>(counts.functionCount));
+    std::int64_t* instructions = static_cast<std::int64_t*>(
+        system->ReAllocate(nullptr, 0, (counts.functionCount + 1) * sizeof(std::int64_t)));
+    if (instructions == nullptr) {
+        Panic("Out Of Memory");
+    }
+    for (std::size_t i = 0; i < counts.functionCount; i++) {
+        instructions[i] = counts.functions[i].instructions;
+    }
+    n = Top(instructions, counts.functionCount, order);
+    for (std::size_t i = 0; i < n && i < TOP; i++) {
+        FunctionCounts* function = &counts.functions[order[i]];
+        std::fprintf(stderr, "  %-20.*s calls %12lld instructions %14lld %6.2f%%\n",
+            static_cast<int>(function->length), counts.names.data + function->offset,
+            static_cast<long long>(function->calls), static_cast<long long>(function->instructions),
+            Percent(function->instructions, total));
+    }
+    system->ReAllocate(instructions, (counts.functionCount + 1) * sizeof(std::int64_t), 0);
+
+    std::fprintf(stderr, "[PROFILE] natives\n");
+    std::int64_t nanos[NATIVE_CAPACITY];
+    for (std::size_t i = 0; i < counts.nativeCount; i++) {
+        nanos[i] = counts.natives[i].nanos;
+    }
+    n = Top(nanos, counts.nativeCount, order);
+    for (std::size_t i = 0; i < n && i < TOP; i++) {
+        NativeCounts* entry = &counts.natives[order[i]];
+        std::fprintf(stderr, "  %-20s calls %12lld ns %14lld ns/call %10lld\n",
+            native::NameOf(entry->handle), static_cast<long long>(entry->calls),
+            static_cast<long long>(entry->nanos), static_cast<long long>(entry->nanos / entry->calls));
+    }
+
+    Release(system, &counts.names);
+    system->ReAllocate(counts.functions, counts.functionCapacity * sizeof(FunctionCounts), 0);
+    counts = Counts{};
+}
+
+#endif
+
+} // prof
+
+} // espresso
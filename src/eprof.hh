@@ -0,0 +1,115 @@
+#pragma once
+
+#include "edep.hh"
+
+#include <csignal>
+
+namespace espresso {
+
+class Runtime;
+class Function;
+
+namespace prof {
+
+// cpu time between samples, in microseconds
+constexpr std::int64_t DEFAULT_INTERVAL = 1000;
+
+// Ticks of the timer that have not been sampled yet. The signal handler
+// only counts them, as the frames and the stack may be half way through
+// a change when it runs, and the runtime takes the sample at its next
+// safe point. See Runtime::SafePoint.
+extern volatile std::sig_atomic_t pending;
+
+// Starts sampling the runtime every interval microseconds of cpu time.
+// Returns false when output cannot be opened for writing, or a runtime is
+// already being sampled.
+bool Start(Runtime* rt, const char* output, std::int64_t interval);
+
+// Stops sampling and writes the samples to the output as folded stacks:
+// a line for each distinct stack, its frames from the outermost to the
+// innermost separated by ';', followed by the number of ticks it was seen
+// for. Does nothing when the runtime is not being sampled.
+void Stop(Runtime* rt);
+
+// Records the stack of the runtime for the pending ticks. A native that
+// has just returned passes itself, as its result has replaced it in the
+// top frame.
+void Sample(Runtime* rt, const void* native);
+
+// True while a trace is being written. Calls check it once, and cost a
+// single branch when there is no trace.
+extern bool tracing;
+
+// Starts writing Chrome trace_event JSON to output, with a begin and an
+// end event for every call through Runtime::RawInvoke, functions and
+// natives alike, and for compiling, loading bytecode, optimizing and
+// collecting. Returns false when output cannot be opened for writing, or
+// a runtime is already being traced.
+bool StartTrace(Runtime* rt, const char* output);
+
+// Ends the trace. Does nothing when the runtime is not being traced.
+void StopTrace(Runtime* rt);
+
+void Begin(Runtime* rt, const char* category, const char* name);
+
+// begins the call of a Function or NativeFunction, named after its global
+void BeginCall(Runtime* rt, const char* category, const void* callee);
+
+// ends the innermost event that has begun, which is how viewers match them
+void End(Runtime* rt);
+
+// Traces the scope it lives in, when a trace is being written as it
+// starts.
+class Span {
+public:
+    Span(Runtime* rt_, const char* category, const char* name)
+    : rt{rt_}, traced{tracing}
+    {
+        if (this->traced) {
+            Begin(this->rt, category, name);
+        }
+    }
+
+    ~Span() {
+        if (this->traced) {
+            End(this->rt);
+        }
+    }
+
+    Span(const Span&) = delete;
+    Span& operator=(const Span&) = delete;
+
+    Span(Span&&) = delete;
+    Span& operator=(Span&&) = delete;
+
+private:
+    Runtime* rt;
+    bool traced;
+};
+
+#ifdef ESPRESSO_PROFILE
+// Counts of the ESPRESSO_PROFILE build, printed by PrintCounts. The jit
+// is off in that build, so every instruction runs in the interpreter.
+
+// an instruction the interpreter is about to run in fn
+void CountInstruction(Runtime* rt, const Function* fn, std::uint8_t opcode);
+
+void CountCall(Runtime* rt, const Function* fn);
+
+// Time spent in a native from the natives table, its callees included.
+// Other natives are not counted.
+void CountNative(void (*handle)(Runtime*), std::int64_t nanos);
+
+// the counts of a function that is about to be freed stay in the tables
+void ForgetFunction(const Function* fn);
+
+// monotonic nanoseconds
+std::int64_t Now();
+
+// writes the tables to stderr
+void PrintCounts(Runtime* rt);
+#endif
+
+} // prof
+
+} // espresso
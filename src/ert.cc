@@ -1,6 +1,13 @@
 #include "ert.hh"
 #include "esys.hh"
 #include "enat.hh"
+#include "ejit.hh"
+#include "eopt.hh"
+#include "esdt.hh"
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 namespace espresso {
 
@@ -32,10 +39,23 @@ void Runtime::Init(System* system, const char* loadPath) {
     this->globals = nullptr;
     this->loadPath = nullptr;
     this->bytesAllocated = Integer{0};
+    this->allocationCount = Integer{0};
+    this->totalBytesAllocated = Integer{0};
+    this->peakBytesAllocated = Integer{0};
+    this->collections = 0;
+    #ifdef ESPRESSO_CACHE_DEBUG
+    this->globalCacheHits = 0;
+    this->globalCacheMisses = 0;
+    #endif
     this->nextGc = Integer{128};
+    this->interned = nullptr;
+    this->internedSlots = 0;
+    this->internedCount = 0;
 
     this->stack.Init(this);
     this->frames.Init(this);
+    this->handlers.Init(this);
+    this->handlerDepth = -1;
 
     this->globals = this->NewMap();
     this->loadPath = this->NewString(loadPath);
@@ -56,8 +76,22 @@ void Runtime::Init(System* system, const char* loadPath) {
 }
 
 void Runtime::DeInit() {
+    #ifdef ESPRESSO_CACHE_DEBUG
+    std::int64_t lookups = this->globalCacheHits + this->globalCacheMisses;
+    std::fprintf(stderr, "[IC] LoadGlobal hits %lld misses %lld (%.2f%% hit rate)\n",
+        static_cast<long long>(this->globalCacheHits), static_cast<long long>(this->globalCacheMisses),
+        lookups == 0 ? 0.0 : 100.0 * this->globalCacheHits / lookups);
+    #endif
+
+    #ifdef ESPRESSO_PROFILE
+    espresso::prof::PrintCounts(this);
+    #endif
+
     this->stack.DeInit(this);
     this->frames.DeInit(this);
+    this->handlers.DeInit(this);
+
+    Free<String*>(this, this->interned, Integer{this->internedSlots});
 
     Object* curr = this->heap;
     while (curr != nullptr) {
@@ -75,27 +109,69 @@ Map* Runtime::GetGlobals() const {
     return this->globals;
 }
 
+Integer Runtime::AllocationCount() const {
+    return this->allocationCount;
+}
+
+Integer Runtime::TotalBytesAllocated() const {
+    return this->totalBytesAllocated;
+}
+
+Integer Runtime::PeakBytesAllocated() const {
+    return this->peakBytesAllocated;
+}
+
+std::uint64_t Runtime::CollectionCount() const {
+    return this->collections;
+}
+
 System* Runtime::GetSystem() {
     return this->system;
 }
 
-void Runtime::Invoke(Integer localBase, Integer argumentCount) {
-    RawInvoke(localBase, argumentCount, false);
+// optimized functions are reported to the probes as the function they
+// were made from
+static const Function* OriginalOf(const Function* fn) {
+    const Function* original = fn->GetOriginal();
+    return original != nullptr ? original : fn;
 }
 
-void Runtime::InvokeTail(Integer localBase, Integer argumentCount) {
-    RawInvoke(localBase, argumentCount, true);
+void Runtime::Invoke(Integer localBase, Integer argumentCount) {
+    if (prof::tracing) {
+        this->TracedInvoke(localBase, argumentCount);
+        return;
+    }
+    RawInvoke(localBase, argumentCount);
 }
 
-void Runtime::RawInvoke(Integer localBase, Integer argumentCount, bool isTailInvoke) {
-
-    (void)(isTailInvoke);
+void Runtime::TracedInvoke(Integer localBase, Integer argumentCount) {
+    Value* callee = this->Local(localBase);
+    if (callee->GetType() == ValueType::Function) {
+        Function* fn = callee->GetFunction(this);
+        Function* original = fn->GetOriginal();
+        prof::BeginCall(this, "function", original != nullptr ? original : fn);
+    } else if (callee->GetType() == ValueType::NativeFunction) {
+        prof::BeginCall(this, "native", callee->GetNativeFunction(this));
+    } else {
+        // raises the error
+        RawInvoke(localBase, argumentCount);
+        return;
+    }
+    // errors propagate as exceptions, the call ends either way
+    Defer end{[this](){
+        prof::End(this);
+    }};
+    RawInvoke(localBase, argumentCount);
+}
 
+void Runtime::RawInvoke(Integer localBase, Integer argumentCount) {
     ValueType fnType = this->Local(localBase)->GetType();
 
+    // errors take the place of the callee, the caller may yet resume in a
+    // handler and its own registers must survive
     if (!(fnType == ValueType::Function || fnType == ValueType::NativeFunction)) {
-        this->Local(Integer{0})->SetString(this->NewString("Illegal cast to function"));
-        this->Throw(Integer{0});
+        this->Local(localBase)->SetString(this->NewString("Illegal cast to function"));
+        this->Throw(localBase);
         return;
     }
 
@@ -109,41 +185,210 @@ void Runtime::RawInvoke(Integer localBase, Integer argumentCount, bool isTailInv
 
     // Too Many / Too Few args passed
     if (arity.Unwrap() != argumentCount.Unwrap()) {
-        Local(Integer{0})->SetString(NewString("Invalid arity"));
-        Throw(Integer{0});
+        Local(localBase)->SetString(NewString("Invalid arity"));
+        Throw(localBase);
         return;
     }
 
-    Integer absoluteBase = CurrentFrame()->AbsoluteIndex(localBase);
-    frames.Push(this)->Init(absoluteBase, localCount);
-
-    Defer popFrameAtEnd{[=](){
-        this->frames.Pop();
+    // frames that the interpreter pushes for bytecode to bytecode calls are
+    // only popped when they return normally, so unwind back to this depth
+    // rather than popping a single frame
+    Integer depth = frames.Length();
+
+    // identifies the call to the probes, the result takes its register
+    [[maybe_unused]] const Object* callee = this->ProbedCallee(Local(localBase));
+    ESPRESSO_PROBE3(function__entry, callee, argumentCount.Unwrap(), fnType == ValueType::NativeFunction);
+
+    PushFrame(localBase, argumentCount, localCount);
+
+    // Functions return through the interpreter or the jit, which fire
+    // the return probe with the function the frame runs by then, natives
+    // fire it here. Errors leave the frames pushed above this one behind,
+    // their calls end with this one.
+    bool returned = false;
+    Defer popFrameAtEnd{[&, this](){
+        if (!returned) {
+            this->AbandonFrames(Integer{depth.Unwrap() + 1}, Integer{depth.Unwrap() + 1});
+            // a function may have been replaced by a tail call, and the
+            // error may have taken its place. Natives keep what they like
+            // in their registers.
+            [[maybe_unused]] const Object* current = fnType == ValueType::Function
+                ? this->ProbedCallee(this->Local(Integer{0}))
+                : nullptr;
+            ESPRESSO_PROBE2(function__return, current != nullptr ? current : callee,
+                fnType == ValueType::NativeFunction);
+        }
+        this->frames.Truncate(depth);
     }};
 
-    // prepare the new stack
-    // 1. grow the stack until it's at least as large as the new top
-    std::int64_t newAbsoluteStackSize = CurrentFrame()->AbsoluteIndex(localCount).Unwrap();
-    while (stack.Length().Unwrap() < newAbsoluteStackSize) {
-        stack.Push(this)->SetNil();
-    }
-
-    // 2. Nullify all memory that is not assigned yet
-    std::int64_t startIndex = argumentCount.Unwrap();
-    std::int64_t frameSize = CurrentFrame()->Size().Unwrap();
-    for(std::int64_t i = startIndex; i < frameSize; i++) {
-        Local(Integer{i})->SetNil();
-    }
-
     // enter the actual function here
 
     if (fnType == ValueType::Function) {
+        Function* fn = Local(Integer{0})->GetFunction(this);
+        if (fn->CountInvocation()) {
+            this->Promote(fn);
+        }
+        #ifdef ESPRESSO_PROFILE
+        espresso::prof::CountCall(this, fn);
+        #endif
+        #ifdef ESPRESSO_JIT
+        if (fn->GetTier() == Tier::Compiled) {
+            espresso::jit::Run(this);
+        } else {
+            this->Interpret();
+        }
+        #else
         this->Interpret();
+        #endif
+        returned = true;
 
     } else /* val == ValueType::NativeFunction */ {
         NativeFunction* fn = Local(Integer{0})->GetNativeFunction(this);
         NativeFunction::Handle handle = fn->GetHandle();
+        #ifdef ESPRESSO_PROFILE
+        // natives may throw, the time is counted either way
+        std::int64_t start = espresso::prof::Now();
+        Defer countNative{[=](){
+            espresso::prof::CountNative(handle, espresso::prof::Now() - start);
+        }};
+        #endif
         handle(this);
+        returned = true;
+        ESPRESSO_PROBE2(function__return, callee, true);
+        this->SafePoint(fn);
+    }
+}
+
+void Runtime::AbandonFrames(Integer depth, Integer tracedDepth) {
+    for (std::int64_t i = this->frames.Length().Unwrap() - 1; i >= depth.Unwrap(); i--) {
+        [[maybe_unused]] Value* callee =
+            this->StackAtAbsoluteIndex(this->frames.At(Integer{i})->AbsoluteIndex(Integer{0}));
+        ESPRESSO_PROBE2(function__return, this->ProbedCallee(callee),
+            callee->GetType() == ValueType::NativeFunction);
+        if (prof::tracing && i >= tracedDepth.Unwrap()) {
+            prof::End(this);
+        }
+    }
+    this->frames.Truncate(depth);
+}
+
+const Object* Runtime::ProbedCallee(Value* callee) {
+    if (callee->GetType() == ValueType::NativeFunction) {
+        return callee->GetNativeFunction(this);
+    }
+    if (callee->GetType() != ValueType::Function) {
+        return nullptr;
+    }
+    return OriginalOf(callee->GetFunction(this));
+}
+
+void Runtime::PushFrame(Integer localBase, Integer argumentCount, Integer localCount) {
+    Integer absoluteBase = CurrentFrame()->AbsoluteIndex(localBase);
+
+    // prepare the new stack
+    // 1. grow the stack until it's at least as large as the new top. This
+    // happens before the frame is pushed as growing may run the gc, which
+    // must not see a frame that extends past the end of the stack. The new
+    // slots lie above every live frame, so they can stay uninitialized
+    // until step 2
+    std::int64_t newAbsoluteStackSize = absoluteBase.Unwrap() + localCount.Unwrap();
+    std::int64_t growBy = newAbsoluteStackSize - stack.Length().Unwrap();
+    if (growBy > 0) {
+        stack.Extend(this, Integer{growBy});
+    }
+
+    frames.Push(this)->Init(absoluteBase, localCount);
+
+    // 2. Nullify all memory that is not assigned yet
+    std::int64_t startIndex = argumentCount.Unwrap();
+    std::int64_t frameSize = localCount.Unwrap();
+    Value::SetNil(
+        stack.At<Unchecked>(Integer{absoluteBase.Unwrap() + startIndex}),
+        Integer{frameSize - startIndex});
+}
+
+void Runtime::ReuseFrame(Integer localBase, Integer argumentCount, Integer localCount) {
+    // move the callee and its arguments down to the start of the frame,
+    // the source always lies above the destination
+    std::int64_t n = argumentCount.Unwrap();
+    for (std::int64_t i = 0; i < n; i++) {
+        Local<VerifiedPolicy>(Integer{i})->Copy(Local<VerifiedPolicy>(Integer{localBase.Unwrap() + i}));
+    }
+
+    Integer absoluteBase = CurrentFrame()->AbsoluteIndex(Integer{0});
+
+    // grow before resizing the frame for the same reason as in PushFrame
+    std::int64_t newAbsoluteStackSize = absoluteBase.Unwrap() + localCount.Unwrap();
+    std::int64_t growBy = newAbsoluteStackSize - stack.Length().Unwrap();
+    if (growBy > 0) {
+        stack.Extend(this, Integer{growBy});
+    }
+
+    CurrentFrame()->Init(absoluteBase, localCount);
+
+    Value::SetNil(
+        stack.At<Unchecked>(Integer{absoluteBase.Unwrap() + n}),
+        Integer{localCount.Unwrap() - n});
+}
+
+void Runtime::Promote(Function* fn) {
+    #ifdef ESPRESSO_JIT
+    if (fn->GetJitState() == JitState::Pending) {
+        espresso::jit::Compile(this, fn);
+    }
+    #elif defined(ESPRESSO_DEBUGGER)
+    // breakpoints show the registers of the bytecode as it was written
+    (void)(fn);
+    #else
+    if (fn->IsOptimizable()) {
+        espresso::opt::Optimize(this, fn);
+    }
+    #endif
+}
+
+void Runtime::Deoptimize(Integer point) {
+    CallFrame* frame = CurrentFrame();
+    Function* optimized = Local(Integer{0})->GetFunction(this);
+    Function* original = optimized->GetOriginal();
+    DeoptPoint* deopt = optimized->DeoptPointAt(point);
+    std::int64_t base = frame->AbsoluteIndex(Integer{0}).Unwrap();
+    std::int64_t size = frame->Size().Unwrap();
+    std::int64_t localCount = original->GetLocalCount().Unwrap();
+
+    // the registers of the original are staged above the frame, as the
+    // values they are made from may sit in any register of it
+    std::int64_t staging = base + size;
+    std::int64_t growBy = staging + localCount - stack.Length().Unwrap();
+    if (growBy > 0) {
+        stack.Extend(this, Integer{growBy});
+    }
+    Value::SetNil(stack.At(Integer{staging}), Integer{localCount});
+    stack.At(Integer{staging})->SetFunction(original);
+    for (std::int64_t i = 0; i < deopt->count; i++) {
+        DeoptValue* value = optimized->DeoptValueAt(Integer{deopt->first + i});
+        Value* source = value->constant != nullptr
+            ? value->constant
+            : stack.At(Integer{base + value->source});
+        stack.At(Integer{staging + value->reg})->Copy(source);
+    }
+
+    // staging is above base, so copying upwards never reads what it wrote
+    frame->Init(Integer{base}, Integer{localCount});
+    for (std::int64_t i = 0; i < localCount; i++) {
+        stack.At(Integer{base + i})->Copy(stack.At(Integer{staging + i}));
+    }
+    frame->SetProgramCounter(Integer{deopt->pc});
+    original->DropOptimized();
+}
+
+void Runtime::PopFrame() {
+    frames.Pop();
+}
+
+void Runtime::CountBytes(std::int64_t size) {
+    this->totalBytesAllocated = Integer{this->totalBytesAllocated.Unwrap() + size};
+    if (this->bytesAllocated.Unwrap() > this->peakBytesAllocated.Unwrap()) {
+        this->peakBytesAllocated = this->bytesAllocated;
     }
 }
 
@@ -151,12 +396,15 @@ void* Runtime::RawNew(Integer itemSize, Integer count) {
     // TODO: size checking
     std::int64_t size = count.Unwrap() * itemSize.Unwrap();
     this->bytesAllocated = Integer{size + this->bytesAllocated.Unwrap()};
+    this->allocationCount = Integer{this->allocationCount.Unwrap() + 1};
+    this->CountBytes(size);
     this->Gc();
     void* result = this->system->ReAllocate(nullptr, 0, size);
     if (result == nullptr) {
         Panic("Out Of Memory");
         return nullptr;
     }
+    ESPRESSO_PROBE2(alloc, result, size);
     return result;
 }
 
@@ -166,6 +414,8 @@ void* Runtime::RawReAllocate(void* data, Integer itemSize, Integer prevCount, In
     std::int64_t newSize = newCount.Unwrap() * itemSize.Unwrap();
     this->bytesAllocated = Integer{this->bytesAllocated.Unwrap() - prevSize + newSize};
     if (newSize > prevSize) {
+        this->allocationCount = Integer{this->allocationCount.Unwrap() + 1};
+        this->CountBytes(newSize - prevSize);
         this->Gc();
     }
     void* result = this->system->ReAllocate(data, prevSize, newSize);
@@ -184,14 +434,6 @@ void Runtime::RawFree(void* pointer, Integer itemSize, Integer count) {
     // std::printf("Free %s [%p, %p)\n", typeid(T).name(), (void*) pointer, (void*) &pointer[count.Unwrap()]);
 }
 
-Defer::Defer(Defer::Handle fn)
-: handle{fn}
-{}
-
-Defer::~Defer() {
-    this->handle();
-}
-
 Integer ThrowException::GetAbsoluteStackIndex() const {
     return this->stackIndex;
 }
@@ -235,12 +477,6 @@ void DefaultSystem::Close(FILE* fp) {
     std::fclose(fp);
 }
 
-CallFrame* Runtime::CurrentFrame() {
-    Integer length = frames.Length();
-    Integer last = Integer{length.Unwrap() - 1};
-    return frames.At(last);
-}
-
 void CallFrame::Init(Integer stackBase, Integer argumentCount) {
     this->stackBase = stackBase;
     this->programCounter = Integer{0};
@@ -256,8 +492,21 @@ Integer CallFrame::Size() const {
 }
 
 void Value::SetNil() {
+#ifdef ESPRESSO_NAN_BOXING
+    this->bits = 0;
+#else
     this->type = ValueType::Nil;
     this->as.integer = Integer{0};
+#endif
+}
+
+void Value::SetNil(Value* head, Integer count) {
+    // a nil is all zero bytes, see SetNil above
+    static_assert(static_cast<int>(ValueType::Nil) == 0);
+    if (count.Unwrap() <= 0) {
+        return;
+    }
+    std::memset(static_cast<void*>(head), 0, sizeof(Value) * count.Unwrap());
 }
 
 void Runtime::LoadConstant(Integer dest, Integer constant) {
@@ -269,115 +518,770 @@ void Runtime::Return(Integer sourceIndex) {
     this->Local(Integer{0})->Copy(this->Local(sourceIndex));
 }
 
+// Opcodes are dispatched either through a computed goto table (the
+// ESPRESSO_THREADED_DISPATCH build, GCC/Clang only) or through a plain
+// switch. Both share the same handler bodies via the macros below.
+#if defined(ESPRESSO_THREADED_DISPATCH) && !(defined(__GNUC__) || defined(__clang__))
+#undef ESPRESSO_THREADED_DISPATCH
+#endif
+
+static bool IsIntrinsic(Runtime* rt, Value* value, Intrinsic intrinsic) {
+    return value->GetType() == ValueType::NativeFunction
+        && value->GetNativeFunction(rt)->GetIntrinsic() == intrinsic;
+}
+
+static bool BothIntegers(Value* lhs, Value* rhs) {
+    return lhs->GetType() == ValueType::Integer && rhs->GetType() == ValueType::Integer;
+}
+
+static std::uint8_t QuickenedOpCode(Intrinsic intrinsic) {
+    switch (intrinsic) {
+        case Intrinsic::Equal: return OpCode(ByteCodeType::QuickEqual);
+        case Intrinsic::Less: return OpCode(ByteCodeType::QuickLess);
+        case Intrinsic::LessEqual: return OpCode(ByteCodeType::QuickLessEqual);
+        case Intrinsic::Greater: return OpCode(ByteCodeType::QuickGreater);
+        case Intrinsic::GreaterEqual: return OpCode(ByteCodeType::QuickGreaterEqual);
+        case Intrinsic::Add: return OpCode(ByteCodeType::QuickAdd);
+        case Intrinsic::Subtract: return OpCode(ByteCodeType::QuickSubtract);
+        case Intrinsic::Multiply: return OpCode(ByteCodeType::QuickMultiply);
+        case Intrinsic::Divide: return OpCode(ByteCodeType::QuickDivide);
+        case Intrinsic::None:
+        case Intrinsic::Try:
+        case Intrinsic::Throw:
+            break;
+    }
+    Panic("No quickened form for intrinsic");
+    return 0;
+}
+
+static bool IsQuickenable(Intrinsic intrinsic) {
+    return intrinsic != Intrinsic::None
+        && intrinsic != Intrinsic::Try
+        && intrinsic != Intrinsic::Throw;
+}
+
+// try and throw are run by the interpreter itself when bytecode calls them
+static bool IsControl(Runtime* rt, Value* callee) {
+    if (callee->GetType() != ValueType::NativeFunction) {
+        return false;
+    }
+    Intrinsic intrinsic = callee->GetNativeFunction(rt)->GetIntrinsic();
+    return intrinsic == Intrinsic::Try || intrinsic == Intrinsic::Throw;
+}
+
+#ifdef ESPRESSO_THREADED_DISPATCH
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wpedantic"
+#endif
+
 void Runtime::Interpret() {
+    std::int64_t entryDepth = frames.Length().Unwrap();
+
+    // Errors raised by natives and the runtime arrive as exceptions. When
+    // a try of these frames can catch them the loop is resumed in its
+    // handler, otherwise they continue to the frames below.
+    std::int64_t handlerBase = -1;
+    Function* handlerTail = nullptr;
     while (true) {
-        Function* function = Local(Integer{0})->GetFunction(this);
-        ByteCode* byteCode = function->ByteCodeAt(CurrentFrame()->ProgramCounter());
+        try {
+            this->Resume(entryDepth, handlerBase, handlerTail);
+            return;
+        } catch (const ThrowException& e) {
+            if (!this->Unwind(entryDepth, e.GetAbsoluteStackIndex(), &handlerBase, &handlerTail)) {
+                throw;
+            }
+        }
+    }
+}
 
-        #ifdef ESPRESSO_DEBUGGER
-        espresso::native::debugger::Breakpoint(this);
-        #endif
+void Runtime::Resume(std::int64_t entryDepth, std::int64_t handlerBase, Function* handlerTail) {
+    // Calls from bytecode to bytecode push a frame and continue in this
+    // loop, returns pop back to the caller. Only the frame this loop was
+    // entered with leaves it, along with natives which are called through
+    // RawInvoke.
+
+    // the function and its code cannot change while a frame is active, so
+    // they are only resolved when entering or resuming a frame
+    Function* function = nullptr;
+    Instruction* code = nullptr;
+    Instruction* ip = nullptr;
+    GlobalCache* caches = nullptr;
+    Feedback* feedback = nullptr;
+
+    // a call of try or throw, see call_Control
+    std::int64_t controlBase = 0;
+    std::int64_t controlCount = 0;
+    bool controlTail = false;
+
+    #define ESPRESSO_LOAD_FRAME() \
+        function = Local<VerifiedPolicy>(Integer{0})->GetFunction(this); \
+        code = function->InstructionHead(); \
+        if (code == nullptr) { \
+            /* functions are decoded the first time they run */ \
+            function->Decode(this); \
+            code = function->InstructionHead(); \
+            if (code == nullptr) { \
+                Panic("Interpret of unverified function"); \
+                return; \
+            } \
+        } \
+        caches = function->GlobalCacheHead(); \
+        feedback = function->FeedbackHead(); \
+        ip = &code[CurrentFrame<VerifiedPolicy>()->ProgramCounter().Unwrap()]
+
+    // the frame is only consulted by code outside of this loop, so the
+    // program counter is written back before anything that can observe it
+    #define ESPRESSO_SYNC_PC() CurrentFrame<VerifiedPolicy>()->SetProgramCounter(Integer{ip - code})
+
+    // registers of a verified function are known to be in range
+    #define ESPRESSO_LOCAL(index) Local<VerifiedPolicy>(Integer{index})
+
+    // the result goes to register 0 of the returning frame, where the caller
+    // placed the callee, then the caller resumes at its saved pc, right
+    // after the call the result is recorded for. A frame that returns
+    // takes the handlers of the trys it was running with it.
+    #define ESPRESSO_RETURN(source) \
+        ESPRESSO_PROBE_RETURN(); \
+        ESPRESSO_RETURNED(source)
+
+    // returns a frame whose return probe has fired already, as that of a
+    // frame the jit ran or of a handler that is not a function
+    #define ESPRESSO_RETURNED(source) \
+        ESPRESSO_LOCAL(0)->Copy(ESPRESSO_LOCAL(source)); \
+        if (frames.Length().Unwrap() == this->handlerDepth) { \
+            this->PopHandlers(frames.Length()); \
+        } \
+        if (frames.Length().Unwrap() == entryDepth) { \
+            return; \
+        } \
+        { \
+            TypeSet result = TypeBit(ESPRESSO_LOCAL(0)->GetType()); \
+            ESPRESSO_TRACE_RETURN(); \
+            frames.Pop(); \
+            ESPRESSO_LOAD_FRAME(); \
+            feedback[ip - 1 - code].results |= result; \
+        } \
+        ESPRESSO_DISPATCH()
+
+    // a warm cache is a version compare and a copy, anything else takes
+    // the slow path which refills the cache
+    #define ESPRESSO_LOAD_GLOBAL(dest) { \
+        GlobalCache* cache = &caches[ip->cache]; \
+        if (cache->version == this->globals->Version()) { \
+            ESPRESSO_CACHE_HIT(); \
+            ESPRESSO_LOCAL(dest)->Copy(cache->slot); \
+        } else { \
+            this->LoadGlobal(Integer{dest}, ip->operand.constant, cache); \
+        } \
+    }
 
-        switch (byteCode->Type()) {
-            case ByteCodeType::NoOp: {
-                CurrentFrame()->AdvanceProgramCounter();
-                break;
-            }
-            case ByteCodeType::InvokeTail: {
-                CurrentFrame()->AdvanceProgramCounter();
-                Integer arg1 = byteCode->SmallArgument1();
-                Integer arg2 = byteCode->SmallArgument2();
-                InvokeTail(arg1, arg2);
-                break;
-            }
-            case ByteCodeType::Invoke: {
-                CurrentFrame()->AdvanceProgramCounter();
-                Integer arg1 = byteCode->SmallArgument1();
-                Integer arg2 = byteCode->SmallArgument2();
-                Invoke(arg1, arg2);
-                break;
-            }
-            case ByteCodeType::LoadConstant: {
-                CurrentFrame()->AdvanceProgramCounter();
-                Integer arg1 = byteCode->SmallArgument1();
-                Integer arg2 = byteCode->LargeArgument();
-                LoadConstant(arg1, arg2);
-                break;
-            }
-            case ByteCodeType::LoadGlobal: {
-                CurrentFrame()->AdvanceProgramCounter();
-                Integer arg1 = byteCode->SmallArgument1();
-                Integer arg2 = byteCode->SmallArgument2();
-                this->LoadGlobal(arg1, arg2);
-                break;
-            }
-            case ByteCodeType::Return: {
-                CurrentFrame()->AdvanceProgramCounter();
-                Integer arg1 = byteCode->SmallArgument1();
-                this->Return(arg1);
-                return;
-            }
-            case ByteCodeType::Copy: {
-                CurrentFrame()->AdvanceProgramCounter();
-                Integer arg1 = byteCode->SmallArgument1();
-                Integer arg2 = byteCode->SmallArgument2();
-                this->Copy(arg1, arg2);
-                break;
-            }
-            case ByteCodeType::JumpIfFalse: {
-                CurrentFrame()->AdvanceProgramCounter();
-                Integer arg1 = byteCode->SmallArgument1();
-                Integer dest = byteCode->LargeArgument();
-                bool result = Local(arg1)->IsTruthy();
-                if (!result) {
-                    CurrentFrame()->SetProgramCounter(dest);
-                }
-                break;
+    // InvokeGlobal(Tail) is rewritten in place the first time it calls an
+    // intrinsic with two arguments
+    #define ESPRESSO_QUICKEN(isTail) { \
+        Value* callee = ESPRESSO_LOCAL(ip->arg1); \
+        if (callee->GetType() == ValueType::NativeFunction && ip->arg2 == 3) { \
+            Intrinsic intrinsic = callee->GetNativeFunction(this)->GetIntrinsic(); \
+            if (IsQuickenable(intrinsic)) { \
+                ip->opcode = QuickenedOpCode(intrinsic); \
+                ip->arg3 = isTail; \
+            } \
+        } \
+    }
+
+    // The global must still name the intrinsic and the arguments must suit
+    // the fast path, anything else goes through a generic invoke. Should
+    // the global have been redefined the instruction is un-quickened.
+    #define ESPRESSO_QUICK(intrinsic, condition, result) { \
+        GlobalCache* cache = &caches[ip->cache]; \
+        Value* lhs = ESPRESSO_LOCAL(ip->arg1 + 1); \
+        Value* rhs = ESPRESSO_LOCAL(ip->arg1 + 2); \
+        if (cache->version == this->globals->Version() \
+                && IsIntrinsic(this, cache->slot, intrinsic) \
+                && (condition)) { \
+            std::uint8_t dest = ip->arg1; \
+            ESPRESSO_LOCAL(dest)->result; \
+            if (ip->arg3) { \
+                ip++; \
+                ESPRESSO_RETURN(dest); \
+            } \
+            ip++; \
+            ESPRESSO_DISPATCH(); \
+        } \
+        ESPRESSO_LOAD_GLOBAL(ip->arg1); \
+        if (!IsIntrinsic(this, ESPRESSO_LOCAL(ip->arg1), intrinsic)) { \
+            ip->opcode = ip->arg3 \
+                ? OpCode(ByteCodeType::InvokeGlobalTail) \
+                : OpCode(ByteCodeType::InvokeGlobal); \
+        } \
+        if (ip->arg3) ESPRESSO_INVOKE_TAIL() else ESPRESSO_INVOKE() \
+    }
+
+    #ifdef ESPRESSO_CACHE_DEBUG
+    #define ESPRESSO_CACHE_HIT() this->globalCacheHits++
+    #else
+    #define ESPRESSO_CACHE_HIT()
+    #endif
+
+    // Runs the callee in the frame just made for it. Compiled functions
+    // run in the jit until they return, then return like any other frame.
+    #ifdef ESPRESSO_JIT
+    #define ESPRESSO_ENTER(callee) \
+        if (callee->GetTier() == Tier::Compiled) { \
+            espresso::jit::Run(this); \
+            ESPRESSO_RETURNED(0); \
+        } \
+        ESPRESSO_LOAD_FRAME(); \
+        ESPRESSO_DISPATCH()
+    #else
+    #define ESPRESSO_ENTER(callee) \
+        ESPRESSO_LOAD_FRAME(); \
+        ESPRESSO_DISPATCH()
+    #endif
+
+    // a call or a backward jump may make the function hot
+    #define ESPRESSO_COUNT(counter, fn) \
+        this->SafePoint(); \
+        if (fn->counter()) { \
+            this->Promote(fn); \
+        }
+
+    // the optimized version runs in place of the callee for as long as
+    // the globals it assumes hold
+    #define ESPRESSO_OPTIMIZED(target, callee) { \
+        Function* optimized = callee->GetOptimized(); \
+        if (optimized != nullptr) { \
+            if (optimized->HoldsAssumptions(this)) { \
+                target->SetFunction(optimized); \
+                callee = optimized; \
+            } else { \
+                callee->DropOptimized(); \
+            } \
+        } \
+    }
+
+    // the invoke family shares these, with the callee in arg1 and the
+    // argument count, callee included, in arg2
+    #define ESPRESSO_INVOKE() { \
+        Integer arg1 = Integer{ip->arg1}; \
+        Integer arg2 = Integer{ip->arg2}; \
+        Value* target = ESPRESSO_LOCAL(ip->arg1); \
+        Feedback* site = &feedback[ip - code]; \
+        site->RecordCall(this, target, arg2.Unwrap() - 1); \
+        ip++; \
+        ESPRESSO_SYNC_PC(); \
+        if (target->GetType() == ValueType::Function) { \
+            Function* callee = target->GetFunction(this); \
+            if (callee->GetArity().Unwrap() == arg2.Unwrap()) { \
+                ESPRESSO_COUNT(CountInvocation, callee); \
+                ESPRESSO_PROFILE_CALL(callee); \
+                ESPRESSO_TRACE_CALL(callee); \
+                ESPRESSO_PROBE_CALL(callee, arg2.Unwrap()); \
+                ESPRESSO_OPTIMIZED(target, callee); \
+                PushFrame(arg1, arg2, callee->GetLocalCount()); \
+                ESPRESSO_ENTER(callee); \
+            } \
+        } \
+        if (IsControl(this, target)) { \
+            controlBase = arg1.Unwrap(); \
+            controlCount = arg2.Unwrap(); \
+            controlTail = false; \
+            goto call_Control; \
+        } \
+        /* natives, and everything that raises an error */ \
+        Invoke(arg1, arg2); \
+        site->results |= TypeBit(ESPRESSO_LOCAL(arg1.Unwrap())->GetType()); \
+        ESPRESSO_DISPATCH(); \
+    }
+
+    #define ESPRESSO_INVOKE_TAIL() { \
+        Integer arg1 = Integer{ip->arg1}; \
+        Integer arg2 = Integer{ip->arg2}; \
+        Value* target = ESPRESSO_LOCAL(ip->arg1); \
+        Feedback* site = &feedback[ip - code]; \
+        site->RecordCall(this, target, arg2.Unwrap() - 1); \
+        ip++; \
+        ESPRESSO_SYNC_PC(); \
+        if (target->GetType() == ValueType::Function) { \
+            Function* callee = target->GetFunction(this); \
+            if (callee->GetArity().Unwrap() == arg2.Unwrap()) { \
+                ESPRESSO_COUNT(CountInvocation, callee); \
+                ESPRESSO_PROFILE_CALL(callee); \
+                ESPRESSO_TRACE_RETURN(); \
+                ESPRESSO_TRACE_CALL(callee); \
+                ESPRESSO_PROBE_RETURN(); \
+                ESPRESSO_PROBE_CALL(callee, arg2.Unwrap()); \
+                ESPRESSO_OPTIMIZED(target, callee); \
+                /* the callee takes over this frame, so loops written as */ \
+                /* recursion run in constant space */ \
+                ReuseFrame(arg1, arg2, callee->GetLocalCount()); \
+                ESPRESSO_ENTER(callee); \
+            } \
+        } \
+        if (IsControl(this, target)) { \
+            controlBase = arg1.Unwrap(); \
+            controlCount = arg2.Unwrap(); \
+            controlTail = true; \
+            goto call_Control; \
+        } \
+        /* natives (and errors) are called normally and their result is */ \
+        /* returned right away */ \
+        Invoke(arg1, arg2); \
+        site->results |= TypeBit(ESPRESSO_LOCAL(arg1.Unwrap())->GetType()); \
+        ESPRESSO_RETURN(arg1.Unwrap()); \
+    }
+
+    #ifdef ESPRESSO_DEBUGGER
+    #define ESPRESSO_BREAKPOINT() ESPRESSO_SYNC_PC(); espresso::native::debugger::Breakpoint(this)
+    #else
+    #define ESPRESSO_BREAKPOINT()
+    #endif
+
+    #ifdef ESPRESSO_PROFILE
+    #define ESPRESSO_PROFILE_INSTRUCTION() espresso::prof::CountInstruction(this, function, ip->opcode)
+    #define ESPRESSO_PROFILE_CALL(callee) espresso::prof::CountCall(this, callee)
+    #else
+    #define ESPRESSO_PROFILE_INSTRUCTION()
+    #define ESPRESSO_PROFILE_CALL(callee)
+    #endif
+
+    // Calls that push or take over a frame here are traced here, from the
+    // call to the return that pops the frame. Those made through Invoke
+    // are traced by TracedInvoke, see also Unwind.
+    #define ESPRESSO_TRACE_CALL(callee) \
+        if (prof::tracing) { \
+            prof::BeginCall(this, "function", callee); \
+        }
+    #define ESPRESSO_TRACE_RETURN() \
+        if (prof::tracing) { \
+            prof::End(this); \
+        }
+
+    // The probes of the same calls, which give the function a frame runs.
+    // Invoke fires those of the calls it makes, see also Unwind.
+    #define ESPRESSO_PROBE_CALL(callee, count) \
+        ESPRESSO_PROBE3(function__entry, callee, count, false)
+    #define ESPRESSO_PROBE_RETURN() \
+        ESPRESSO_PROBE2(function__return, OriginalOf(function), false)
+
+    #ifdef ESPRESSO_THREADED_DISPATCH
+
+    // indexed by Instruction::opcode, see bits::OP_*. The verifier rejects
+    // every opcode that is not listed here.
+    static void* const DISPATCH_TABLE[bits::OP_TABLE_SIZE] = {
+        &&op_LoadConstant,       // 0x00
+        &&op_LoadGlobal,         // 0x01
+        &&op_Invoke,             // 0x02
+        &&op_Return,             // 0x03
+        &&op_Copy,               // 0x04
+        &&op_QuickEqual,         // 0x05
+        &&op_QuickLess,          // 0x06
+        &&op_QuickLessEqual,     // 0x07
+        &&op_QuickGreater,       // 0x08
+        &&op_QuickGreaterEqual,  // 0x09
+        &&op_QuickAdd,           // 0x0a
+        &&op_QuickSubtract,      // 0x0b
+        &&op_QuickMultiply,      // 0x0c
+        &&op_QuickDivide,        // 0x0d
+        &&op_NoOp,               // 0x0e
+        &&op_JumpIfFalse,        // 0x0f
+        &&op_Jump,               // 0x10
+        &&op_StoreGlobal,        // 0x11
+        &&op_InvokeTail,         // 0x12
+        &&op_Guard,              // 0x13
+        &&op_Unknown,            // 0x14
+        &&op_LoadGlobalConstant, // 0x15
+        &&op_InvokeGlobal,       // 0x16
+        &&op_InvokeGlobalTail,   // 0x17
+        &&op_Unknown,            // 0x18
+        &&op_Unknown,            // 0x19
+        &&op_Unknown,            // 0x1a
+        &&op_Unknown,            // 0x1b
+        &&op_Unknown,            // 0x1c
+        &&op_Unknown,            // 0x1d
+        &&op_Unknown,            // 0x1e
+        &&op_Unknown,            // 0x1f
+    };
+
+    #define ESPRESSO_DISPATCH() \
+        ESPRESSO_BREAKPOINT(); \
+        ESPRESSO_PROFILE_INSTRUCTION(); \
+        goto *DISPATCH_TABLE[ip->opcode]
+    #define ESPRESSO_OPCODE(name) op_##name:
+    #define ESPRESSO_OPCODE_UNKNOWN() op_Unknown:
+
+    #else
+
+    #define ESPRESSO_DISPATCH() continue
+    #define ESPRESSO_OPCODE(name) case OpCode(ByteCodeType::name):
+    #define ESPRESSO_OPCODE_UNKNOWN() default:
+
+    #endif
+
+    resume:
+    if (handlerBase >= 0) {
+        goto call_Handler;
+    }
+    ESPRESSO_LOAD_FRAME();
+
+    #ifdef ESPRESSO_THREADED_DISPATCH
+
+    ESPRESSO_DISPATCH();
+
+    #else
+
+    while (true) {
+        ESPRESSO_BREAKPOINT();
+        ESPRESSO_PROFILE_INSTRUCTION();
+        switch (ip->opcode) {
+
+    #endif
+
+    ESPRESSO_OPCODE(NoOp) {
+        ip++;
+        ESPRESSO_DISPATCH();
+    }
+    ESPRESSO_OPCODE(InvokeTail) {
+        ESPRESSO_INVOKE_TAIL();
+    }
+    ESPRESSO_OPCODE(Invoke) {
+        ESPRESSO_INVOKE();
+    }
+    ESPRESSO_OPCODE(InvokeGlobal) {
+        ESPRESSO_LOAD_GLOBAL(ip->arg1);
+        ESPRESSO_QUICKEN(false);
+        ESPRESSO_INVOKE();
+    }
+    ESPRESSO_OPCODE(InvokeGlobalTail) {
+        ESPRESSO_LOAD_GLOBAL(ip->arg1);
+        ESPRESSO_QUICKEN(true);
+        ESPRESSO_INVOKE_TAIL();
+    }
+    ESPRESSO_OPCODE(QuickEqual) {
+        ESPRESSO_QUICK(Intrinsic::Equal, true, SetBoolean(lhs->Equals(this, rhs)));
+    }
+    ESPRESSO_OPCODE(QuickLess) {
+        ESPRESSO_QUICK(Intrinsic::Less, BothIntegers(lhs, rhs),
+            SetBoolean(lhs->GetInteger(this).Unwrap() < rhs->GetInteger(this).Unwrap()));
+    }
+    ESPRESSO_OPCODE(QuickLessEqual) {
+        ESPRESSO_QUICK(Intrinsic::LessEqual, BothIntegers(lhs, rhs),
+            SetBoolean(lhs->GetInteger(this).Unwrap() <= rhs->GetInteger(this).Unwrap()));
+    }
+    ESPRESSO_OPCODE(QuickGreater) {
+        ESPRESSO_QUICK(Intrinsic::Greater, BothIntegers(lhs, rhs),
+            SetBoolean(lhs->GetInteger(this).Unwrap() > rhs->GetInteger(this).Unwrap()));
+    }
+    ESPRESSO_OPCODE(QuickGreaterEqual) {
+        ESPRESSO_QUICK(Intrinsic::GreaterEqual, BothIntegers(lhs, rhs),
+            SetBoolean(lhs->GetInteger(this).Unwrap() >= rhs->GetInteger(this).Unwrap()));
+    }
+    ESPRESSO_OPCODE(QuickAdd) {
+        ESPRESSO_QUICK(Intrinsic::Add, BothIntegers(lhs, rhs),
+            SetInteger(Integer{lhs->GetInteger(this).Unwrap() + rhs->GetInteger(this).Unwrap()}));
+    }
+    ESPRESSO_OPCODE(QuickSubtract) {
+        ESPRESSO_QUICK(Intrinsic::Subtract, BothIntegers(lhs, rhs),
+            SetInteger(Integer{lhs->GetInteger(this).Unwrap() - rhs->GetInteger(this).Unwrap()}));
+    }
+    ESPRESSO_OPCODE(QuickMultiply) {
+        ESPRESSO_QUICK(Intrinsic::Multiply, BothIntegers(lhs, rhs),
+            SetInteger(Integer{lhs->GetInteger(this).Unwrap() * rhs->GetInteger(this).Unwrap()}));
+    }
+    ESPRESSO_OPCODE(QuickDivide) {
+        // division by zero is left to the native, which raises the error
+        ESPRESSO_QUICK(Intrinsic::Divide, BothIntegers(lhs, rhs) && rhs->GetInteger(this).Unwrap() != 0,
+            SetInteger(Integer{lhs->GetInteger(this).Unwrap() / rhs->GetInteger(this).Unwrap()}));
+    }
+    ESPRESSO_OPCODE(LoadConstant) {
+        ESPRESSO_LOCAL(ip->arg1)->Copy(ip->operand.constant);
+        ip++;
+        ESPRESSO_DISPATCH();
+    }
+    ESPRESSO_OPCODE(LoadGlobal) {
+        Integer arg1 = Integer{ip->arg1};
+        Integer arg2 = Integer{ip->arg2};
+        ip++;
+        this->LoadGlobal(arg1, arg2);
+        ESPRESSO_DISPATCH();
+    }
+    ESPRESSO_OPCODE(LoadGlobalConstant) {
+        ESPRESSO_LOAD_GLOBAL(ip->arg1);
+        ip++;
+        ESPRESSO_DISPATCH();
+    }
+    ESPRESSO_OPCODE(Return) {
+        std::uint8_t source = ip->arg1;
+        ip++;
+        ESPRESSO_SYNC_PC();
+        ESPRESSO_RETURN(source);
+    }
+    ESPRESSO_OPCODE(Copy) {
+        ESPRESSO_LOCAL(ip->arg1)->Copy(ESPRESSO_LOCAL(ip->arg2));
+        ip++;
+        ESPRESSO_DISPATCH();
+    }
+    ESPRESSO_OPCODE(JumpIfFalse) {
+        bool result = ESPRESSO_LOCAL(ip->arg1)->IsTruthy();
+        if (result) {
+            feedback[ip - code].fellThrough++;
+            ip++;
+        } else {
+            feedback[ip - code].jumped++;
+            if (ip->operand.target <= ip) {
+                ESPRESSO_COUNT(CountBackEdge, function);
             }
-            case ByteCodeType::Jump: {
-                CurrentFrame()->SetProgramCounter(byteCode->LargeArgument());
-                break;
+            ip = ip->operand.target;
+        }
+        ESPRESSO_DISPATCH();
+    }
+    ESPRESSO_OPCODE(Jump) {
+        if (ip->operand.target <= ip) {
+            ESPRESSO_COUNT(CountBackEdge, function);
+        }
+        ip = ip->operand.target;
+        ESPRESSO_DISPATCH();
+    }
+    ESPRESSO_OPCODE(StoreGlobal) {
+        Integer key = Integer{ip->arg1};
+        Integer value = Integer{ip->arg2};
+        ip++;
+        this->StoreGlobal(key, value);
+        ESPRESSO_DISPATCH();
+    }
+    ESPRESSO_OPCODE(Guard) {
+        if (!function->HoldsAssumptions(this)) {
+            ESPRESSO_SYNC_PC();
+            this->Deoptimize(Integer{ip->cache});
+            ESPRESSO_LOAD_FRAME();
+            ESPRESSO_DISPATCH();
+        }
+        ip++;
+        ESPRESSO_DISPATCH();
+    }
+    ESPRESSO_OPCODE_UNKNOWN() {
+        Panic("Unknown ByteCode in Interpret");
+        return;
+    }
+
+    // try runs its body as a call from this frame with a handler on top,
+    // throw goes straight to that handler when it is one of this loop's.
+    // Neither allocates nor raises an exception.
+    call_Control: {
+        Intrinsic intrinsic = ESPRESSO_LOCAL(controlBase)->GetNativeFunction(this)->GetIntrinsic();
+        std::int64_t depth = frames.Length().Unwrap();
+        if (intrinsic == Intrinsic::Try && controlCount == 3 && !controlTail) {
+            // the body is called in the place of try and returns to it
+            PushHandler(Integer{depth + 1}, CurrentFrame()->AbsoluteIndex(Integer{controlBase}),
+                false, ESPRESSO_LOCAL(controlBase + 2));
+            ESPRESSO_LOCAL(controlBase)->Copy(ESPRESSO_LOCAL(controlBase + 1));
+            Value* body = ESPRESSO_LOCAL(controlBase);
+            if (body->GetType() == ValueType::Function
+                    && body->GetFunction(this)->GetArity().Unwrap() == 1) {
+                Function* callee = body->GetFunction(this);
+                ESPRESSO_COUNT(CountInvocation, callee);
+                ESPRESSO_PROFILE_CALL(callee);
+                ESPRESSO_TRACE_CALL(callee);
+                ESPRESSO_PROBE_CALL(callee, 1);
+                ESPRESSO_OPTIMIZED(body, callee);
+                PushFrame(Integer{controlBase}, Integer{1}, callee->GetLocalCount());
+                ESPRESSO_ENTER(callee);
             }
-            case ByteCodeType::StoreGlobal: {
-                CurrentFrame()->AdvanceProgramCounter();
-                Integer key = byteCode->SmallArgument1();
-                Integer value = byteCode->SmallArgument2();
-                this->StoreGlobal(key, value);
-                break;
+            Invoke(Integer{controlBase}, Integer{1});
+            PopHandlers(Integer{depth + 1});
+            ESPRESSO_DISPATCH();
+        }
+        if (intrinsic == Intrinsic::Try && controlCount == 3) {
+            // in tail position the body takes over this frame
+            PushHandler(Integer{depth}, Integer{0}, true, ESPRESSO_LOCAL(controlBase + 2));
+            Value* body = ESPRESSO_LOCAL(controlBase + 1);
+            if (body->GetType() == ValueType::Function
+                    && body->GetFunction(this)->GetArity().Unwrap() == 1) {
+                Function* callee = body->GetFunction(this);
+                ESPRESSO_COUNT(CountInvocation, callee);
+                ESPRESSO_PROFILE_CALL(callee);
+                ESPRESSO_TRACE_RETURN();
+                ESPRESSO_TRACE_CALL(callee);
+                ESPRESSO_PROBE_RETURN();
+                ESPRESSO_PROBE_CALL(callee, 1);
+                ESPRESSO_OPTIMIZED(body, callee);
+                ReuseFrame(Integer{controlBase + 1}, Integer{1}, callee->GetLocalCount());
+                ESPRESSO_ENTER(callee);
             }
-            default: {
-                Panic("Unknown ByteCode in Interpret");
-                break;
+            Invoke(Integer{controlBase + 1}, Integer{1});
+            ESPRESSO_RETURN(controlBase + 1);
+        }
+        if (intrinsic == Intrinsic::Throw && controlCount == 2
+                && UnwindThrow(entryDepth, CurrentFrame()->AbsoluteIndex(Integer{controlBase + 1}),
+                    &handlerBase, &handlerTail)) {
+            goto resume;
+        }
+        // the native raises the errors, or throws to the frames below
+        Invoke(Integer{controlBase}, Integer{controlCount});
+        if (controlTail) {
+            ESPRESSO_RETURN(controlBase);
+        }
+        ESPRESSO_DISPATCH();
+    }
+
+    // Unwind left the handler and the error at handlerBase of the frame
+    // it was caught in. In tail position the handler already sits in
+    // register 0, so there is no code to load for the frame, which ran
+    // handlerTail until then.
+    call_Handler: {
+        Integer base = Integer{handlerBase};
+        handlerBase = -1;
+        if (handlerTail == nullptr) {
+            ESPRESSO_LOAD_FRAME();
+        } else {
+            function = handlerTail;
+        }
+        Value* handler = ESPRESSO_LOCAL(base.Unwrap());
+        if (handler->GetType() == ValueType::Function
+                && handler->GetFunction(this)->GetArity().Unwrap() == 2) {
+            Function* callee = handler->GetFunction(this);
+            if (handlerTail != nullptr) {
+                // the call of handlerTail ends first, nothing else may
+                // keep it alive once a collection runs
+                ESPRESSO_TRACE_RETURN();
+                ESPRESSO_PROBE_RETURN();
+                ESPRESSO_COUNT(CountInvocation, callee);
+                ESPRESSO_PROFILE_CALL(callee);
+                ESPRESSO_TRACE_CALL(callee);
+                ESPRESSO_PROBE_CALL(callee, 2);
+                ESPRESSO_OPTIMIZED(handler, callee);
+                ReuseFrame(base, Integer{2}, callee->GetLocalCount());
+            } else {
+                ESPRESSO_COUNT(CountInvocation, callee);
+                ESPRESSO_PROFILE_CALL(callee);
+                ESPRESSO_TRACE_CALL(callee);
+                ESPRESSO_PROBE_CALL(callee, 2);
+                ESPRESSO_OPTIMIZED(handler, callee);
+                PushFrame(base, Integer{2}, callee->GetLocalCount());
             }
+            ESPRESSO_ENTER(callee);
         }
+        if (handlerTail != nullptr) {
+            // the frame runs the handler as far as the probes are
+            // concerned, and the result takes its place
+            [[maybe_unused]] const Object* returning = ProbedCallee(handler);
+            [[maybe_unused]] bool native = handler->GetType() == ValueType::NativeFunction;
+            ESPRESSO_PROBE_RETURN();
+            ESPRESSO_PROBE3(function__entry, returning, 2, native);
+            Invoke(base, Integer{2});
+            ESPRESSO_PROBE2(function__return, returning, native);
+            ESPRESSO_RETURNED(base.Unwrap());
+        }
+        Invoke(base, Integer{2});
+        ESPRESSO_DISPATCH();
     }
-}
 
-Integer Runtime::FrameCount() const {
-    return this->frames.Length();
-}
+    #ifndef ESPRESSO_THREADED_DISPATCH
+        }
+    }
+    #endif
 
-CallFrame* Runtime::FrameAt(Integer index) const {
-    return this->frames.At(index);
+    #undef ESPRESSO_LOAD_FRAME
+    #undef ESPRESSO_RETURN
+    #undef ESPRESSO_RETURNED
+    #undef ESPRESSO_INVOKE
+    #undef ESPRESSO_INVOKE_TAIL
+    #undef ESPRESSO_LOAD_GLOBAL
+    #undef ESPRESSO_CACHE_HIT
+    #undef ESPRESSO_QUICKEN
+    #undef ESPRESSO_QUICK
+    #undef ESPRESSO_ENTER
+    #undef ESPRESSO_COUNT
+    #undef ESPRESSO_SYNC_PC
+    #undef ESPRESSO_LOCAL
+    #undef ESPRESSO_BREAKPOINT
+    #undef ESPRESSO_PROFILE_INSTRUCTION
+    #undef ESPRESSO_PROFILE_CALL
+    #undef ESPRESSO_TRACE_CALL
+    #undef ESPRESSO_TRACE_RETURN
+    #undef ESPRESSO_PROBE_CALL
+    #undef ESPRESSO_PROBE_RETURN
+    #undef ESPRESSO_DISPATCH
+    #undef ESPRESSO_OPCODE
+    #undef ESPRESSO_OPCODE_UNKNOWN
+}
+
+#ifdef ESPRESSO_THREADED_DISPATCH
+#pragma GCC diagnostic pop
+#endif
+
+void Runtime::PushHandler(Integer depth, Integer base, bool tail, Value* handler) {
+    Handler* record = this->handlers.Push(this);
+    record->depth = depth.Unwrap();
+    record->base = base.Unwrap();
+    record->tail = tail;
+    record->handler.Copy(handler);
+    this->handlerDepth = depth.Unwrap();
+}
+
+void Runtime::PopHandlers(Integer depth) {
+    while (this->handlerDepth >= depth.Unwrap()) {
+        this->handlers.Pop();
+        std::int64_t count = this->handlers.Length().Unwrap();
+        this->handlerDepth = count == 0 ? -1 : this->handlers.At(Integer{count - 1})->depth;
+    }
 }
 
-Value* Runtime::Local(Integer num) {
-    return CurrentFrame()->At(this, num);
+bool Runtime::Unwind(std::int64_t entryDepth, Integer errorIndex, std::int64_t* handlerBase, Function** handlerTail) {
+    // handlers below entryDepth belong to a loop further out, which is
+    // reached by letting the exception continue
+    if (this->handlerDepth < entryDepth) {
+        return false;
+    }
+    Handler* record = this->handlers.At(Integer{this->handlers.Length().Unwrap() - 1});
+
+    // The error is read before anything else is written, it may sit in any
+    // register above the frame that is resumed. The calls of the frames
+    // left behind end here, the loop that is resumed pushed all of them.
+    std::int64_t base = 0;
+    *handlerTail = nullptr;
+    if (record->tail) {
+        // the handler takes over the frame of the body, which may have
+        // been too small to be called with an argument. Its call ends
+        // where the loop calls the handler.
+        this->AbandonFrames(Integer{record->depth}, Integer{record->depth});
+        *handlerTail = Local(Integer{0})->GetFunction(this);
+        Local(Integer{0})->Copy(StackAtAbsoluteIndex(errorIndex));
+        if (CurrentFrame()->Size().Unwrap() < 2) {
+            ReuseFrame(Integer{0}, Integer{1}, Integer{2});
+        }
+        Local(Integer{1})->Copy(Local(Integer{0}));
+    } else {
+        // the handler is called where try was
+        this->AbandonFrames(Integer{record->depth - 1}, Integer{record->depth - 1});
+        base = record->base - CurrentFrame()->AbsoluteIndex(Integer{0}).Unwrap();
+        Local(Integer{base + 1})->Copy(StackAtAbsoluteIndex(errorIndex));
+    }
+    Local(Integer{base})->Copy(&record->handler);
+
+    *handlerBase = base;
+
+    // only this handler is done, an enclosing try of the same frame is not
+    this->handlers.Pop();
+    std::int64_t count = this->handlers.Length().Unwrap();
+    this->handlerDepth = count == 0 ? -1 : this->handlers.At(Integer{count - 1})->depth;
+    return true;
 }
 
-Value* CallFrame::At(Runtime* rt, Integer index) {
-    if (index.Unwrap() >= this->stackSize.Unwrap() || index.Unwrap() < 0) {
-        Panic("Stack underflow");
-        return nullptr;
+bool Runtime::UnwindThrow(std::int64_t entryDepth, Integer errorIndex, std::int64_t* handlerBase, Function** handlerTail) {
+    if (this->handlerDepth < entryDepth) {
+        return false;
     }
+    ESPRESSO_PROBE2(throw, static_cast<std::int64_t>(StackAtAbsoluteIndex(errorIndex)->GetType()),
+        frames.Length().Unwrap());
+    return this->Unwind(entryDepth, errorIndex, handlerBase, handlerTail);
+}
 
-    std::int64_t absoluteIndex = this->stackBase.Unwrap() + index.Unwrap();
-
-    return rt->StackAtAbsoluteIndex(Integer{absoluteIndex});
+Integer Runtime::FrameCount() const {
+    return this->frames.Length();
 }
 
-Value* Runtime::StackAtAbsoluteIndex(Integer index) {
-    return this->stack.At(index);
+CallFrame* Runtime::FrameAt(Integer index) const {
+    return this->frames.At(index);
 }
 
 void Runtime::Copy(Integer destIndex, Integer sourceIndex) {
@@ -475,11 +1379,22 @@ void Runtime::Multiply(Integer dest, Integer arg1, Integer arg2) {
 }
 
 ValueType Value::GetType() const {
+#ifdef ESPRESSO_NAN_BOXING
+    // the tag, unless the bits above it are set as in a double, so a
+    // compare with any other type only needs the shift
+    std::uint64_t tag = this->bits >> TAG_SHIFT;
+    if (tag < (TAGGED >> TAG_SHIFT)) {
+        return static_cast<ValueType>(tag);
+    }
+    return ValueType::Double;
+#else
     return this->type;
+#endif
 }
 
 void Runtime::Throw(Integer idx) {
     Integer stackIndex = Integer{CurrentFrame()->AbsoluteIndex(idx)};
+    ESPRESSO_PROBE2(throw, static_cast<std::int64_t>(Local(idx)->GetType()), frames.Length().Unwrap());
     throw ThrowException{stackIndex};
 }
 
@@ -497,6 +1412,15 @@ void NativeFunction::Init(Runtime* rt, Object* next, Integer arity, Integer loca
     this->arity = arity;
     this->localCount = locals;
     this->handle = fn;
+    this->intrinsic = Intrinsic::None;
+}
+
+Intrinsic NativeFunction::GetIntrinsic() const {
+    return this->intrinsic;
+}
+
+void NativeFunction::SetIntrinsic(Intrinsic intrinsic) {
+    this->intrinsic = intrinsic;
 }
 
 Integer NativeFunction::GetArity() const {
@@ -515,7 +1439,9 @@ String* Runtime::NewString(const char* message, std::size_t givenLength) {
     // TODO: size converstion checking
     Integer length = Integer{static_cast<std::int64_t>(givenLength)};
     String* str = New<String>(this, Integer{1});
-    str->Init(this, this->heap, length, message);
+    // copying the data may collect what is at the head of the heap now
+    str->Init(this, nullptr, length, message);
+    str->SetNext(this->heap);
     this->heap = str;
     return str;
 }
@@ -524,8 +1450,102 @@ String* Runtime::NewString(const char* message) {
     return NewString(message, std::strlen(message));
 }
 
+// FNV-1a of the characters and the terminator after them, as String::Hash
+// sees them
+static std::uint32_t HashChars(const char* chars, std::int64_t length) {
+    std::uint64_t hash = 0xCBF29CE484222325;
+    for (std::int64_t i = 0; i < length; i++) {
+        hash ^= static_cast<unsigned char>(chars[i]);
+        hash *= 0x100000001B3;
+    }
+    hash *= 0x100000001B3;
+    return static_cast<std::uint32_t>(hash ^ (hash >> 32));
+}
+
+String* Runtime::InternString(const char* message, std::size_t givenLength) {
+    std::int64_t length = static_cast<std::int64_t>(givenLength);
+    std::uint32_t hash = HashChars(message, length);
+
+    if ((this->internedCount + 1) * 4 > this->internedSlots * 3) {
+        std::int64_t slots = this->internedSlots == 0 ? 64 : this->internedSlots * 2;
+        // may collect, which removes strings from the table
+        String** table = New<String*>(this, Integer{slots});
+        std::memset(static_cast<void*>(table), 0, sizeof(String*) * slots);
+        for (std::int64_t i = 0; i < this->internedSlots; i++) {
+            String* str = this->interned[i];
+            if (str != nullptr) {
+                std::int64_t slot = str->Hash() & (slots - 1);
+                while (table[slot] != nullptr) {
+                    slot = (slot + 1) & (slots - 1);
+                }
+                table[slot] = str;
+            }
+        }
+        Free<String*>(this, this->interned, Integer{this->internedSlots});
+        this->interned = table;
+        this->internedSlots = slots;
+    }
+
+    std::int64_t mask = this->internedSlots - 1;
+    for (std::int64_t slot = hash & mask; this->interned[slot] != nullptr; slot = (slot + 1) & mask) {
+        String* str = this->interned[slot];
+        if (str->Hash() == hash && str->Length().Unwrap() == length
+                && std::memcmp(str->RawPointer(), message, givenLength) == 0) {
+            return str;
+        }
+    }
+
+    // may collect too, so the slot is only looked for after
+    String* str = this->NewString(message, givenLength);
+    str->Intern(hash);
+    std::int64_t slot = hash & mask;
+    while (this->interned[slot] != nullptr) {
+        slot = (slot + 1) & mask;
+    }
+    this->interned[slot] = str;
+    this->internedCount++;
+    return str;
+}
+
+String* Runtime::InternString(const char* message) {
+    return InternString(message, std::strlen(message));
+}
+
+void Runtime::SweepInterned() {
+    std::int64_t slot = 0;
+    while (slot < this->internedSlots) {
+        String* str = this->interned[slot];
+        if (str != nullptr && !str->IsMarked()) {
+            // another string may have moved into the slot
+            this->RemoveInterned(slot);
+        } else {
+            slot++;
+        }
+    }
+}
+
+void Runtime::RemoveInterned(std::int64_t slot) {
+    std::int64_t mask = this->internedSlots - 1;
+    std::int64_t hole = slot;
+    for (std::int64_t next = (hole + 1) & mask; this->interned[next] != nullptr; next = (next + 1) & mask) {
+        // a string stays when its home slot is after the hole, up to it
+        std::int64_t home = this->interned[next]->Hash() & mask;
+        bool stays = hole <= next
+            ? hole < home && home <= next
+            : hole < home || home <= next;
+        if (!stays) {
+            this->interned[hole] = this->interned[next];
+            hole = next;
+        }
+    }
+    this->interned[hole] = nullptr;
+    this->internedCount--;
+}
+
 void String::Init(Runtime* rt, Object* next, Integer length, const char* data) {
     this->ObjectInit(ObjectType::String, next);
+    this->hash = 0;
+    this->interned = false;
     this->data.InitWithCapacity(rt, Integer{1 + length.Unwrap()});
     std::int64_t n = length.Unwrap();
     for (std::int64_t i = 0; i < n; i++) {
@@ -534,77 +1554,372 @@ void String::Init(Runtime* rt, Object* next, Integer length, const char* data) {
     *this->data.Push(rt) = '\0';
 }
 
-void Object::ObjectInit(ObjectType type, Object* next) {
-    this->isMarked = false;
-    this->type = type;
-    this->next = next;
+void Object::ObjectInit(ObjectType type, Object* next) {
+    static_assert(static_cast<std::uintptr_t>(ObjectType::Map) <= TYPE_BITS >> TYPE_SHIFT);
+    if ((reinterpret_cast<std::uintptr_t>(this) & ~NEXT_BITS) != 0) {
+        Panic("Misaligned object");
+    }
+    this->header = static_cast<std::uintptr_t>(type) << TYPE_SHIFT;
+    this->SetNext(next);
+}
+
+Function* Runtime::NewFunction() {
+    Function* function = New<Function>(this, Integer{1});
+    function->Init(this, this->heap);
+    this->heap = function;
+    return function;
+}
+
+Map* Runtime::NewMap() {
+    Map* map = New<Map>(this, Integer{1});
+    map->Init(this, this->heap);
+    this->heap = map;
+    return map;
+}
+
+void Function::Init(Runtime* rt, Object* next) {
+    this->ObjectInit(ObjectType::Function, next);
+    this->arity = Integer{0};
+    this->byteCode.Init(rt);
+    this->constants.Init(rt);
+    this->instructions.Init(rt);
+    this->globalCaches.Init(rt);
+    this->feedback.Init(rt);
+    this->assumptions.Init(rt);
+    this->deoptPoints.Init(rt);
+    this->deoptValues.Init(rt);
+    this->verified = false;
+    this->invocations = 0;
+    this->backEdges = 0;
+    this->deoptimizations = 0;
+    this->optimized = nullptr;
+    this->original = nullptr;
+    this->assumedAt = 0;
+    #ifdef ESPRESSO_JIT
+    this->jitState = JitState::Pending;
+    this->machineCode = nullptr;
+    this->machineCodeSize = 0;
+    #endif
+}
+
+bool Function::IsVerified() const {
+    return this->verified;
+}
+
+Tier Function::GetTier() const {
+    #ifdef ESPRESSO_JIT
+    if (this->jitState == JitState::Compiled) {
+        return Tier::Compiled;
+    }
+    #endif
+    if (this->optimized != nullptr) {
+        return Tier::Optimized;
+    }
+    return this->instructions.RawHeadPointer() == nullptr ? Tier::ByteCode : Tier::Interpreted;
+}
+
+bool Function::CountInvocation() {
+    this->invocations++;
+    return this->invocations == HOT_INVOCATIONS;
+}
+
+bool Function::CountBackEdge() {
+    this->backEdges++;
+    return this->backEdges == HOT_BACK_EDGES;
+}
+
+std::uint64_t Function::GetInvocationCount() const {
+    return this->invocations;
+}
+
+std::uint64_t Function::GetBackEdgeCount() const {
+    return this->backEdges;
+}
+
+Function* Function::GetOptimized() const {
+    return this->optimized;
+}
+
+Function* Function::GetOriginal() const {
+    return this->original;
+}
+
+bool Function::IsOptimizable() const {
+    return this->verified
+        && this->original == nullptr
+        && this->optimized == nullptr
+        && this->deoptimizations < MAX_DEOPTIMIZATIONS;
+}
+
+void Function::GiveUpOptimizing() {
+    this->deoptimizations = MAX_DEOPTIMIZATIONS;
+}
+
+void Function::SetOptimized(Runtime* rt, Function* optimized) {
+    optimized->original = this;
+    optimized->verified = true;
+    optimized->assumedAt = rt->GetGlobals()->Redefinitions();
+    optimized->AllocateFeedback(rt, optimized->instructions.Length());
+    this->optimized = optimized;
+}
+
+void Function::DropOptimized() {
+    if (this->optimized == nullptr) {
+        return;
+    }
+    this->optimized = nullptr;
+    this->deoptimizations++;
+    this->invocations = 0;
+    this->backEdges = 0;
+}
+
+bool Function::HoldsAssumptions(Runtime* rt) {
+    Map* globals = rt->GetGlobals();
+    if (this->assumedAt == globals->Redefinitions()) {
+        return true;
+    }
+    std::int64_t count = this->assumptions.Length().Unwrap();
+    for (std::int64_t i = 0; i < count; i++) {
+        Assumption* assumption = this->assumptions.At(Integer{i});
+        Value* current = globals->Get(rt, assumption->name);
+        if (current == nullptr || !current->Equals(rt, assumption->value)) {
+            return false;
+        }
+    }
+    // what was redefined is nothing this function relies on
+    this->assumedAt = globals->Redefinitions();
+    return true;
+}
+
+void Function::ReserveInstructions(Runtime* rt, Integer capacity) {
+    this->instructions.Reserve(rt, capacity);
+}
+
+Instruction* Function::PushInstruction(Runtime* rt) {
+    return this->instructions.Push(rt);
+}
+
+void Function::PushAssumption(Runtime* rt, Value* name, Value* value) {
+    Assumption* assumption = this->assumptions.Push(rt);
+    assumption->name = name;
+    assumption->value = value;
+}
+
+DeoptPoint* Function::PushDeoptPoint(Runtime* rt) {
+    return this->deoptPoints.Push(rt);
+}
+
+DeoptValue* Function::PushDeoptValue(Runtime* rt) {
+    return this->deoptValues.Push(rt);
+}
+
+DeoptPoint* Function::DeoptPointAt(Integer index) const {
+    return this->deoptPoints.At(index);
+}
+
+DeoptValue* Function::DeoptValueAt(Integer index) const {
+    return this->deoptValues.At(index);
+}
+
+#ifdef ESPRESSO_JIT
+JitState Function::GetJitState() const {
+    return this->jitState;
+}
+
+void* Function::GetMachineCode() const {
+    return this->machineCode;
+}
+
+void Function::SetMachineCode(JitState state, void* code, std::size_t size) {
+    this->jitState = state;
+    this->machineCode = code;
+    this->machineCodeSize = size;
+}
+#endif
+
+Integer Function::GetLocalCount() const {
+    return this->localCount;
+}
+
+Integer Function::GetConstantCount() const {
+    return this->constants.Length();
+}
+
+Integer Function::GetByteCodeCount() const {
+    return this->byteCode.Length();
+}
+
+ByteCodeType ByteCode::Type() const {
+    return static_cast<ByteCodeType>(this->value & bits::OP_BITS);
+}
+
+Integer ByteCode::SmallArgument1() const {
+    return Integer{(this->value & bits::ARG1_BITS) >> bits::ARG1_SHIFT};
+}
+
+Integer ByteCode::SmallArgument2() const {
+    return Integer{(this->value & bits::ARG2_BITS) >> bits::ARG2_SHIFT};
+}
+
+Integer ByteCode::SmallArgument3() const {
+    return Integer{(this->value & bits::ARG3_BITS) >> bits::ARG3_SHIFT};
+}
+
+Integer ByteCode::LargeArgument() const {
+    return Integer{(this->value & bits::LARGE_ARG_BITS) >> bits::LARGE_ARG_SHIFT};
+}
+
+ByteCode* Function::ByteCodeAt(Integer index) const {
+    return this->byteCode.At(index);
+}
+
+Instruction* Function::InstructionHead() {
+    return this->instructions.RawHeadPointer();
+}
+
+GlobalCache* Function::GlobalCacheHead() {
+    return this->globalCaches.RawHeadPointer();
+}
+
+Feedback* Function::FeedbackHead() {
+    return this->feedback.RawHeadPointer();
+}
+
+void Function::ForgetUnmarkedCallees() {
+    std::int64_t count = this->feedback.Length().Unwrap();
+    for (std::int64_t i = 0; i < count; i++) {
+        Feedback* site = this->feedback.At(Integer{i});
+        if (site->callee != nullptr && !site->callee->IsMarked()) {
+            // whatever calls it next is a different function
+            site->callee = nullptr;
+            site->callees = CalleeFeedback::None;
+        }
+    }
+}
+
+void Feedback::RecordCall(Runtime* rt, Value* target, std::int64_t count) {
+    Object* object = nullptr;
+    if (target->GetType() == ValueType::Function) {
+        object = target->GetFunction(rt);
+    } else if (target->GetType() == ValueType::NativeFunction) {
+        object = target->GetNativeFunction(rt);
+    }
+    if (this->callees == CalleeFeedback::None) {
+        this->callee = object;
+        this->callees = CalleeFeedback::Monomorphic;
+    } else if (this->callees == CalleeFeedback::Monomorphic && this->callee != object) {
+        this->callee = nullptr;
+        this->callees = CalleeFeedback::Polymorphic;
+    }
+    std::int64_t recorded = count < ARGUMENTS ? count : ARGUMENTS;
+    for (std::int64_t i = 0; i < recorded; i++) {
+        this->arguments[i] |= TypeBit(target[i + 1].GetType());
+    }
+}
+
+Value* Function::ConstantAt(Integer index) const {
+    return this->constants.At(index);
+}
+
+Integer Function::GetArity() const {
+    return this->arity;
+}
+
+#ifdef ESPRESSO_NAN_BOXING
+bool Value::IsTruthy() const {
+    // nil is zero, false the tag of a boolean alone
+    return this->bits != 0 && this->bits != static_cast<std::uint64_t>(ValueType::Boolean) << TAG_SHIFT;
+}
+
+void Value::Copy(Value* other) {
+    this->bits = other->bits;
+}
+
+void Value::SetTagged(ValueType type, std::uint64_t payload) {
+#ifdef DEBUG_ENABLED
+    if (payload > PAYLOAD_BITS) {
+        Panic("Payload does not fit a Value");
+    }
+#endif
+    this->bits = (static_cast<std::uint64_t>(type) << TAG_SHIFT) | payload;
 }
 
-Function* Runtime::NewFunction() {
-    Function* function = New<Function>(this, Integer{1});
-    function->Init(this, this->heap);
-    this->heap = function;
-    return function;
+std::uint64_t Value::Payload() const {
+    return this->bits & PAYLOAD_BITS;
 }
 
-Map* Runtime::NewMap() {
-    Map* map = New<Map>(this, Integer{1});
-    map->Init(this, this->heap);
-    this->heap = map;
-    return map;
+void Value::SetDouble(Double val) {
+    double real = val.Unwrap();
+    std::uint64_t raw = 0x7FF8000000000000;
+    if (real == real) {
+        std::memcpy(&raw, &real, sizeof(raw));
+    }
+    this->bits = raw ^ DOUBLE_FLIP;
 }
 
-void Function::Init(Runtime* rt, Object* next) {
-    this->ObjectInit(ObjectType::Function, next);
-    this->arity = Integer{0};
-    this->byteCode.Init(rt);
-    this->constants.Init(rt);
+Double Value::GetDouble(Runtime* rt) const {
+    this->AssertType(rt, ValueType::Double);
+    std::uint64_t raw = this->bits ^ DOUBLE_FLIP;
+    double real;
+    std::memcpy(&real, &raw, sizeof(real));
+    return Double{real};
 }
 
-Integer Function::GetLocalCount() const {
-    return this->localCount;
+void Value::SetInteger(Integer val) {
+    this->SetTagged(ValueType::Integer, static_cast<std::uint64_t>(val.Unwrap()) & PAYLOAD_BITS);
 }
 
-Integer Function::GetConstantCount() const {
-    return this->constants.Length();
+Integer Value::GetInteger(Runtime* rt) const {
+    this->AssertType(rt, ValueType::Integer);
+    // sign extends the payload
+    return Integer{static_cast<std::int64_t>(this->Payload() << (64 - TAG_SHIFT)) >> (64 - TAG_SHIFT)};
 }
 
-Integer Function::GetByteCodeCount() const {
-    return this->byteCode.Length();
+void Value::SetBoolean(bool val) {
+    this->SetTagged(ValueType::Boolean, val ? 1 : 0);
 }
 
-ByteCodeType ByteCode::Type() const {
-    return static_cast<ByteCodeType>(this->value & bits::OP_BITS);
+bool Value::GetBoolean(Runtime* rt) const {
+    this->AssertType(rt, ValueType::Boolean);
+    return this->Payload() != 0;
 }
 
-Integer ByteCode::SmallArgument1() const {
-    return Integer{(this->value & bits::ARG1_BITS) >> bits::ARG1_SHIFT};
+void Value::SetNativeFunction(NativeFunction* val) {
+    this->SetTagged(ValueType::NativeFunction, reinterpret_cast<std::uintptr_t>(val));
 }
 
-Integer ByteCode::SmallArgument2() const {
-    return Integer{(this->value & bits::ARG2_BITS) >> bits::ARG2_SHIFT};
+NativeFunction* Value::GetNativeFunction(Runtime* rt) const {
+    this->AssertType(rt, ValueType::NativeFunction);
+    return reinterpret_cast<NativeFunction*>(this->Payload());
 }
 
-Integer ByteCode::SmallArgument3() const {
-    return Integer{(this->value & bits::ARG3_BITS) >> bits::ARG3_SHIFT};
+void Value::SetFunction(Function* val) {
+    this->SetTagged(ValueType::Function, reinterpret_cast<std::uintptr_t>(val));
 }
 
-Integer ByteCode::LargeArgument() const {
-    return Integer{(this->value & bits::LARGE_ARG_BITS) >> bits::LARGE_ARG_SHIFT};
+Function* Value::GetFunction(Runtime* rt) const {
+    this->AssertType(rt, ValueType::Function);
+    return reinterpret_cast<Function*>(this->Payload());
 }
 
-ByteCode* Function::ByteCodeAt(Integer index) const {
-    return this->byteCode.At(index);
+void Value::SetString(String* val) {
+    this->SetTagged(ValueType::String, reinterpret_cast<std::uintptr_t>(val));
 }
 
-Value* Function::ConstantAt(Integer index) const {
-    return this->constants.At(index);
+String* Value::GetString(Runtime* rt) const {
+    this->AssertType(rt, ValueType::String);
+    return reinterpret_cast<String*>(this->Payload());
 }
 
-Integer Function::GetArity() const {
-    return this->arity;
+void Value::SetMap(Map* val) {
+    this->SetTagged(ValueType::Map, reinterpret_cast<std::uintptr_t>(val));
 }
 
+Map* Value::GetMap(Runtime* rt) const {
+    this->AssertType(rt, ValueType::Map);
+    return reinterpret_cast<Map*>(this->Payload());
+}
+#else
 bool Value::IsTruthy() const {
     switch (this->GetType()) {
         case ValueType::Boolean: {
@@ -624,6 +1939,14 @@ void Value::Copy(Value* other) {
     this->as = other->as;
 }
 
+std::size_t Value::TypeOffset() {
+    return offsetof(Value, type);
+}
+
+std::size_t Value::PayloadOffset() {
+    return offsetof(Value, as);
+}
+
 void Value::SetDouble(Double val) {
     this->as.real = val;
     this->type = ValueType::Double;
@@ -694,6 +2017,8 @@ Map* Value::GetMap(Runtime* rt) const {
     return this->as.map;
 }
 
+#endif
+
 void Value::AssertType(Runtime* rt, ValueType expected) const {
     if (this->GetType() == expected) {
         return;
@@ -724,11 +2049,34 @@ void Runtime::StoreGlobal(Integer keyIndex, Integer valueIndex) {
 }
 
 void Runtime::LoadGlobal(Integer destIndex, Integer keyIndex) {
-    Value* dest = Local(destIndex);
     Value* key = Local(keyIndex);
 
     key->AssertType(this, ValueType::String);
 
+    LoadGlobal(destIndex, key);
+}
+
+void Runtime::LoadGlobal(Integer destIndex, Value* key, GlobalCache* cache) {
+    #ifdef ESPRESSO_CACHE_DEBUG
+    this->globalCacheMisses++;
+    #endif
+
+    Value* result = this->globals->Get(this, key);
+
+    if (result != nullptr) {
+        cache->version = this->globals->Version();
+        cache->slot = result;
+        Local(destIndex)->Copy(result);
+        return;
+    }
+
+    // throws
+    LoadGlobal(destIndex, key);
+}
+
+void Runtime::LoadGlobal(Integer destIndex, Value* key) {
+    Value* dest = Local(destIndex);
+
     Value* result = this->globals->Get(this, key);
 
     if (result != nullptr) {
@@ -736,45 +2084,270 @@ void Runtime::LoadGlobal(Integer destIndex, Integer keyIndex) {
         return;
     }
 
-    this->Local(Integer{0})->SetString(this->NewString(""));
-    String* str = this->Local(Integer{0})->GetString(this);
-    str->Push(this, "Undefined Global: ");
-    str->Push(this, key->GetString(this));
-    str->Push(this, '\0');
+    // put together before it is made a string, as the key may be in local
+    // 0, which the message replaces
+    constexpr char PREFIX[] = "Undefined Global: ";
+    constexpr std::int64_t prefixLength = sizeof(PREFIX) - 1;
+    String* name = key->GetString(this);
+    std::int64_t nameLength = name->Length().Unwrap();
+    std::int64_t length = prefixLength + nameLength;
+    char* message = New<char>(this, Integer{length});
+    std::memcpy(message, PREFIX, prefixLength);
+    std::memcpy(message + prefixLength, name->RawPointer(), nameLength);
+    this->Local(Integer{0})->SetString(this->NewString(message, length));
+    Free<char>(this, message, Integer{length});
     this->Throw(Integer{0});
 }
 
-Value* Map::Get(Runtime* rt, Value* key) {
+// finalizer of MurmurHash3, spreads every bit of x over the result
+static std::uint64_t Mix(std::uint64_t x) {
+    x ^= x >> 33;
+    x *= 0xFF51AFD7ED558CCD;
+    x ^= x >> 33;
+    x *= 0xC4CEB9FE1A85EC53;
+    x ^= x >> 33;
+    return x;
+}
+
+std::uint64_t Value::Hash(Runtime* rt) const {
+    std::uint64_t bits = 0;
+    switch (this->GetType()) {
+        case ValueType::Nil: {
+            break;
+        }
+        case ValueType::Integer: {
+            bits = static_cast<std::uint64_t>(this->GetInteger(rt).Unwrap());
+            break;
+        }
+        case ValueType::Double: {
+            // 0.0 and -0.0 are equal
+            double real = this->GetDouble(rt).Unwrap();
+            if (real != 0.0) {
+                std::memcpy(&bits, &real, sizeof(bits));
+            }
+            break;
+        }
+        case ValueType::Boolean: {
+            bits = this->GetBoolean(rt);
+            break;
+        }
+        case ValueType::String: {
+            bits = this->GetString(rt)->Hash();
+            break;
+        }
+        case ValueType::Function: {
+            bits = reinterpret_cast<std::uintptr_t>(this->GetFunction(rt));
+            break;
+        }
+        case ValueType::NativeFunction: {
+            bits = reinterpret_cast<std::uintptr_t>(this->GetNativeFunction(rt));
+            break;
+        }
+        case ValueType::Map: {
+            bits = reinterpret_cast<std::uintptr_t>(this->GetMap(rt));
+            break;
+        }
+        default: {
+            Panic("Unhandled ValueType in Hash");
+        }
+    }
+    return Mix(bits ^ static_cast<std::uint64_t>(this->GetType()) << 56);
+}
+
+// the slots of group that hold the control byte, a bit each
+static std::uint32_t MatchGroup(const std::uint8_t* group, std::uint8_t control) {
+#ifdef __SSE2__
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+    return static_cast<std::uint32_t>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, _mm_set1_epi8(static_cast<char>(control)))));
+#else
+    std::uint32_t matches = 0;
+    for (std::uint32_t i = 0; i < 16; i++) {
+        if (group[i] == control) {
+            matches |= 1u << i;
+        }
+    }
+    return matches;
+#endif
+}
+
+std::uint32_t* Map::Slots() const {
+    return reinterpret_cast<std::uint32_t*>(this->table + this->slotCount);
+}
+
+// Groups are probed in the order 0, 1, 3, 6, ... from the one the high
+// bits of the hash pick, which visits every group of a power of two many.
+// Within a group the control bytes are matched against the low 7 bits
+// first, so only keys that are likely equal are compared.
+Map::Entry* Map::Find(Runtime* rt, Value* key, std::uint64_t hash) const {
+    if (this->slotCount == 0) {
+        return nullptr;
+    }
+    std::uint32_t* slots = this->Slots();
+    std::uint8_t control = static_cast<std::uint8_t>(hash & 0x7F);
+    std::uint64_t mask = this->slotCount / GROUP_SIZE - 1;
+    std::uint64_t group = (hash >> 7) & mask;
+    for (std::uint64_t probe = 1; ; probe++) {
+        const std::uint8_t* controls = this->table + group * GROUP_SIZE;
+        for (std::uint32_t matches = MatchGroup(controls, control); matches != 0; matches &= matches - 1) {
+            std::uint32_t slot = static_cast<std::uint32_t>(group * GROUP_SIZE) + std::countr_zero(matches);
+            Entry* entry = this->entries.At<Unchecked>(Integer{slots[slot]});
+            if (entry->key.Equals(rt, key)) {
+                return entry;
+            }
+        }
+        if (MatchGroup(controls, EMPTY) != 0) {
+            return nullptr;
+        }
+        group = (group + probe) & mask;
+    }
+}
+
+void Map::Insert(std::uint32_t index, std::uint64_t hash) {
+    std::uint64_t mask = this->slotCount / GROUP_SIZE - 1;
+    std::uint64_t group = (hash >> 7) & mask;
+    for (std::uint64_t probe = 1; ; probe++) {
+        std::uint8_t* controls = this->table + group * GROUP_SIZE;
+        std::uint32_t empty = MatchGroup(controls, EMPTY);
+        if (empty != 0) {
+            std::uint32_t slot = static_cast<std::uint32_t>(group * GROUP_SIZE) + std::countr_zero(empty);
+            this->table[slot] = static_cast<std::uint8_t>(hash & 0x7F);
+            this->Slots()[slot] = index;
+            return;
+        }
+        group = (group + probe) & mask;
+    }
+}
+
+void Map::Rehash(Runtime* rt) {
+    std::int64_t first = this->array.Length().Unwrap();
+    Value next;
+    next.SetInteger(Integer{first});
+    for (Entry* entry = this->Find(rt, &next, next.Hash(rt)); entry != nullptr;
+            entry = this->Find(rt, &next, next.Hash(rt))) {
+        this->array.Push(rt)->Copy(&entry->value);
+        next.SetInteger(Integer{this->array.Length().Unwrap()});
+    }
+
+    // the moved entries are the integer keys the array part covers now
+    std::int64_t last = this->array.Length().Unwrap();
     std::int64_t n = this->entries.Length().Unwrap();
+    std::int64_t kept = 0;
     for (std::int64_t index = 0; index < n; index++) {
-        Entry* entry = this->entries.At(Integer{index});
-        if (entry->key.Equals(rt, key)) {
-            return &entry->value;
+        Entry* entry = this->entries.At<Unchecked>(Integer{index});
+        if (entry->key.GetType() == ValueType::Integer
+                && entry->key.GetInteger(rt).Unwrap() >= first
+                && entry->key.GetInteger(rt).Unwrap() < last) {
+            continue;
+        }
+        Entry* to = this->entries.At<Unchecked>(Integer{kept++});
+        to->key.Copy(&entry->key);
+        to->value.Copy(&entry->value);
+    }
+    this->entries.Truncate(Integer{kept});
+
+    // at most 7 in 8 slots are in use, so probes end at an empty slot
+    // soon
+    std::uint32_t newSlotCount = this->slotCount == 0 ? GROUP_SIZE : this->slotCount;
+    while (kept + 1 > std::int64_t{newSlotCount} / 8 * 7) {
+        newSlotCount *= 2;
+    }
+    Free<std::uint8_t>(rt, this->table, Integer{this->slotCount * SLOT_BYTES});
+    this->table = nullptr;
+    this->slotCount = 0;
+    this->table = New<std::uint8_t>(rt, Integer{newSlotCount * SLOT_BYTES});
+    this->slotCount = newSlotCount;
+    std::memset(this->table, EMPTY, newSlotCount);
+    for (std::uint32_t index = 0; index < kept; index++) {
+        this->Insert(index, this->entries.At<Unchecked>(Integer{index})->key.Hash(rt));
+    }
+}
+
+bool Map::Continues(Runtime* rt, Value* key) const {
+    return key->GetType() == ValueType::Integer
+        && key->GetInteger(rt).Unwrap() == this->array.Length().Unwrap();
+}
+
+Value* Map::Get(Runtime* rt, Value* key) {
+    if (key->GetType() == ValueType::Integer) {
+        std::int64_t index = key->GetInteger(rt).Unwrap();
+        if (index >= 0 && index < this->array.Length().Unwrap()) {
+            return this->array.At<Unchecked>(Integer{index});
         }
     }
-    return nullptr;
+    Entry* entry = this->Find(rt, key, key->Hash(rt));
+    if (entry == nullptr) {
+        return nullptr;
+    }
+    return &entry->value;
+}
+
+std::uint64_t Map::Version() const {
+    return this->version;
+}
+
+const std::uint64_t* Map::VersionAddress() const {
+    return &this->version;
+}
+
+std::uint64_t Map::Redefinitions() const {
+    return this->redefinitions;
+}
+
+// a key that held a function is given another value
+static bool Redefines(Runtime* rt, Value* current, Value* value) {
+    return (current->GetType() == ValueType::Function || current->GetType() == ValueType::NativeFunction)
+        && !current->Equals(rt, value);
 }
 
 void Map::Put(Runtime* rt, Value* key, Value* value) {
-    Entry* existing = nullptr;
-    std::int64_t n = this->entries.Length().Unwrap();
-    for (std::int64_t index = 0; index < n; index++) {
-        Entry* entry = this->entries.At(Integer{index});
-        if (entry->key.Equals(rt, key)) {
-            existing = entry;
-            break;
+    Value* existing = nullptr;
+    if (key->GetType() == ValueType::Integer) {
+        std::int64_t index = key->GetInteger(rt).Unwrap();
+        if (index >= 0 && index < this->array.Length().Unwrap()) {
+            existing = this->array.At<Unchecked>(Integer{index});
         }
     }
+    std::uint64_t hash = 0;
     if (existing == nullptr) {
-        existing = this->entries.Push(rt);
+        hash = key->Hash(rt);
+        Entry* entry = this->Find(rt, key, hash);
+        if (entry != nullptr) {
+            existing = &entry->value;
+        }
+    }
+    if (existing != nullptr) {
+        if (Redefines(rt, existing, value)) {
+            this->redefinitions++;
+        }
+        existing->Copy(value);
+        return;
+    }
+
+    if (!this->Continues(rt, key)
+            && this->entries.Length().Unwrap() + 1 > std::int64_t{this->slotCount} / 8 * 7) {
+        this->Rehash(rt);
+    }
+    // may move every value of the array part, or every entry
+    this->version++;
+    if (this->Continues(rt, key)) {
+        this->array.Push(rt)->Copy(value);
+        return;
     }
-    existing->key.Copy(key);
-    existing->value.Copy(value);
+    std::uint32_t index = static_cast<std::uint32_t>(this->entries.Length().Unwrap());
+    Entry* entry = this->entries.Push(rt);
+    entry->key.Copy(key);
+    entry->value.Copy(value);
+    this->Insert(index, hash);
 }
 
 void Map::Init(Runtime* rt, Object* next) {
     this->ObjectInit(ObjectType::Map, next);
+    this->array.Init(rt);
     this->entries.Init(rt);
+    this->table = nullptr;
+    this->slotCount = 0;
+    this->version = 1;
+    this->redefinitions = 0;
 }
 
 Map::Iterator Map::GetIterator() const {
@@ -788,15 +2361,24 @@ Map::Iterator::Iterator(const Map* map, std::int64_t val) {
 
 bool Map::Iterator::HasNext() {
     this->next++;
-    return this->next < map->entries.Length().Unwrap();
+    return this->next < map->array.Length().Unwrap() + map->entries.Length().Unwrap();
 }
 
 Value* Map::Iterator::Key() {
-    return &this->map->entries.At(Integer{this->next})->key;
+    std::int64_t arrayLength = this->map->array.Length().Unwrap();
+    if (this->next < arrayLength) {
+        this->key.SetInteger(Integer{this->next});
+        return &this->key;
+    }
+    return &this->map->entries.At(Integer{this->next - arrayLength})->key;
 }
 
 Value* Map::Iterator::Value() {
-    return &this->map->entries.At(Integer{this->next})->value;
+    std::int64_t arrayLength = this->map->array.Length().Unwrap();
+    if (this->next < arrayLength) {
+        return this->map->array.At(Integer{this->next});
+    }
+    return &this->map->entries.At(Integer{this->next - arrayLength})->value;
 }
 
 bool Value::Equals(Runtime* rt, Value* other) const {
@@ -837,20 +2419,43 @@ bool Value::Equals(Runtime* rt, Value* other) const {
 }
 
 bool String::Equals(String* other) const {
+    if (this == other) {
+        return true;
+    }
+    // there is one interned string with the same characters
+    if (this->interned && other->interned) {
+        return false;
+    }
     std::int64_t n = this->data.Length().Unwrap();
     if (other->data.Length().Unwrap() != n) {
         return false;
     }
-    for (std::int64_t i = 0; i < n; i++) {
-        Integer wrapped = Integer{i};
-        if (*other->data.At(wrapped) != *this->data.At(wrapped)) {
-            return false;
-        }
+    return n == 0 || std::memcmp(this->data.RawHeadPointer(), other->data.RawHeadPointer(), n) == 0;
+}
+
+std::uint32_t String::Hash() const {
+    if (this->interned) {
+        return this->hash;
     }
-    return true;
+    // a string ends in its terminator
+    std::int64_t length = this->data.Length().Unwrap() - 1;
+    return HashChars(this->data.RawHeadPointer(), length < 0 ? 0 : length);
+}
+
+bool String::IsInterned() const {
+    return this->interned;
+}
+
+void String::Intern(std::uint32_t hash) {
+    this->hash = hash;
+    this->interned = true;
 }
 
 void String::Push(Runtime* rt, char c) {
+    if (this->interned) {
+        Panic("Interned strings cannot change");
+        return;
+    }
     *this->data.Push(rt) = c;
 }
 
@@ -872,6 +2477,10 @@ void String::Push(Runtime* rt, String* other) {
 }
 
 void String::Clear() {
+    if (this->interned) {
+        Panic("Interned strings cannot change");
+        return;
+    }
     this->data.Truncate(Integer{0});
 }
 
@@ -927,7 +2536,7 @@ const char* String::RawPointer() const {
     return this->data.RawHeadPointer();
 }
 
-void Function::Verify(Runtime* rt) const {
+void Function::Verify(Runtime* rt) {
     if (this->arity.Unwrap() > this->localCount.Unwrap()) {
         rt->Local(Integer{0})->SetString(rt->NewString("Invalid arity for function. Must be <= localCount"));
         rt->Throw(Integer{0});
@@ -973,6 +2582,85 @@ void Function::Verify(Runtime* rt) const {
             }
         }
     }
+
+    // decoding waits until the function is called, most never are
+    this->verified = true;
+}
+
+std::uint32_t Function::NewGlobalCache(Runtime* rt) {
+    std::uint32_t index = static_cast<std::uint32_t>(this->globalCaches.Length().Unwrap());
+    GlobalCache* cache = this->globalCaches.Push(rt);
+    // maps start at version 1, so the first lookup always misses
+    cache->version = 0;
+    cache->slot = nullptr;
+    return index;
+}
+
+void Function::AllocateFeedback(Runtime* rt, Integer count) {
+    this->feedback.Reserve(rt, count);
+    for (std::int64_t i = 0; i < count.Unwrap(); i++) {
+        Feedback* site = this->feedback.Push(rt);
+        site->callee = nullptr;
+        site->jumped = 0;
+        site->fellThrough = 0;
+        for (std::int64_t j = 0; j < Feedback::ARGUMENTS; j++) {
+            site->arguments[j] = 0;
+        }
+        site->results = 0;
+        site->callees = CalleeFeedback::None;
+    }
+}
+
+void Function::Decode(Runtime* rt) {
+    std::int64_t byteCodeCount = this->byteCode.Length().Unwrap();
+    if (!this->verified || this->instructions.Length().Unwrap() == byteCodeCount) {
+        return;
+    }
+
+    // the jump targets below point into this vector, so it must never grow
+    // after this point
+    this->instructions.Reserve(rt, Integer{byteCodeCount});
+    for (std::int64_t i = 0; i < byteCodeCount; i++) {
+        this->instructions.Push(rt);
+    }
+    // feedback is only gathered for functions that run
+    this->AllocateFeedback(rt, Integer{byteCodeCount});
+
+    for (std::int64_t i = 0; i < byteCodeCount; i++) {
+        ByteCode* bc = this->ByteCodeAt(Integer{i});
+        Instruction* instruction = this->instructions.At(Integer{i});
+        instruction->opcode = OpCode(bc->Type());
+        instruction->arg1 = static_cast<std::uint8_t>(bc->SmallArgument1().Unwrap());
+        instruction->arg2 = static_cast<std::uint8_t>(bc->SmallArgument2().Unwrap());
+        instruction->arg3 = static_cast<std::uint8_t>(bc->SmallArgument3().Unwrap());
+        instruction->cache = 0;
+        instruction->operand.constant = nullptr;
+        switch (bc->Type()) {
+            case ByteCodeType::LoadConstant: {
+                instruction->operand.constant = this->ConstantAt(bc->LargeArgument());
+                break;
+            }
+            case ByteCodeType::LoadGlobalConstant: {
+                instruction->operand.constant = this->ConstantAt(bc->LargeArgument());
+                instruction->cache = NewGlobalCache(rt);
+                break;
+            }
+            case ByteCodeType::InvokeGlobal:
+            case ByteCodeType::InvokeGlobalTail: {
+                instruction->operand.constant = this->ConstantAt(bc->SmallArgument3());
+                instruction->cache = NewGlobalCache(rt);
+                break;
+            }
+            case ByteCodeType::JumpIfFalse:
+            case ByteCodeType::Jump: {
+                instruction->operand.target = this->instructions.At(bc->LargeArgument());
+                break;
+            }
+            default: {
+                break;
+            }
+        }
+    }
 }
 
 void ByteCode::Verify(Runtime* rt, const Function* fn) const {
@@ -1019,6 +2707,23 @@ void ByteCode::Verify(Runtime* rt, const Function* fn) const {
         }
     };
 
+    auto validateConstantIsString = [&](Integer constantArg, const char* message) {
+        validateConstantIsReadable(constantArg, message);
+        if (fn->ConstantAt(constantArg)->GetType() != ValueType::String) {
+            fmtAbort(message, constantArg);
+        }
+    };
+
+    // the callee register, followed by the argument registers
+    auto validateInvokeRegisters = [&](const char* baseMessage, const char* countMessage, const char* lastMessage) {
+        validateRegisterIsWritable(this->SmallArgument1(), baseMessage);
+        std::int64_t argCount = this->SmallArgument2().Unwrap();
+        if (argCount <= 0) {
+            fmtAbort(countMessage, Integer{argCount});
+        }
+        validateRegisterIsReadable(Integer{this->SmallArgument1().Unwrap() + argCount - 1}, lastMessage);
+    };
+
     switch (this->Type()) {
         case ByteCodeType::NoOp: {
             break;
@@ -1037,20 +2742,39 @@ void ByteCode::Verify(Runtime* rt, const Function* fn) const {
             validateRegisterIsReadable(this->SmallArgument2(), "Invalid readable register R%lld for LoadGlobal");
             break;
         }
+        case ByteCodeType::LoadGlobalConstant: {
+            validateRegisterIsWritable(this->SmallArgument1(), "Invalid writable register R%lld for LoadGlobalConstant");
+            validateConstantIsString(this->LargeArgument(), "Invalid string constant %lld for LoadGlobalConstant");
+            break;
+        }
         case ByteCodeType::InvokeTail: {
-            validateRegisterIsWritable(this->SmallArgument1(), "Invalid writable register R%lld for Invoke");
-            std::int64_t argCount = this->SmallArgument2().Unwrap();
-            if (argCount <= 0) {
-                fmtAbort("Invalid argument count %lld in invoketail", Integer{argCount});
-            }
+            validateInvokeRegisters(
+                "Invalid writable register R%lld for InvokeTail",
+                "Invalid argument count %lld in invoketail",
+                "Invalid last argument register R%lld for InvokeTail");
             break;
         }
         case ByteCodeType::Invoke: {
-            validateRegisterIsWritable(this->SmallArgument1(), "Invalid writable register R%lld for Invoke");
-            std::int64_t argCount = this->SmallArgument2().Unwrap();
-            if (argCount <= 0) {
-                fmtAbort("Invalid argument count %lld in invoke", Integer{argCount});
-            }
+            validateInvokeRegisters(
+                "Invalid writable register R%lld for Invoke",
+                "Invalid argument count %lld in invoke",
+                "Invalid last argument register R%lld for Invoke");
+            break;
+        }
+        case ByteCodeType::InvokeGlobal: {
+            validateInvokeRegisters(
+                "Invalid writable register R%lld for InvokeGlobal",
+                "Invalid argument count %lld in invokeglobal",
+                "Invalid last argument register R%lld for InvokeGlobal");
+            validateConstantIsString(this->SmallArgument3(), "Invalid string constant %lld for InvokeGlobal");
+            break;
+        }
+        case ByteCodeType::InvokeGlobalTail: {
+            validateInvokeRegisters(
+                "Invalid writable register R%lld for InvokeGlobalTail",
+                "Invalid argument count %lld in invokeglobaltail",
+                "Invalid last argument register R%lld for InvokeGlobalTail");
+            validateConstantIsString(this->SmallArgument3(), "Invalid string constant %lld for InvokeGlobalTail");
             break;
         }
         case ByteCodeType::Copy: {
@@ -1072,6 +2796,22 @@ void ByteCode::Verify(Runtime* rt, const Function* fn) const {
             validateRegisterIsReadable(this->SmallArgument2(), "Invalid readable register 2 R%lld for StoreGlobal");
             break;
         }
+        case ByteCodeType::QuickEqual:
+        case ByteCodeType::QuickLess:
+        case ByteCodeType::QuickLessEqual:
+        case ByteCodeType::QuickGreater:
+        case ByteCodeType::QuickGreaterEqual:
+        case ByteCodeType::QuickAdd:
+        case ByteCodeType::QuickSubtract:
+        case ByteCodeType::QuickMultiply:
+        case ByteCodeType::QuickDivide: {
+            fmtAbort("Invalid opcode %lld, only the interpreter may quicken instructions", Integer{OpCode(this->Type())});
+            break;
+        }
+        case ByteCodeType::Guard: {
+            fmtAbort("Invalid opcode %lld, only the optimizer may emit guards", Integer{OpCode(this->Type())});
+            break;
+        }
         default: {
             Panic("Unhandled bytecode in bytecode verifier");
             return;
@@ -1097,23 +2837,23 @@ void NativeFunction::Verify(Runtime* rt) const {
 }
 
 Object* Object::GetNext() {
-    return this->next;
+    return reinterpret_cast<Object*>(this->header & NEXT_BITS);
 }
 
 void Object::SetNext(Object* next) {
-    this->next = next;
+    this->header = (this->header & ~NEXT_BITS) | reinterpret_cast<std::uintptr_t>(next);
 }
 
 bool Object::IsMarked() const {
-    return this->isMarked;
+    return (this->header & MARK_BIT) != 0;
 }
 
 void Object::SetMark(bool val) {
-    this->isMarked = val;
+    this->header = (this->header & ~MARK_BIT) | (val ? MARK_BIT : 0);
 }
 
 ObjectType Object::Type() const {
-    return this->type;
+    return static_cast<ObjectType>((this->header & TYPE_BITS) >> TYPE_SHIFT);
 }
 
 void Object::DeInit(Runtime* rt) {
@@ -1150,7 +2890,9 @@ void String::DeInit(Runtime* rt) {
 }
 
 void Map::DeInit(Runtime* rt) {
+    this->array.DeInit(rt);
     this->entries.DeInit(rt);
+    Free<std::uint8_t>(rt, this->table, Integer{this->slotCount * SLOT_BYTES});
     Free<Map>(rt, this, Integer{1});
 }
 
@@ -1159,8 +2901,22 @@ void NativeFunction::DeInit(Runtime* rt) {
 }
 
 void Function::DeInit(Runtime* rt) {
+    #ifdef ESPRESSO_PROFILE
+    espresso::prof::ForgetFunction(this);
+    #endif
     this->byteCode.DeInit(rt);
     this->constants.DeInit(rt);
+    this->instructions.DeInit(rt);
+    this->globalCaches.DeInit(rt);
+    this->feedback.DeInit(rt);
+    this->assumptions.DeInit(rt);
+    this->deoptPoints.DeInit(rt);
+    this->deoptValues.DeInit(rt);
+    #ifdef ESPRESSO_JIT
+    if (this->machineCode != nullptr) {
+        espresso::jit::Release(this->machineCode, this->machineCodeSize);
+    }
+    #endif
     Free<Function>(rt, this, Integer{1});
 }
 
@@ -1177,6 +2933,13 @@ void Runtime::Mark(Object* obj) {
                 Value* constant = fn->ConstantAt(Integer{i});
                 Mark(constant);
             }
+            // a frame may still run the original of an optimized function
+            if (fn->GetOptimized() != nullptr) {
+                Mark(fn->GetOptimized());
+            }
+            if (fn->GetOriginal() != nullptr) {
+                Mark(fn->GetOriginal());
+            }
             break;
         }
         case ObjectType::NativeFunction: {
@@ -1243,6 +3006,15 @@ void Runtime::Mark(Value* val) {
 }
 
 void Runtime::Sweep() {
+    // feedback does not keep callees alive, so it lets go of them while
+    // the marks still tell which are about to be freed
+    for (Object* obj = this->heap; obj != nullptr; obj = obj->GetNext()) {
+        if (obj->IsMarked() && obj->Type() == ObjectType::Function) {
+            static_cast<Function*>(obj)->ForgetUnmarkedCallees();
+        }
+    }
+    this->SweepInterned();
+
     Object* prev = nullptr;
     Object* iter = this->heap;
 
@@ -1269,7 +3041,7 @@ void Runtime::Sweep() {
             #ifdef ESPRESSO_GC_DEBUG
             std::printf("[GC] Free(end) %p\n", (void*) obj);
             #endif
-            prev = nullptr;
+            prev->SetNext(nullptr);
         // 3. middle of heap
         } else if (obj != this->heap && next != nullptr) {
             // prev should never be null here because at some
@@ -1287,6 +3059,14 @@ void Runtime::Sweep() {
     }
 }
 
+bool Runtime::IsGcEnabled() const {
+    return this->gcEnabled;
+}
+
+void Runtime::SetGcEnabled(bool enabled) {
+    this->gcEnabled = enabled;
+}
+
 void Runtime::Gc() {
     if (!this->gcEnabled) {
         return;
@@ -1308,6 +3088,10 @@ void Runtime::Gc() {
     std::printf("[GC] Starting: bytes allocating %lld > next gc %lld\n", this->bytesAllocated.Unwrap(), this->nextGc.Unwrap());
     #endif
 
+    this->collections++;
+    prof::Span span{this, "gc", "Gc"};
+    ESPRESSO_PROBE2(gc__start, this->bytesAllocated.Unwrap(), this->collections);
+
     this->Mark(this->globals);
 
     this->Mark(this->loadPath);
@@ -1333,6 +3117,11 @@ void Runtime::Gc() {
 
     // std::printf("[GC] Done Marking Frames\n");
 
+    std::int64_t handlerCount = this->handlers.Length().Unwrap();
+    for (std::int64_t i = 0; i < handlerCount; i++) {
+        this->Mark(&this->handlers.At(Integer{i})->handler);
+    }
+
     this->Sweep();
 
     #ifdef ESPRESSO_GC_DEBUG
@@ -1343,6 +3132,8 @@ void Runtime::Gc() {
     if (this->nextGc.Unwrap() <= 0) {
         this->nextGc = Integer{128};
     }
+
+    ESPRESSO_PROBE2(gc__done, this->bytesAllocated.Unwrap(), this->nextGc.Unwrap());
 }
 
 
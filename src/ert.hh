@@ -3,6 +3,7 @@
 #include "edep.hh"
 #include "esys.hh"
 #include "espresso.hh"
+#include "eprof.hh"
 
 namespace espresso {
 
@@ -34,6 +35,25 @@ using Double = Numeric<double>;
 class Runtime;
 class Value;
 
+// Bounds checking policies for Vector, CallFrame and Runtime accessors.
+// Checked panics on an out of range index, Unchecked trusts the caller.
+struct Checked {
+    static constexpr bool IS_CHECKED = true;
+};
+
+struct Unchecked {
+    static constexpr bool IS_CHECKED = false;
+};
+
+// Policy for register and constant accesses made on behalf of a Function
+// that passed Function::Verify, which already proved them in range. Debug
+// (and sanitizer) builds keep the checks.
+#ifdef DEBUG_ENABLED
+using VerifiedPolicy = Checked;
+#else
+using VerifiedPolicy = Unchecked;
+#endif
+
 class PanicException : public std::exception {
 public:
     PanicException(const char* message_);
@@ -85,6 +105,7 @@ public:
 
     void Init(Integer stackBase, Integer argumentCount);
 
+    template<typename Policy = Checked>
     Value* At(Runtime* rt, Integer index);
 
     Integer AbsoluteIndex(Integer localNumber) const;
@@ -127,79 +148,114 @@ public:
     }
 
     void InitWithCapacity(Runtime* rt, Integer capacity) {
-        this->size = Integer{0};
-        this->capacity = capacity;
-        if (this->capacity.Unwrap() == 0) {
+        this->size = 0;
+        this->capacity = Fit(capacity.Unwrap());
+        if (this->capacity == 0) {
             this->data = nullptr;
         } else {
-            this->data = New<T>(rt, this->capacity);
+            this->data = New<T>(rt, capacity);
         }
     }
 
     void DeInit(Runtime* rt) {
-        Free<T>(rt, this->data, this->capacity);
+        Free<T>(rt, this->data, Integer{this->capacity});
     }
 
     T* Push(Runtime* rt) {
-        if (this->size.Unwrap() == this->capacity.Unwrap()) {
-            Integer newCapacity = Integer{this->capacity.Unwrap() * 2};
-            if (newCapacity.Unwrap() == 0) {
-                newCapacity = Integer{8};
+        if (this->size == this->capacity) {
+            std::int64_t newCapacity = std::int64_t{this->capacity} * 2;
+            if (newCapacity == 0) {
+                newCapacity = 8;
+            }
+            this->Grow(rt, newCapacity);
+        }
+        T* result = &this->data[this->size];
+        this->size++;
+        return result;
+    }
+
+    // Appends count uninitialized items and returns the first of them.
+    T* Extend(Runtime* rt, Integer count) {
+        std::int64_t newSize = std::int64_t{this->size} + count.Unwrap();
+        if (newSize > this->capacity) {
+            std::int64_t newCapacity = this->capacity == 0 ? 8 : this->capacity;
+            while (newCapacity < newSize) {
+                newCapacity *= 2;
             }
-            this->data = ReAllocate<T>(rt, this->data, this->capacity, newCapacity);
-            this->capacity = newCapacity;
+            this->Grow(rt, newCapacity);
         }
-        T* result = &this->data[this->size.Unwrap()];
-        this->size = Integer{this->size.Unwrap() + 1};
+        T* result = &this->data[this->size];
+        this->size = Fit(newSize);
         return result;
     }
 
     void Pop() {
-        if (this->size.Unwrap() <= 0) {
+        if (this->size == 0) {
             Panic("Pop Underflow");
             return;
         }
-        this->size = Integer{this->size.Unwrap() - 1};
+        this->size--;
     }
 
+    template<typename Policy = Checked>
     T* At(Integer index) const {
         std::int64_t val = index.Unwrap();
-        if (val >= size.Unwrap() || val < 0) {
-            Panic("IndexOutOfBounds");
-            return nullptr;
+        if constexpr (Policy::IS_CHECKED) {
+            if (val >= this->size || val < 0) {
+                Panic("IndexOutOfBounds");
+                return nullptr;
+            }
         }
         return &this->data[val];
     }
 
     Integer Length() const {
-        return this->size;
+        return Integer{this->size};
     }
 
     void Reserve(Runtime* rt, Integer capacity) {
-        if (this->capacity.Unwrap() >= capacity.Unwrap()) {
+        if (this->capacity >= capacity.Unwrap()) {
             return;
         }
-        this->data = ReAllocate<T>(rt, this->data, this->capacity, capacity);
-        this->capacity = capacity;
+        this->Grow(rt, capacity.Unwrap());
     }
 
     const T* RawHeadPointer() const {
         return this->data;
     }
 
+    T* RawHeadPointer() {
+        return this->data;
+    }
+
     void Truncate(Integer newLength) {
-        if (this->size.Unwrap() < newLength.Unwrap()) {
+        if (this->size < newLength.Unwrap()) {
             Panic("Truncate Underflow");
             return;
         }
-        this->size = newLength;
+        this->size = Fit(newLength.Unwrap());
     }
 
 private:
+    // lengths and capacities are 32 bits, which every vector the runtime
+    // makes fits in, and keeps strings and maps small
+    static std::uint32_t Fit(std::int64_t count) {
+        if (count < 0 || count > std::numeric_limits<std::uint32_t>::max()) {
+            Panic("Vector too large");
+            return 0;
+        }
+        return static_cast<std::uint32_t>(count);
+    }
+
+    void Grow(Runtime* rt, std::int64_t newCapacity) {
+        std::uint32_t fitted = Fit(newCapacity);
+        this->data = ReAllocate<T>(rt, this->data, Integer{this->capacity}, Integer{fitted});
+        this->capacity = fitted;
+    }
 
     T* data{nullptr};
-    Integer size{0};
-    Integer capacity{0};
+    std::uint32_t size{0};
+    std::uint32_t capacity{0};
 };
 
 enum class ValueType {
@@ -224,6 +280,8 @@ namespace bits {
     static constexpr uint32_t ARG2_SHIFT       = 8;
     static constexpr uint32_t ARG3_SHIFT       = 0;
     static constexpr uint32_t LARGE_ARG_SHIFT  = 0;
+    static constexpr uint32_t OP_SHIFT         = 24;
+    static constexpr uint32_t OP_TABLE_SIZE    = 32;
     static constexpr uint32_t OP_BITS          = 0b11111111000000000000000000000000;
     static constexpr uint32_t ARG1_BITS        = 0b00000000111111110000000000000000;
     static constexpr uint32_t ARG2_BITS        = 0b00000000000000001111111100000000;
@@ -234,11 +292,28 @@ namespace bits {
     static constexpr uint32_t OP_INVOKE        = 0b00000010000000000000000000000000;
     static constexpr uint32_t OP_RETURN        = 0b00000011000000000000000000000000;
     static constexpr uint32_t OP_COPY          = 0b00000100000000000000000000000000;
+    // quickened forms of InvokeGlobal and InvokeGlobalTail, only ever
+    // written by the interpreter and rejected by the verifier
+    static constexpr uint32_t OP_Q_EQUAL       = 0b00000101000000000000000000000000;
+    static constexpr uint32_t OP_Q_LT          = 0b00000110000000000000000000000000;
+    static constexpr uint32_t OP_Q_LTE         = 0b00000111000000000000000000000000;
+    static constexpr uint32_t OP_Q_GT          = 0b00001000000000000000000000000000;
+    static constexpr uint32_t OP_Q_GTE         = 0b00001001000000000000000000000000;
+    static constexpr uint32_t OP_Q_ADD         = 0b00001010000000000000000000000000;
+    static constexpr uint32_t OP_Q_SUB         = 0b00001011000000000000000000000000;
+    static constexpr uint32_t OP_Q_MULT        = 0b00001100000000000000000000000000;
+    static constexpr uint32_t OP_Q_DIV         = 0b00001101000000000000000000000000;
     static constexpr uint32_t OP_NOOP          = 0b00001110000000000000000000000000;
     static constexpr uint32_t OP_JUMPF         = 0b00001111000000000000000000000000;
     static constexpr uint32_t OP_JUMP          = 0b00010000000000000000000000000000;
     static constexpr uint32_t OP_STORE_G       = 0b00010001000000000000000000000000;
     static constexpr uint32_t OP_INVOKE_TAIL   = 0b00010010000000000000000000000000;
+    // only in functions built by the optimizer, rejected by the verifier
+    static constexpr uint32_t OP_GUARD         = 0b00010011000000000000000000000000;
+    // superinstructions, each replaces a sequence the compiler emits often
+    static constexpr uint32_t OP_LOAD_GLOBAL_C = 0b00010101000000000000000000000000;
+    static constexpr uint32_t OP_INVOKE_G      = 0b00010110000000000000000000000000;
+    static constexpr uint32_t OP_INVOKE_G_TAIL = 0b00010111000000000000000000000000;
 }
 
 enum class ByteCodeType : std::uint32_t {
@@ -252,13 +327,38 @@ enum class ByteCodeType : std::uint32_t {
     LoadGlobal = bits::OP_LOAD_GLOBAL,
     StoreGlobal = bits::OP_STORE_G,
     InvokeTail = bits::OP_INVOKE_TAIL,
+    // LoadConstant R, C followed by LoadGlobal R, R
+    LoadGlobalConstant = bits::OP_LOAD_GLOBAL_C,
+    // LoadGlobalConstant R, C followed by Invoke R, argc with C in arg3
+    InvokeGlobal = bits::OP_INVOKE_G,
+    // LoadGlobalConstant R, C followed by InvokeTail R, argc with C in arg3
+    InvokeGlobalTail = bits::OP_INVOKE_G_TAIL,
+    // InvokeGlobal(Tail) R, 3, C once C was seen to name an intrinsic
+    // native, arg3 is set for the tail form
+    QuickEqual = bits::OP_Q_EQUAL,
+    QuickLess = bits::OP_Q_LT,
+    QuickLessEqual = bits::OP_Q_LTE,
+    QuickGreater = bits::OP_Q_GT,
+    QuickGreaterEqual = bits::OP_Q_GTE,
+    QuickAdd = bits::OP_Q_ADD,
+    QuickSubtract = bits::OP_Q_SUB,
+    QuickMultiply = bits::OP_Q_MULT,
+    QuickDivide = bits::OP_Q_DIV,
+    // Deoptimizes to DeoptPoint cache of the original function once a
+    // global the optimized function assumes has been redefined
+    Guard = bits::OP_GUARD,
 };
 
+class Object;
 class NativeFunction;
 class Function;
 class String;
 class Map;
 
+constexpr std::uint8_t OpCode(ByteCodeType type) {
+    return static_cast<std::uint8_t>(static_cast<std::uint32_t>(type) >> bits::OP_SHIFT);
+}
+
 class ByteCode {
 public:
     ByteCode() = default;
@@ -285,6 +385,85 @@ private:
     uint32_t value;
 };
 
+// Execution form of a ByteCode. Function::Decode builds one for every
+// ByteCode with the operands already unpacked and the constants and jump
+// targets resolved to pointers, so the interpreter does no decoding.
+struct Instruction {
+    std::uint8_t opcode;
+    std::uint8_t arg1;
+    std::uint8_t arg2;
+    std::uint8_t arg3;
+    // index of the GlobalCache of instructions that load a global by
+    // constant, fills what would otherwise be padding
+    std::uint32_t cache;
+    union {
+        Value* constant;
+        Instruction* target;
+    } operand;
+};
+
+// Inline cache for a global load. The slot stays valid for as long as the
+// globals map reports the version it was resolved at.
+struct GlobalCache {
+    std::uint64_t version;
+    Value* slot;
+};
+
+// A set of ValueTypes, one bit each
+using TypeSet = std::uint16_t;
+
+constexpr TypeSet TypeBit(ValueType type) {
+    return static_cast<TypeSet>(1u << static_cast<std::uint32_t>(type));
+}
+
+enum class CalleeFeedback : std::uint8_t {
+    None,
+    Monomorphic,
+    Polymorphic,
+};
+
+// What the interpreter saw at one instruction, indexed like the
+// instructions. Invokes record their callees and the types of their
+// first arguments and results, JumpIfFalse how often it jumped. Quickened
+// instructions only record when they fall back to a generic invoke.
+struct Feedback {
+    static constexpr std::int64_t ARGUMENTS = 3;
+
+    // the arguments follow the callee
+    void RecordCall(Runtime* rt, Value* callee, std::int64_t count);
+
+    // while Monomorphic, the one callee seen. It does not keep the callee
+    // alive, see Function::ForgetUnmarkedCallees
+    Object* callee;
+    std::uint32_t jumped;
+    std::uint32_t fellThrough;
+    TypeSet arguments[ARGUMENTS];
+    TypeSet results;
+    CalleeFeedback callees;
+};
+
+// A global that an optimized function relies on keeping its value
+struct Assumption {
+    Value* name;
+    Value* value;
+};
+
+// Where a Guard resumes the original function: its program counter and
+// the DeoptValues that rebuild its live registers
+struct DeoptPoint {
+    std::int64_t pc;
+    std::int64_t first;
+    std::int64_t count;
+};
+
+// register reg of the original function, copied from register source of
+// the optimized one or, when not nullptr, from constant
+struct DeoptValue {
+    Value* constant;
+    std::uint8_t reg;
+    std::uint8_t source;
+};
+
 class Value {
 public:
     Value() = default;
@@ -297,6 +476,7 @@ public:
     Value& operator=(Value&&) = delete;
 
     void SetNil();
+    static void SetNil(Value* head, Integer count);
     void SetInteger(Integer value);
     void SetDouble(Double value);
     void SetFunction(Function* value);
@@ -309,6 +489,9 @@ public:
 
     bool Equals(Runtime* rt, Value* other) const;
 
+    // values that are Equals hash the same
+    std::uint64_t Hash(Runtime* rt) const;
+
     ValueType GetType() const;
     void AssertType(Runtime* rt, ValueType type) const;
     Integer GetInteger(Runtime* rt) const;
@@ -321,6 +504,34 @@ public:
 
     void Copy(Value* other);
 
+#ifdef ESPRESSO_NAN_BOXING
+    // the range of integers in this layout, which wrap around within it
+    static constexpr std::int64_t MIN_INTEGER = -(std::int64_t{1} << 47);
+    static constexpr std::int64_t MAX_INTEGER = (std::int64_t{1} << 47) - 1;
+
+private:
+    // A double, with the bits of its sign, exponent and quiet bit flipped,
+    // or below TAGGED a 48 bit payload under a 3 bit tag, which is the
+    // ValueType. Flipping the bits makes nil all zero bytes, and the tagged
+    // values are the negative quiet NaNs, which SetDouble never stores as
+    // it makes every NaN positive.
+    static constexpr std::uint64_t DOUBLE_FLIP = 0xFFF8000000000000;
+    static constexpr std::uint64_t TAGGED = std::uint64_t{1} << 51;
+    static constexpr std::uint32_t TAG_SHIFT = 48;
+    static constexpr std::uint64_t PAYLOAD_BITS = (std::uint64_t{1} << TAG_SHIFT) - 1;
+
+    void SetTagged(ValueType type, std::uint64_t payload);
+    std::uint64_t Payload() const;
+
+    std::uint64_t bits{0};
+};
+
+static_assert(sizeof(Value) == 8);
+#else
+    // where the fields sit, for code generated by the jit
+    static std::size_t TypeOffset();
+    static std::size_t PayloadOffset();
+
 private:
     ValueType type{ValueType::Nil};
     union {
@@ -332,6 +543,17 @@ private:
         Map* map;
     } as{Integer{0}};
 };
+#endif
+
+// Installed by try while its body runs. Until the frame at depth returns,
+// whatever is thrown is passed to handler, which is called at the absolute
+// stack index base, or in place of the frame when the try was a tail call.
+struct Handler {
+    std::int64_t depth;
+    std::int64_t base;
+    bool tail;
+    Value handler;
+};
 
 enum class ObjectType {
     String,
@@ -366,11 +588,38 @@ public:
     void SetNext(Object* next);
 
 private:
-    bool isMarked;
-    ObjectType type;
-    Object* next;
+    // objects are at least 8 byte aligned, which leaves the low bits of
+    // the pointer to the next object for the mark and the type
+    static constexpr std::uintptr_t MARK_BIT = 0b001;
+    static constexpr std::uintptr_t TYPE_BITS = 0b110;
+    static constexpr std::uint32_t TYPE_SHIFT = 1;
+    static constexpr std::uintptr_t NEXT_BITS = ~(MARK_BIT | TYPE_BITS);
+
+    std::uintptr_t header;
+};
+
+static_assert(sizeof(Object) == sizeof(void*));
+
+// How a Function runs. It is only verified when loaded, decoded when it is
+// first called and, once it is hot, optimized or in ESPRESSO_JIT builds
+// compiled.
+enum class Tier : std::uint8_t {
+    ByteCode,
+    Interpreted,
+    Optimized,
+    Compiled,
 };
 
+#ifdef ESPRESSO_JIT
+enum class JitState : std::uint8_t {
+    // not translated yet
+    Pending,
+    Compiled,
+    // uses something the jit cannot translate, stays interpreted
+    Unsupported,
+};
+#endif
+
 class Function : public Object {
 public:
     Function() = default;
@@ -388,6 +637,17 @@ public:
 
     ByteCode* ByteCodeAt(Integer index) const;
 
+    // mutable so the interpreter can quicken instructions in place
+    Instruction* InstructionHead();
+
+    GlobalCache* GlobalCacheHead();
+
+    // allocated along with the instructions, nullptr before
+    Feedback* FeedbackHead();
+
+    // called before a collection frees the objects that are not marked
+    void ForgetUnmarkedCallees();
+
     Value* ConstantAt(Integer index) const;
 
     void SetStack(Integer arity, Integer localCount);
@@ -408,13 +668,120 @@ public:
 
     Value* PushConstant(Runtime* rt);
 
-    void Verify(Runtime* rt) const;
+    void Verify(Runtime* rt);
+
+    bool IsVerified() const;
+
+    // builds the instructions of a verified function, once
+    void Decode(Runtime* rt);
+
+    Tier GetTier() const;
+
+    // calls and backward jumps needed for a function to be hot
+    static constexpr std::uint64_t HOT_INVOCATIONS = 1000;
+    static constexpr std::uint64_t HOT_BACK_EDGES = 1000;
+
+    // return true when the count makes the function hot
+    bool CountInvocation();
+    bool CountBackEdge();
+
+    std::uint64_t GetInvocationCount() const;
+    std::uint64_t GetBackEdgeCount() const;
+
+    // times a function may lose its optimized version before it is no
+    // longer optimized
+    static constexpr std::uint32_t MAX_DEOPTIMIZATIONS = 3;
+
+    // calls run the optimized version, if there is one, while the globals
+    // it assumes hold
+    Function* GetOptimized() const;
+
+    // the function an optimized version was made from, nullptr otherwise
+    Function* GetOriginal() const;
+
+    bool IsOptimizable() const;
+
+    // makes IsOptimizable false for good
+    void GiveUpOptimizing();
+
+    void SetOptimized(Runtime* rt, Function* optimized);
+
+    // the function is interpreted again and counts its way back up
+    void DropOptimized();
+
+    // of an optimized function, checks the globals only when some global
+    // that named a function has been redefined since it last looked
+    bool HoldsAssumptions(Runtime* rt);
+
+    // the optimizer builds instructions directly, see opt::Optimize
+    void ReserveInstructions(Runtime* rt, Integer capacity);
+
+    Instruction* PushInstruction(Runtime* rt);
+
+    std::uint32_t NewGlobalCache(Runtime* rt);
+
+    void PushAssumption(Runtime* rt, Value* name, Value* value);
+
+    DeoptPoint* PushDeoptPoint(Runtime* rt);
+
+    DeoptValue* PushDeoptValue(Runtime* rt);
+
+    DeoptPoint* DeoptPointAt(Integer index) const;
+
+    DeoptValue* DeoptValueAt(Integer index) const;
+
+    #ifdef ESPRESSO_JIT
+    JitState GetJitState() const;
+
+    void* GetMachineCode() const;
+
+    // takes ownership of the code, which is released with the function
+    void SetMachineCode(JitState state, void* code, std::size_t size);
+    #endif
 
 private:
+    void AllocateFeedback(Runtime* rt, Integer count);
+
     Integer arity{0};
     Integer localCount{0};
+    bool verified;
+    std::uint64_t invocations;
+    std::uint64_t backEdges;
+    std::uint32_t deoptimizations;
+    Function* optimized;
+    Function* original;
+    // Map::Redefinitions of the globals when the assumptions last held
+    std::uint64_t assumedAt;
     Vector<ByteCode> byteCode;
     Vector<Value> constants;
+    Vector<Instruction> instructions;
+    Vector<GlobalCache> globalCaches;
+    Vector<Feedback> feedback;
+    Vector<Assumption> assumptions;
+    Vector<DeoptPoint> deoptPoints;
+    Vector<DeoptValue> deoptValues;
+    #ifdef ESPRESSO_JIT
+    JitState jitState;
+    void* machineCode;
+    std::size_t machineCodeSize;
+    #endif
+};
+
+// Natives that the interpreter knows the meaning of, and may perform
+// without calling them once it has checked the callee.
+enum class Intrinsic : std::uint8_t {
+    None,
+    Equal,
+    Less,
+    LessEqual,
+    Greater,
+    GreaterEqual,
+    Add,
+    Subtract,
+    Multiply,
+    Divide,
+    Try,
+    Throw,
 };
 
 class NativeFunction : public Object {
@@ -440,12 +807,17 @@ public:
 
     Handle GetHandle() const;
 
+    Intrinsic GetIntrinsic() const;
+
+    void SetIntrinsic(Intrinsic intrinsic);
+
     void Verify(Runtime* rt) const;
 
 private:
     Integer arity{0};
     Integer localCount{0};
     Handle handle{nullptr};
+    Intrinsic intrinsic{Intrinsic::None};
 };
 
 class String : public Object {
@@ -465,6 +837,13 @@ public:
 
     bool Equals(String* other) const;
 
+    std::uint32_t Hash() const;
+
+    // see Runtime::InternString
+    bool IsInterned() const;
+
+    void Intern(std::uint32_t hash);
+
     Integer Length() const;
 
     char At(Integer index) const;
@@ -483,6 +862,9 @@ public:
 
 private:
     Vector<char> data;
+    // of an interned string, which cannot change
+    std::uint32_t hash;
+    bool interned;
 };
 
 class Map : public Object {
@@ -504,17 +886,33 @@ public:
 
     void Put(Runtime* rt, Value* key, Value* value);
 
+    // changes whenever a pointer returned by Get may have been invalidated,
+    // never 0
+    std::uint64_t Version() const;
+
+    // lets generated code check global caches without a call
+    const std::uint64_t* VersionAddress() const;
+
+    // changes whenever a key that held a function is given another value
+    std::uint64_t Redefinitions() const;
+
+    // Goes over the integer keys 0 up to the length of the array part in
+    // order, then the other keys in the order they were first put in. A
+    // key put out of order is among the others until a rehash moves it to
+    // the array part, which moves it to the front as well.
     class Iterator {
         public:
             bool HasNext();
-            Value* Key();
-            Value* Value();
+            espresso::Value* Key();
+            espresso::Value* Value();
         private:
             friend class Map;
             Iterator(const Map* map_, std::int64_t next_);
 
             const Map* map;
             std::int64_t next;
+            // the key of a value of the array part
+            espresso::Value key;
     };
 
     Iterator GetIterator() const;
@@ -526,7 +924,41 @@ private:
         Value value;
     };
 
+    // slots are probed a group at a time
+    static constexpr std::uint32_t GROUP_SIZE = 16;
+    // control byte of a slot that is not in use, in use ones hold the low
+    // 7 bits of the hash of their key
+    static constexpr std::uint8_t EMPTY = 0x80;
+    // a control byte and a slot
+    static constexpr std::int64_t SLOT_BYTES = 1 + sizeof(std::uint32_t);
+
+    Entry* Find(Runtime* rt, Value* key, std::uint64_t hash) const;
+
+    // puts index in the first empty slot of the probe sequence of hash
+    void Insert(std::uint32_t index, std::uint64_t hash);
+
+    // Moves the keys that continue the array part from the entries to
+    // it, then rebuilds the table with room for one more entry.
+    void Rehash(Runtime* rt);
+
+    // whether key is the integer the array part continues with
+    bool Continues(Runtime* rt, Value* key) const;
+
+    std::uint32_t* Slots() const;
+
+    // The values of the keys 0 up to its length, which are iterated
+    // first. A key joins it when it is put right after its end, or when
+    // the table is rebuilt. No key of the array part is in the entries.
+    Vector<Value> array;
+    // The other keys, iterated in the order they were put in. They are
+    // indexed by a Swiss table: slotCount control bytes followed by as
+    // many slots, each the index of an entry. A map without entries has
+    // no table.
     Vector<Entry> entries;
+    std::uint8_t* table;
+    std::uint32_t slotCount;
+    std::uint64_t version{1};
+    std::uint64_t redefinitions{0};
 };
 
 
@@ -544,11 +976,25 @@ public:
     Runtime(Runtime&&) = delete;
     Runtime& operator=(Runtime&&) = delete;
 
+    // calls through RawInvoke, wrapped in events when tracing
     void Invoke(Integer base, Integer argumentCount);
-    void InvokeTail(Integer base, Integer argumentCount);
 
-    void RawInvoke(Integer base, Integer argumentCount, bool inTailPosition);
+    void RawInvoke(Integer base, Integer argumentCount);
+
+    void PushFrame(Integer base, Integer argumentCount, Integer localCount);
+
+    void ReuseFrame(Integer base, Integer argumentCount, Integer localCount);
+
+    // moves a function that became hot to a faster tier, if there is one
+    void Promote(Function* fn);
 
+    // Replaces the optimized function running in the current frame by its
+    // original at the given DeoptPoint of the optimized function.
+    void Deoptimize(Integer point);
+
+    void PopFrame();
+
+    template<typename Policy = Checked>
     CallFrame* CurrentFrame();
 
     Integer FrameCount() const;
@@ -557,8 +1003,10 @@ public:
 
     System* GetSystem();
 
+    template<typename Policy = Checked>
     Value* StackAtAbsoluteIndex(Integer index);
 
+    template<typename Policy = Checked>
     Value* Local(Integer index);
 
     Function* NewFunction();
@@ -569,11 +1017,21 @@ public:
 
     String* NewString(const char* data, std::size_t givenLength);
 
+    // The string with these characters, made the first time they are
+    // asked for and the same one after that, for as long as it lives.
+    // Interned strings compare by pointer and must not change. The table
+    // they are in does not keep them alive.
+    String* InternString(const char* data);
+
+    String* InternString(const char* data, std::size_t givenLength);
+
     NativeFunction* NewNativeFunction(Integer arity, Integer localCount, NativeFunction::Handle handle);
 
     void Throw(Integer localNumber);
 
     void LoadGlobal(Integer destLocalNumber, Integer sourceLocalNumber);
+    void LoadGlobal(Integer destLocalNumber, Value* key);
+    void LoadGlobal(Integer destLocalNumber, Value* key, GlobalCache* cache);
 
     void LoadConstant(Integer destLocalNumber, Integer sourceConstantNumber);
 
@@ -597,6 +1055,31 @@ public:
 
     void Interpret();
 
+    // Runs the frames above entryDepth, first calling the handler at
+    // handlerBase when it is not negative. See Unwind.
+    void Resume(std::int64_t entryDepth, std::int64_t handlerBase, Function* handlerTail);
+
+    void PushHandler(Integer depth, Integer base, bool tail, Value* handler);
+
+    // drops the handlers of frames at depth and above
+    void PopHandlers(Integer depth);
+
+    // Unwinds to the innermost handler that belongs to frames above
+    // entryDepth and stages the call to it, returns false if there is none.
+    // A handler in tail position takes over the frame of the function
+    // left in handlerTail, which is nullptr for one called where try was.
+    bool Unwind(std::int64_t entryDepth, Integer errorIndex, std::int64_t* handlerBase, Function** handlerTail);
+
+    // Unwind for a throw that the loops run without calling the native,
+    // which fires the throw probe as Throw does
+    bool UnwindThrow(std::int64_t entryDepth, Integer errorIndex, std::int64_t* handlerBase, Function** handlerTail);
+
+    // what the function__entry and function__return probes give as the
+    // callee: functions as the one they were optimized from, and nullptr
+    // for values that cannot be called, such as an error that took the
+    // place of the callee
+    const Object* ProbedCallee(Value* callee);
+
     void* RawNew(Integer itemSize, Integer count);
 
     void* RawReAllocate(void* ptr, Integer itemSize, Integer prevCount, Integer newCount);
@@ -605,6 +1088,10 @@ public:
 
     void Gc();
 
+    // the optimizer holds pointers into objects while it allocates
+    bool IsGcEnabled() const;
+    void SetGcEnabled(bool enabled);
+
     void Mark();
 
     void Mark(Value* val);
@@ -617,25 +1104,82 @@ public:
 
     Map* GetGlobals() const;
 
+    // number of times the runtime has asked the system for new or larger
+    // memory, used to check that hot paths do not allocate
+    Integer AllocationCount() const;
+
+    // bytes the runtime has grown its memory by, whether freed since or
+    // not, and the most it has held at once
+    Integer TotalBytesAllocated() const;
+    Integer PeakBytesAllocated() const;
+
+    // number of collections so far, an object may have been freed and its
+    // address reused whenever it changes
+    std::uint64_t CollectionCount() const;
+
+    // Called where the frames and the stack are consistent: calls, back
+    // edges and returns from natives, which pass themselves. Takes the
+    // samples of the profiler.
+    void SafePoint(const NativeFunction* native = nullptr);
+
 private:
+    void TracedInvoke(Integer base, Integer argumentCount);
+
+    // Ends the calls of the frames at and above depth, which an error
+    // leaves behind, and drops them. Those at and above tracedDepth also
+    // end their events in the trace.
+    void AbandonFrames(Integer depth, Integer tracedDepth);
+
+    // adds an allocation of size bytes to the totals, after bytesAllocated
+    void CountBytes(std::int64_t size);
+
+    // drops the interned strings that are about to be freed
+    void SweepInterned();
+
+    // empties the slot of the intern table, moving back the strings that
+    // probed past it
+    void RemoveInterned(std::int64_t slot);
+
     System* system{nullptr};
     Vector<CallFrame> frames;
+    Vector<Handler> handlers;
+    // depth of the innermost handler, -1 without one
+    std::int64_t handlerDepth{-1};
     Vector<Value> stack;
     Map* globals{nullptr};
     Object* heap{nullptr};
     Integer bytesAllocated{0};
+    Integer allocationCount{0};
+    Integer totalBytesAllocated{0};
+    Integer peakBytesAllocated{0};
     Integer nextGc{0};
+    std::uint64_t collections{0};
+    #ifdef ESPRESSO_CACHE_DEBUG
+    std::int64_t globalCacheHits{0};
+    std::int64_t globalCacheMisses{0};
+    #endif
     String* loadPath{nullptr};
+    // The intern table, linearly probed from the hash of a string. It has
+    // a power of two many slots, nullptr when free, which are at most 3 in
+    // 4 full.
+    String** interned{nullptr};
+    std::int64_t internedSlots{0};
+    std::int64_t internedCount{0};
     bool gcEnabled{false};
 };
 
+// Runs a callable when the scope ends. The callable is held by value so
+// deferring never allocates.
+template<typename Handle>
 class Defer {
 public:
-    using Handle = std::function<void()>;
-
-    Defer(Handle fn);
+    Defer(Handle fn)
+    : handle{fn}
+    {}
 
-    ~Defer();
+    ~Defer() {
+        this->handle();
+    }
 
     Defer(const Defer&) = delete;
     Defer& operator=(const Defer&) = delete;
@@ -647,6 +1191,43 @@ private:
     Handle handle;
 };
 
+template<typename Policy>
+Value* CallFrame::At(Runtime* rt, Integer index) {
+    if constexpr (Policy::IS_CHECKED) {
+        if (index.Unwrap() >= this->stackSize.Unwrap() || index.Unwrap() < 0) {
+            Panic("Stack underflow");
+            return nullptr;
+        }
+    }
+
+    std::int64_t absoluteIndex = this->stackBase.Unwrap() + index.Unwrap();
+
+    return rt->StackAtAbsoluteIndex<Policy>(Integer{absoluteIndex});
+}
+
+template<typename Policy>
+CallFrame* Runtime::CurrentFrame() {
+    Integer length = frames.Length();
+    Integer last = Integer{length.Unwrap() - 1};
+    return frames.At<Policy>(last);
+}
+
+inline void Runtime::SafePoint(const NativeFunction* native) {
+    if (prof::pending != 0) {
+        prof::Sample(this, native);
+    }
+}
+
+template<typename Policy>
+Value* Runtime::StackAtAbsoluteIndex(Integer index) {
+    return this->stack.At<Policy>(index);
+}
+
+template<typename Policy>
+Value* Runtime::Local(Integer num) {
+    return CurrentFrame<Policy>()->template At<Policy>(this, num);
+}
+
 template<typename T>
 T* New(Runtime* rt, Integer count) {
     void* result = rt->RawNew(Integer{sizeof(T)}, count);
@@ -0,0 +1,88 @@
+#pragma once
+
+#include "edep.hh"
+
+// Statically defined tracepoints in the format of SystemTap's <sys/sdt.h>,
+// which bpftrace, perf and gdb find in the .note.stapsdt section of the
+// binary. A probe is a nop, and a note giving its address and where its
+// arguments are at that point. Tools attach by patching the nop, so a
+// probe nobody listens to costs the nop and getting its arguments into
+// registers.
+//
+// Only what espresso uses is here: up to three integer or pointer
+// arguments, on x86-64 and AArch64 Linux with GCC or Clang. Elsewhere, or
+// without ESPRESSO_USDT, probes compile to nothing.
+//
+//   bpftrace -e 'usdt:./build/espresso:espresso:gc__start { @[pid] = nsecs; }'
+
+#if defined(ESPRESSO_USDT) && defined(__linux__) && defined(__GNUC__) \
+    && (defined(__x86_64__) || defined(__aarch64__))
+
+namespace espresso {
+
+namespace sdt {
+
+// arguments are all described as signed 8 byte values
+inline std::int64_t Arg(std::int64_t value) {
+    return value;
+}
+
+template<typename T>
+std::int64_t Arg(T* pointer) {
+    return static_cast<std::int64_t>(reinterpret_cast<std::intptr_t>(pointer));
+}
+
+} // sdt
+
+} // espresso
+
+// the note of a probe at label 990, with the version 3 layout of sdt.h:
+// address, address of .stapsdt.base to detect prelinking, semaphore (none),
+// then provider, name and arguments as strings
+#define ESPRESSO_SDT_ASM(provider, name, args) \
+    "990: nop\n" \
+    ".pushsection .note.stapsdt,\"?\",\"note\"\n" \
+    ".balign 4\n" \
+    ".4byte 992f-991f, 994f-993f, 3\n" \
+    "991: .asciz \"stapsdt\"\n" \
+    "992: .balign 4\n" \
+    "993: .8byte 990b\n" \
+    ".8byte _.stapsdt.base\n" \
+    ".8byte 0\n" \
+    ".asciz \"" provider "\"\n" \
+    ".asciz \"" name "\"\n" \
+    ".asciz \"" args "\"\n" \
+    "994: .balign 4\n" \
+    ".popsection\n" \
+    ".ifndef _.stapsdt.base\n" \
+    ".pushsection .stapsdt.base,\"aG\",\"progbits\",.stapsdt.base,comdat\n" \
+    ".weak _.stapsdt.base\n" \
+    ".hidden _.stapsdt.base\n" \
+    "_.stapsdt.base: .space 1\n" \
+    ".size _.stapsdt.base, 1\n" \
+    ".popsection\n" \
+    ".endif\n"
+
+#define ESPRESSO_PROBE(name) \
+    __asm__ __volatile__(ESPRESSO_SDT_ASM("espresso", #name, "") :: )
+
+#define ESPRESSO_PROBE1(name, a) \
+    __asm__ __volatile__(ESPRESSO_SDT_ASM("espresso", #name, "-8@%0") \
+        :: "nor"(espresso::sdt::Arg(a)))
+
+#define ESPRESSO_PROBE2(name, a, b) \
+    __asm__ __volatile__(ESPRESSO_SDT_ASM("espresso", #name, "-8@%0 -8@%1") \
+        :: "nor"(espresso::sdt::Arg(a)), "nor"(espresso::sdt::Arg(b)))
+
+#define ESPRESSO_PROBE3(name, a, b, c) \
+    __asm__ __volatile__(ESPRESSO_SDT_ASM("espresso", #name, "-8@%0 -8@%1 -8@%2") \
+        :: "nor"(espresso::sdt::Arg(a)), "nor"(espresso::sdt::Arg(b)), "nor"(espresso::sdt::Arg(c)))
+
+#else
+
+#define ESPRESSO_PROBE(name)
+#define ESPRESSO_PROBE1(name, a)
+#define ESPRESSO_PROBE2(name, a, b)
+#define ESPRESSO_PROBE3(name, a, b, c)
+
+#endif
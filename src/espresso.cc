@@ -1,5 +1,6 @@
 #include "espresso.hh"
 #include "ert.hh"
+#include "eaot.hh"
 
 namespace espresso {
 
@@ -12,10 +13,32 @@ Espresso::Espresso(System* system, const char* loadPath) {
 Espresso::~Espresso() {
     Runtime* rt = static_cast<Runtime*>(this->impl);
     System* system = rt->GetSystem();
+    prof::Stop(rt);
+    prof::StopTrace(rt);
     rt->DeInit();
     system->ReAllocate(rt, sizeof(Runtime), 0);
 }
 
+bool Espresso::StartProfiler(const char* output) {
+    Runtime* rt = static_cast<Runtime*>(this->impl);
+    return prof::Start(rt, output, prof::DEFAULT_INTERVAL);
+}
+
+void Espresso::StopProfiler() {
+    Runtime* rt = static_cast<Runtime*>(this->impl);
+    prof::Stop(rt);
+}
+
+bool Espresso::StartTrace(const char* output) {
+    Runtime* rt = static_cast<Runtime*>(this->impl);
+    return prof::StartTrace(rt, output);
+}
+
+void Espresso::StopTrace() {
+    Runtime* rt = static_cast<Runtime*>(this->impl);
+    prof::StopTrace(rt);
+}
+
 static int unhandledException(Runtime* rt, const ThrowException& e) {
     rt->Local(Integer{2})->Copy(rt->StackAtAbsoluteIndex(e.GetAbsoluteStackIndex()));
 
@@ -56,4 +79,47 @@ int Espresso::Load(const char* name) {
     }
 }
 
+int Espresso::Translate(const char* name, const char* output) {
+    Runtime* rt = static_cast<Runtime*>(this->impl);
+    std::size_t length = std::strlen(name);
+    const char* suffix = ".espresso";
+    bool isSourceFile = length >= std::strlen(suffix)
+        && std::strcmp(name + length - std::strlen(suffix), suffix) == 0;
+    try {
+        // as load does, but the name is taken as given and the function is
+        // left in local 0 rather than run
+        rt->Local(Integer{0})->SetString(rt->NewString("readFile"));
+        rt->LoadGlobal(Integer{0}, Integer{0});
+        rt->Local(Integer{1})->SetString(rt->NewString(name));
+        rt->Invoke(Integer{0}, Integer{2});
+        rt->Copy(Integer{1}, Integer{0});
+
+        rt->Local(Integer{0})->SetString(rt->NewString(isSourceFile ? "compile" : "readByteCode"));
+        rt->LoadGlobal(Integer{0}, Integer{0});
+        rt->Invoke(Integer{0}, Integer{2});
+
+        rt->Copy(Integer{1}, Integer{0});
+        rt->Local(Integer{0})->SetString(rt->NewString("verifyByteCode"));
+        rt->LoadGlobal(Integer{0}, Integer{0});
+        rt->Invoke(Integer{0}, Integer{2});
+
+        aot::Translate(rt, name, output);
+        return 0;
+    } catch (const ThrowException& e) {
+        return unhandledException(rt, e);
+    }
+}
+
+int Espresso::Run(void (*main)(Runtime* rt)) {
+    Runtime* rt = static_cast<Runtime*>(this->impl);
+    // locals 1 and 2 hold the constants and the call of the program
+    rt->Local(Integer{0})->SetNativeFunction(rt->NewNativeFunction(Integer{1}, Integer{3}, main));
+    try {
+        rt->Invoke(Integer{0}, Integer{1});
+        return 0;
+    } catch (const ThrowException& e) {
+        return unhandledException(rt, e);
+    }
+}
+
 }
\ No newline at end of file
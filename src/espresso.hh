@@ -5,6 +5,8 @@
 
 namespace espresso {
 
+class Runtime;
+
 class Espresso {
 public:
     Espresso(System* system, const char* loadPath);
@@ -20,6 +22,26 @@ public:
 
     int Shell();
 
+    // writes C++ for the script to output, see espresso-aot
+    int Translate(const char* name, const char* output);
+
+    // runs the main of a program written by Translate
+    int Run(void (*main)(Runtime* rt));
+
+    // Samples the stacks of scripts run from here on, writing them to
+    // output as folded stacks on StopProfiler or destruction. Returns false
+    // if output cannot be written.
+    bool StartProfiler(const char* output);
+
+    void StopProfiler();
+
+    // Writes Chrome trace_event JSON of the calls, compiles and collections
+    // of scripts run from here on to output, completed on StopTrace or
+    // destruction. Returns false if output cannot be written.
+    bool StartTrace(const char* output);
+
+    void StopTrace();
+
 private:
     void* impl;
 };
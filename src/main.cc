@@ -1,11 +1,30 @@
 #include "espresso.hh"
 
+#include <cstdio>
+#include <cstring>
+
 int main(int argc, char** argv) {
 
     const char* fileName = nullptr;
+    // espresso --profile <output> writes folded stacks of the run, and
+    // espresso --trace <output> a Chrome trace of it
+    const char* profile = nullptr;
+    const char* trace = nullptr;
+
+    int next = 1;
+    while (next + 1 < argc) {
+        if (std::strcmp(argv[next], "--profile") == 0) {
+            profile = argv[next + 1];
+        } else if (std::strcmp(argv[next], "--trace") == 0) {
+            trace = argv[next + 1];
+        } else {
+            break;
+        }
+        next += 2;
+    }
 
-    if (argc >= 2) {
-        fileName = argv[1];
+    if (argc > next) {
+        fileName = argv[next];
     }
 
     const char* loadPath = ".";
@@ -13,9 +32,19 @@ int main(int argc, char** argv) {
     espresso::DefaultSystem system;
     espresso::Espresso espresso{&system, loadPath};
 
+    if (profile != nullptr && !espresso.StartProfiler(profile)) {
+        std::fprintf(stderr, "Cannot profile to %s\n", profile);
+        return 1;
+    }
+
+    if (trace != nullptr && !espresso.StartTrace(trace)) {
+        std::fprintf(stderr, "Cannot trace to %s\n", trace);
+        return 1;
+    }
+
     if (fileName != nullptr) {
         return espresso.Load(fileName);
     } else {
         return espresso.Shell();
     }
-}
\ No newline at end of file
+}
@@ -0,0 +1,274 @@
+#include "test.hh"
+
+#include <cstdlib>
+#include <initializer_list>
+
+// Map and the Swiss table that indexes its keys. The map is kept in local
+// 1, keys and values are made in locals 2 and 3.
+
+namespace espresso {
+
+namespace test {
+
+namespace {
+
+Map* NewRootedMap(Runtime* rt) {
+    rt->Local(Integer{1})->SetMap(rt->NewMap());
+    return rt->Local(Integer{1})->GetMap(rt);
+}
+
+// keys written as integers are integers, any other is a string
+Value* Key(Runtime* rt, const char* text) {
+    Value* key = rt->Local(Integer{2});
+    char* end = nullptr;
+    long long integer = std::strtoll(text, &end, 10);
+    if (*text != '\0' && *end == '\0') {
+        key->SetInteger(Integer{integer});
+    } else {
+        key->SetString(rt->NewString(text));
+    }
+    return key;
+}
+
+void Put(Runtime* rt, Map* map, const char* key, std::int64_t value) {
+    Value* k = Key(rt, key);
+    rt->Local(Integer{3})->SetInteger(Integer{value});
+    map->Put(rt, k, rt->Local(Integer{3}));
+}
+
+// the value of key, -1 when it is missing
+std::int64_t Get(Runtime* rt, Map* map, const char* key) {
+    Value* value = map->Get(rt, Key(rt, key));
+    return value == nullptr ? -1 : value->GetInteger(rt).Unwrap();
+}
+
+std::int64_t Count(Map* map) {
+    std::int64_t count = 0;
+    Map::Iterator iter = map->GetIterator();
+    while (iter.HasNext()) {
+        count++;
+    }
+    return count;
+}
+
+// whether the map iterates exactly these keys, in this order
+bool IteratesIn(Runtime* rt, Map* map, std::initializer_list<const char*> keys) {
+    Map::Iterator iter = map->GetIterator();
+    for (const char* key : keys) {
+        if (!iter.HasNext()) {
+            return false;
+        }
+        Value* actual = iter.Key();
+        if (!actual->Equals(rt, Key(rt, key))) {
+            return false;
+        }
+    }
+    return !iter.HasNext();
+}
+
+void OverwriteKeepsVersion(Runtime* rt) {
+    Map* map = NewRootedMap(rt);
+    Put(rt, map, "a", 1);
+    Put(rt, map, "b", 2);
+    std::uint64_t version = map->Version();
+    Put(rt, map, "a", 3);
+    CHECK(map->Version() == version);
+    CHECK(Get(rt, map, "a") == 3);
+    CHECK(Get(rt, map, "b") == 2);
+    CHECK(IteratesIn(rt, map, {"a", "b"}));
+}
+
+// from the first group of 16 slots to 8192 of them
+void GrowsAcrossRehashes(Runtime* rt) {
+    constexpr std::int64_t COUNT = 5000;
+    Map* map = NewRootedMap(rt);
+    char name[32];
+    for (std::int64_t i = 0; i < COUNT; i++) {
+        std::snprintf(name, sizeof(name), "key%lld", static_cast<long long>(i));
+        std::uint64_t version = map->Version();
+        Put(rt, map, name, i);
+        CHECK(map->Version() != version);
+    }
+    std::int64_t wrong = 0;
+    for (std::int64_t i = 0; i < COUNT; i++) {
+        std::snprintf(name, sizeof(name), "key%lld", static_cast<long long>(i));
+        wrong += Get(rt, map, name) != i;
+    }
+    CHECK(wrong == 0);
+    CHECK(Get(rt, map, "key") == -1);
+    CHECK(Count(map) == COUNT);
+}
+
+// keys that are equal are one key, whatever their bits
+void EqualKeysAreOneKey(Runtime* rt) {
+    Map* map = NewRootedMap(rt);
+    Value* key = rt->Local(Integer{2});
+    Value* value = rt->Local(Integer{3});
+
+    key->SetDouble(Double{0.0});
+    value->SetInteger(Integer{1});
+    map->Put(rt, key, value);
+    key->SetDouble(Double{-0.0});
+    CHECK(map->Get(rt, key) != nullptr && map->Get(rt, key)->GetInteger(rt).Unwrap() == 1);
+    value->SetInteger(Integer{2});
+    map->Put(rt, key, value);
+    key->SetDouble(Double{0.0});
+    CHECK(map->Get(rt, key) != nullptr && map->Get(rt, key)->GetInteger(rt).Unwrap() == 2);
+
+    key->SetString(rt->InternString("interned"));
+    value->SetInteger(Integer{3});
+    map->Put(rt, key, value);
+    key->SetString(rt->NewString("interned"));
+    CHECK(map->Get(rt, key) != nullptr && map->Get(rt, key)->GetInteger(rt).Unwrap() == 3);
+
+    key->SetString(rt->NewString("plain"));
+    value->SetInteger(Integer{4});
+    map->Put(rt, key, value);
+    key->SetString(rt->InternString("plain"));
+    CHECK(map->Get(rt, key) != nullptr && map->Get(rt, key)->GetInteger(rt).Unwrap() == 4);
+    value->SetInteger(Integer{5});
+    map->Put(rt, key, value);
+    CHECK(Get(rt, map, "plain") == 5);
+
+    CHECK(Count(map) == 3);
+}
+
+// the order keys were first put in, overwriting and growing the table
+// change nothing about it
+void IteratesInInsertionOrder(Runtime* rt) {
+    Map* map = NewRootedMap(rt);
+    Put(rt, map, "c", 1);
+    Put(rt, map, "a", 2);
+    Put(rt, map, "b", 3);
+    CHECK(IteratesIn(rt, map, {"c", "a", "b"}));
+    Put(rt, map, "a", 4);
+    CHECK(IteratesIn(rt, map, {"c", "a", "b"}));
+
+    constexpr std::int64_t COUNT = 100;
+    char name[32];
+    for (std::int64_t i = 0; i < COUNT; i++) {
+        std::snprintf(name, sizeof(name), "key%lld", static_cast<long long>(i));
+        Put(rt, map, name, i);
+    }
+    Map::Iterator iter = map->GetIterator();
+    std::int64_t wrong = 0;
+    for (const char* key : {"c", "a", "b"}) {
+        wrong += !iter.HasNext() || !iter.Key()->Equals(rt, Key(rt, key));
+    }
+    for (std::int64_t i = 0; i < COUNT; i++) {
+        std::snprintf(name, sizeof(name), "key%lld", static_cast<long long>(i));
+        wrong += !iter.HasNext() || !iter.Key()->Equals(rt, Key(rt, name));
+    }
+    CHECK(wrong == 0);
+    CHECK(!iter.HasNext());
+}
+
+// enough string keys to fill the first table and rebuild it
+void ForceRehash(Runtime* rt, Map* map) {
+    char name[32];
+    for (std::int64_t i = 0; i < 16; i++) {
+        std::snprintf(name, sizeof(name), "fill%lld", static_cast<long long>(i));
+        Put(rt, map, name, i);
+    }
+}
+
+// whether the next keys of iter are the ones ForceRehash puts
+bool NextAreFill(Runtime* rt, Map::Iterator* iter) {
+    char name[32];
+    for (std::int64_t i = 0; i < 16; i++) {
+        std::snprintf(name, sizeof(name), "fill%lld", static_cast<long long>(i));
+        if (!iter->HasNext() || !iter->Key()->Equals(rt, Key(rt, name))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// keys put out of order are in the table, after the array part, until a
+// rebuild moves them to it
+void ArrayKeysOutOfOrder(Runtime* rt) {
+    Map* map = NewRootedMap(rt);
+    Put(rt, map, "2", 2);
+    Put(rt, map, "1", 1);
+    Put(rt, map, "0", 0);
+    CHECK(IteratesIn(rt, map, {"0", "2", "1"}));
+    ForceRehash(rt, map);
+    CHECK(Get(rt, map, "0") == 0);
+    CHECK(Get(rt, map, "1") == 1);
+    CHECK(Get(rt, map, "2") == 2);
+    CHECK(Get(rt, map, "3") == -1);
+    Put(rt, map, "3", 3);
+    CHECK(Get(rt, map, "3") == 3);
+    CHECK(Count(map) == 20);
+
+    Map::Iterator iter = map->GetIterator();
+    for (const char* key : {"0", "1", "2", "3"}) {
+        CHECK(iter.HasNext() && iter.Key()->Equals(rt, Key(rt, key)));
+    }
+    CHECK(NextAreFill(rt, &iter));
+    CHECK(!iter.HasNext());
+}
+
+// the array part in index order, then the other keys in the order they
+// were first put in
+void ArrayKeysIterateFirst(Runtime* rt) {
+    Map* map = NewRootedMap(rt);
+    Put(rt, map, "a", 1);
+    Put(rt, map, "1", 2);
+    Put(rt, map, "0", 3);
+    CHECK(IteratesIn(rt, map, {"0", "a", "1"}));
+    ForceRehash(rt, map);
+    Put(rt, map, "2", 4);
+    Put(rt, map, "b", 5);
+
+    Map::Iterator iter = map->GetIterator();
+    for (const char* key : {"0", "1", "2", "a"}) {
+        CHECK(iter.HasNext() && iter.Key()->Equals(rt, Key(rt, key)));
+    }
+    CHECK(NextAreFill(rt, &iter));
+    CHECK(iter.HasNext() && iter.Key()->Equals(rt, Key(rt, "b")));
+    CHECK(!iter.HasNext());
+    CHECK(Get(rt, map, "0") == 3);
+    CHECK(Get(rt, map, "1") == 2);
+    CHECK(Get(rt, map, "2") == 4);
+}
+
+void ArrayKeyOverwriteKeepsVersion(Runtime* rt) {
+    Map* map = NewRootedMap(rt);
+    Put(rt, map, "0", 1);
+    Put(rt, map, "1", 2);
+    std::uint64_t version = map->Version();
+    Put(rt, map, "0", 3);
+    CHECK(map->Version() == version);
+    CHECK(Get(rt, map, "0") == 3);
+    CHECK(IteratesIn(rt, map, {"0", "1"}));
+
+    // and once the array part took it over from the table
+    Put(rt, map, "3", 4);
+    ForceRehash(rt, map);
+    Put(rt, map, "2", 5);
+    version = map->Version();
+    Put(rt, map, "3", 6);
+    Put(rt, map, "2", 7);
+    CHECK(map->Version() == version);
+    CHECK(Get(rt, map, "3") == 6);
+    CHECK(Get(rt, map, "2") == 7);
+}
+
+} // namespace
+
+const Test MAP_TESTS[] = {
+    {"map overwrite keeps the version", OverwriteKeepsVersion},
+    {"map grows across rehashes", GrowsAcrossRehashes},
+    {"map equal keys are one key", EqualKeysAreOneKey},
+    {"map iterates in insertion order", IteratesInInsertionOrder},
+    {"map array keys put out of order", ArrayKeysOutOfOrder},
+    {"map array keys iterate first", ArrayKeysIterateFirst},
+    {"map array key overwrite keeps the version", ArrayKeyOverwriteKeepsVersion},
+};
+
+const std::size_t MAP_TEST_COUNT = sizeof(MAP_TESTS) / sizeof(MAP_TESTS[0]);
+
+} // test
+
+} // espresso
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "ert.hh"
+
+#include <cstdio>
+
+// The tests of unittest. A test gets a runtime of its own, with the four
+// locals of the frame it starts with to keep what it allocates alive.
+
+namespace espresso {
+
+namespace test {
+
+struct Test {
+    const char* name;
+    void (*run)(Runtime* rt);
+};
+
+// checks that failed so far
+extern std::int64_t failures;
+
+// reports the check when it fails and carries on with the test
+#define CHECK(condition) \
+    if (!(condition)) { \
+        std::fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        espresso::test::failures++; \
+    }
+
+// see map.cc
+extern const Test MAP_TESTS[];
+extern const std::size_t MAP_TEST_COUNT;
+
+} // test
+
+} // espresso
@@ -0,0 +1,45 @@
+#include "test.hh"
+
+// unittest runs every test and prints ALL TESTS PASSED when no check
+// failed, which is what ctest looks for.
+
+namespace espresso {
+
+namespace test {
+
+std::int64_t failures = 0;
+
+} // test
+
+} // espresso
+
+namespace {
+
+using espresso::DefaultSystem;
+using espresso::Runtime;
+using espresso::test::Test;
+
+void RunTests(DefaultSystem* system, const Test* tests, std::size_t count) {
+    for (std::size_t i = 0; i < count; i++) {
+        std::int64_t before = espresso::test::failures;
+        Runtime* rt = static_cast<Runtime*>(system->ReAllocate(nullptr, 0, sizeof(Runtime)));
+        rt->Init(system, ".");
+        tests[i].run(rt);
+        rt->DeInit();
+        system->ReAllocate(rt, sizeof(Runtime), 0);
+        std::printf("%s %s\n", espresso::test::failures == before ? "ok  " : "FAIL", tests[i].name);
+    }
+}
+
+} // namespace
+
+int main() {
+    DefaultSystem system;
+    RunTests(&system, espresso::test::MAP_TESTS, espresso::test::MAP_TEST_COUNT);
+    if (espresso::test::failures != 0) {
+        std::printf("%lld checks failed\n", static_cast<long long>(espresso::test::failures));
+        return 1;
+    }
+    std::printf("ALL TESTS PASSED\n");
+    return 0;
+}